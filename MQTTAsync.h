@@ -27,6 +27,16 @@ namespace MQTT
 
 enum QoS { QOS0, QOS1, QOS2 };
 
+// why a connection was lost, as reported to the error handler
+enum ConnectionError
+{
+    NETWORK_ERROR = 1,      // a read or write failed, or the connection was closed by the server
+    PROTOCOL_ERROR,         // an invalid packet was received
+    PING_TIMEOUT,           // no ping response within the keepalive interval
+    RESPONSE_TIMEOUT,       // no response to a command within the command timeout
+    PACKET_TOO_LARGE        // a packet was too large for the read buffer
+};
+
 
 struct Message
 {
@@ -42,9 +52,15 @@ struct Message
 class PacketId
 {
 public:
-    PacketId();
+    PacketId()
+    {
+        next = 0;
+    }
     
-    int getNext();
+    int getNext()
+    {
+        return next = (next == MAX_PACKET_ID) ? 1 : next + 1;
+    }
    
 private:
     static const int MAX_PACKET_ID = 65535;
@@ -75,6 +91,11 @@ typedef struct limits
  * @brief non-blocking, threaded MQTT client API
  * @param Network a network class which supports send, receive
  * @param Timer a timer class with the methods: 
+ *     static void sleep_ms(int ms), with which the background thread waits while there is no connection
+ * @param Thread a thread class with the constructor Thread(void (*task)(void const*), void* argument), which
+ *     starts it, and join(), such as the mbed RTOS Thread or PosixThread.  One thread is started by the first
+ *     connect with a result handler, used for all later connects, and stopped by the destructor
+ * @param Mutex a mutex class with lock() and unlock()
  */ 
 template<class Network, class Timer, class Thread, class Mutex> class Async
 {
@@ -85,12 +106,31 @@ public:
 	{
     	/* success or failure result data */
     	Async<Network, Timer, Thread, Mutex>* client;
-		int rc;
+		int rc;               // 0 for success, the granted QoS for a subscribe, -1 for failure or timeout
+		unsigned short id;    // the packet id of the command which has completed
 	};
 
 	typedef void (*resultHandler)(Result*);	
    
     Async(Network* network, const Limits limits = Limits()); 
+
+    /** Buffers and tables for a client, sized at compile time, so that they can be static or part of
+     *  another object rather than allocated from the heap
+     */
+    template<int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int MAX_CONCURRENT_OPERATIONS>
+    struct Storage;
+
+    /** Construct a client which uses the caller's storage, and so allocates nothing from the heap at
+     *  construction.  The storage must outlive the client, and must not be shared with another client.
+     *  @param network - the network to use
+     *  @param storage - the buffers and tables, which set the limits of the client
+     *  @param command_timeout_ms - the time allowed for each command to complete
+     */
+    template<int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int MAX_CONCURRENT_OPERATIONS>
+    Async(Network* network, Storage<MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, MAX_CONCURRENT_OPERATIONS>& storage,
+          int command_timeout_ms = 30000);
+
+    ~Async();
         
     typedef struct
     {
@@ -99,6 +139,8 @@ public:
     } connectionLostInfo;
     
     typedef int (*connectionLostHandlers)(connectionLostInfo*);
+
+    typedef void (*errorHandler)(ConnectionError error);
     
     /** Set the connection lost callback - called whenever the connection is lost and we should be connected
      *  @param clh - pointer to the callback function
@@ -107,6 +149,26 @@ public:
     {
         connectionLostHandler.attach(clh);
     }
+
+    /** Set the callback for a failure which loses the connection, called before the connection lost
+     *  callback with the reason.  Commands in progress are completed with a failure result first.
+     *  @param eh - pointer to the callback function
+     */
+    void setErrorHandler(errorHandler eh)
+    {
+        connectionErrorHandler.attach(eh);
+    }
+
+    /** Set a member function as the callback for a failure which loses the connection, so that an
+     *  application with many connections can tell which one failed.
+     *  @param object - the object to call the method on
+     *  @param method - the method
+     */
+    template<class T>
+    void setErrorHandler(T* object, void (T::*method)(ConnectionError))
+    {
+        connectionErrorHandler.attach(object, method);
+    }
     
     /** Set the default message handling callback - used for any message which does not match a subscription message handler
      *  @param mh - pointer to the callback function
@@ -136,23 +198,36 @@ private:
     int waitfor(int packet_type, Timer& atimer);
 	int keepalive();
 	int findFreeOperation();
+	int registerOperation(resultHandler rh, int packet_type, unsigned short id, const char* topic = 0,
+	                      Message* message = 0, messageHandler mh = 0);
+	void releaseOperation(int index);
+	void completeOperation(int packet_type, unsigned short id, int rc);
+	void checkOperationTimeouts(bool all = false);
+	void connectionLost(ConnectionError error);
+	int addMessageHandler(const char* topicFilter, messageHandler mh);
+	void removeMessageHandler(const char* topicFilter);
 
     int decodePacket(int* value, int timeout);
     int readPacket(int timeout);
     int sendPacket(int length, int timeout);
 	int deliverMessage(MQTTString* topic, Message* message);
+	void init();
     
     Thread* thread;
+    volatile bool stopping;     // tells the background thread to return
     Network* ipstack;
     
     Limits limits;
     
-    char* buf;  
-    char* readbuf;
+    unsigned char* buf;  
+    unsigned char* readbuf;
+    bool ownsStorage;    // whether the buffers and tables were allocated by the constructor
+    Mutex mutex;         // guards buf, the operations and the message handlers against concurrent use
 
     Timer ping_timer, connect_timer;
     unsigned int keepAliveInterval;
 	bool ping_outstanding;
+	bool isconnected;
     
     PacketId packetid;
     
@@ -170,19 +245,35 @@ private:
     struct Operations
     {
     	unsigned short id;
+    	int type;            // the packet type which completes the command
     	resultHandlerFP fp;
     	const char* topic;         // if this is a publish, store topic name in case republishing is required
     	Message* message;    // for publish, 
+    	messageHandler mh;   // for subscribe, the message handler to set when the suback arrives
     	Timer timer;         // to check if the command has timed out
     } *operations;           // result handlers are indexed by packet ids
 
 	static void threadfn(void* arg);
+	static const int STOP_CHECK_MS = 1000;
+	static const int IDLE_CHECK_MS = 50;       // how soon the idle background thread notices a new connect
 	
 	messageHandlerFP defaultMessageHandler;
     
     typedef FP<int, connectionLostInfo*> connectionLostFP;
     
     connectionLostFP connectionLostHandler;
+    FP<void, ConnectionError> connectionErrorHandler;
+
+public:
+
+    template<int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int MAX_CONCURRENT_OPERATIONS>
+    struct Storage
+    {
+    	unsigned char buf[MAX_MQTT_PACKET_SIZE];
+    	unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+    	struct MessageHandlers messageHandlers[MAX_MESSAGE_HANDLERS];
+    	struct Operations operations[MAX_CONCURRENT_OPERATIONS];
+    };
     
 };
 
@@ -197,18 +288,65 @@ template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async
 
 template<class Network, class Timer, class Thread, class Mutex> MQTT::Async<Network, Timer, Thread, Mutex>::Async(Network* network, Limits limits)  : limits(limits), packetid()
 {
-	this->thread = 0;
 	this->ipstack = network;
-	this->ping_timer = Timer();
-	this->ping_outstanding = 0;
 	   
-	// How to make these memory allocations portable?  I was hoping to avoid the heap
-	buf = new char[limits.MAX_MQTT_PACKET_SIZE];
-	readbuf = new char[limits.MAX_MQTT_PACKET_SIZE];
+	// sizes known only at run time - use the Storage constructor to avoid the heap
+	buf = new unsigned char[limits.MAX_MQTT_PACKET_SIZE];
+	readbuf = new unsigned char[limits.MAX_MQTT_PACKET_SIZE];
 	this->operations = new struct Operations[limits.MAX_CONCURRENT_OPERATIONS];
+	this->messageHandlers = new struct MessageHandlers[limits.MAX_MESSAGE_HANDLERS];
+	ownsStorage = true;
+	init();
+}
+
+
+template<class Network, class Timer, class Thread, class Mutex>
+template<int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int MAX_CONCURRENT_OPERATIONS>
+MQTT::Async<Network, Timer, Thread, Mutex>::Async(Network* network,
+    Storage<MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, MAX_CONCURRENT_OPERATIONS>& storage, int command_timeout_ms)  : packetid()
+{
+	this->ipstack = network;
+	limits.MAX_MQTT_PACKET_SIZE = MAX_MQTT_PACKET_SIZE;
+	limits.MAX_MESSAGE_HANDLERS = MAX_MESSAGE_HANDLERS;
+	limits.MAX_CONCURRENT_OPERATIONS = MAX_CONCURRENT_OPERATIONS;
+	limits.command_timeout_ms = command_timeout_ms;
+
+	buf = storage.buf;
+	readbuf = storage.readbuf;
+	this->operations = storage.operations;
+	this->messageHandlers = storage.messageHandlers;
+	ownsStorage = false;
+	init();
+}
+
+
+template<class Network, class Timer, class Thread, class Mutex> MQTT::Async<Network, Timer, Thread, Mutex>::~Async()
+{
+	if (thread)
+	{
+		stopping = true;
+		thread->join();
+		delete thread;
+	}
+	if (ownsStorage)
+	{
+		delete[] buf;
+		delete[] readbuf;
+		delete[] operations;
+		delete[] messageHandlers;
+	}
+}
+
+
+template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async<Network, Timer, Thread, Mutex>::init()
+{
+	this->thread = 0;
+	this->stopping = false;
+	this->ping_timer = Timer();
+	this->ping_outstanding = 0;
+	this->isconnected = false;
 	for (int i = 0; i < limits.MAX_CONCURRENT_OPERATIONS; ++i)
 		operations[i].id = 0;
-	this->messageHandlers = new struct MessageHandlers[limits.MAX_MESSAGE_HANDLERS];
 	for (int i = 0; i < limits.MAX_MESSAGE_HANDLERS; ++i)
 		messageHandlers[i].topic = 0;
 }
@@ -219,7 +357,12 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
     int sent = 0;
     
     while (sent < length)
-        sent += ipstack->write(&buf[sent], length, timeout);
+    {
+        int rc = ipstack->write(&buf[sent], length - sent, timeout);
+        if (rc <= 0)  // there was an error writing the data, or we timed out
+            break;
+        sent += rc;
+    }
 	if (sent == length)
 	    ping_timer.countdown(this->keepAliveInterval); // record the fact that we have successfully sent the packet    
     return sent;
@@ -228,7 +371,7 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
 
 template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::decodePacket(int* value, int timeout)
 {
-    char c;
+    unsigned char c;
     int multiplier = 1;
     int len = 0;
 	const int MAX_NO_OF_REMAINING_LENGTH_BYTES = 4;
@@ -258,7 +401,7 @@ exit:
  * If any read fails in this method, then we should disconnect from the network, as on reconnect
  * the packets can be retried. 
  * @param timeout the max time to wait for the packet read to complete, in milliseconds
- * @return the MQTT packet type, or -1 if none
+ * @return the MQTT packet type, 0 if none arrived, -2 if it was too large, or -1 on failure
  */
 template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::readPacket(int timeout) 
 {
@@ -268,13 +411,21 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
     int rem_len = 0;
 
     /* 1. read the header byte.  This has the packet type in it */
-    if (ipstack->read(readbuf, 1, timeout) != 1)
+    if ((len = ipstack->read(readbuf, 1, timeout)) != 1)
+    {
+        if (len == 0)
+            rc = 0;   // nothing arrived
         goto exit;
+    }
 
-    len = 1;
     /* 2. read the remaining length.  This is variable in itself */
     decodePacket(&rem_len, timeout);
     len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length back into the buffer */
+    if (rem_len > limits.MAX_MQTT_PACKET_SIZE - len)
+    {
+        rc = -2;    // too large for the read buffer
+        goto exit;
+    }
 
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
     if (ipstack->read(readbuf + len, rem_len, timeout) != rem_len)
@@ -290,22 +441,62 @@ exit:
 template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::deliverMessage(MQTTString* topic, Message* message)
 {
 	int rc = -1;
+	messageHandlerFP fp;
 
 	// we have to find the right message handler - indexed by topic
+	mutex.lock();
 	for (int i = 0; i < limits.MAX_MESSAGE_HANDLERS; ++i)
 	{
 		if (messageHandlers[i].topic != 0 && MQTTPacket_equals(topic, (char*)messageHandlers[i].topic))
 		{
-			messageHandlers[i].fp(message);
+			fp = messageHandlers[i].fp;
 			rc = 0;
 			break;
 		}
 	}
+	mutex.unlock();
 	
+	if (rc == 0)
+		fp(message);
+	return rc;
+}
+
+
+template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::addMessageHandler(const char* topicFilter, messageHandler mh)
+{
+	int rc = -1;
+
+	mutex.lock();
+	for (int i = 0; i < limits.MAX_MESSAGE_HANDLERS; ++i)
+	{
+		if (messageHandlers[i].topic == 0)
+		{
+			messageHandlers[i].topic = topicFilter;
+			messageHandlers[i].fp.attach(mh);
+			rc = 0;
+			break;
+		}
+	}
+	mutex.unlock();
 	return rc;
 }
 
 
+template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async<Network, Timer, Thread, Mutex>::removeMessageHandler(const char* topicFilter)
+{
+	mutex.lock();
+	for (int i = 0; i < limits.MAX_MESSAGE_HANDLERS; ++i)
+	{
+		if (messageHandlers[i].topic != 0 && strcmp(messageHandlers[i].topic, topicFilter) == 0)
+		{
+			messageHandlers[i].topic = 0;
+			messageHandlers[i].fp.detach();
+		}
+	}
+	mutex.unlock();
+}
+
+
 
 template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::cycle(int timeout)
 {
@@ -315,54 +506,99 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
     int packet_type = readPacket(timeout);
     
 	int len, rc;
+	unsigned short mypacketid;
+	unsigned char type, dup;
+	if (packet_type < 0)
+	{
+		connectionLost((packet_type == -2) ? PACKET_TOO_LARGE : NETWORK_ERROR);
+		goto exit;
+	}
     switch (packet_type)
     {
         case CONNACK:
 			if (this->thread)
 			{
-				Result res = {this, 0};
-            	if (MQTTDeserialize_connack(&res.rc, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
-                	;
+				Result res = {this, -1, 0};
+				unsigned char sessionPresent, connack_rc;
+            	if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
+                	res.rc = connack_rc;
+				isconnected = (res.rc == 0);
 				connectHandler(&res);
 				connectHandler.detach(); // only invoke the callback once
 			}
 			break;
         case PUBACK:
-        	if (this->thread)
-        		; //call resultHandler
+        case PUBCOMP:
+        	if (this->thread && MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
+        		completeOperation(packet_type, mypacketid, 0);
+        	break;
         case SUBACK:
+        	if (this->thread)
+        	{
+        		int count = 0, grantedQoS = -1;
+        		if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
+        			completeOperation(packet_type, mypacketid, grantedQoS);
+        	}
             break;
+        case UNSUBACK:
+        	if (this->thread && MQTTDeserialize_unsuback(&mypacketid, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
+        		completeOperation(packet_type, mypacketid, 0);
+        	break;
         case PUBLISH:
 			MQTTString topicName;
 			Message msg;
-			rc = MQTTDeserialize_publish((int*)&msg.dup, (int*)&msg.qos, (int*)&msg.retained, (int*)&msg.id, &topicName,
-								 (char**)&msg.payload, (int*)&msg.payloadlen, readbuf, limits.MAX_MQTT_PACKET_SIZE);;
+			int intQoS;
+			rc = MQTTDeserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, &msg.id, &topicName,
+								 (unsigned char**)&msg.payload, (int*)&msg.payloadlen, readbuf, limits.MAX_MQTT_PACKET_SIZE);
+			msg.qos = (enum QoS)intQoS;
 			if (msg.qos == QOS0)
 				deliverMessage(&topicName, &msg);
             break;
         case PUBREC:
-   	        int type, dup, mypacketid;
-   	        if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
-   	            ; 
+   	        if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, limits.MAX_MQTT_PACKET_SIZE) != 1)
+   	            break; 
    	        // must lock this access against the application thread, if we are multi-threaded
+   	        mutex.lock();
 			len = MQTTSerialize_ack(buf, limits.MAX_MQTT_PACKET_SIZE, PUBREL, 0, mypacketid);
 		    rc = sendPacket(len, timeout); // send the PUBREL packet
+		    mutex.unlock();
 			if (rc != len) 
+			{
+				connectionLost(NETWORK_ERROR);
 				goto exit; // there was a problem
-
-            break;
-        case PUBCOMP:
+			}
             break;
         case PINGRESP:
 			ping_outstanding = false;
             break;
     }
-	keepalive();
+	if (keepalive() != 0)
+		connectionLost(ping_outstanding ? PING_TIMEOUT : NETWORK_ERROR);
+	else if (this->thread)
+		checkOperationTimeouts();
 exit:
     return packet_type;
 }
 
 
+// report the loss of the connection, once, after failing any commands in progress
+template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async<Network, Timer, Thread, Mutex>::connectionLost(ConnectionError error)
+{
+	if (!isconnected)
+		return;
+	isconnected = false;
+	ping_outstanding = false;
+	checkOperationTimeouts(true);
+	if (connectionErrorHandler.attached())
+		connectionErrorHandler(error);
+	if (connectionLostHandler.attached())
+	{
+		connectionLostInfo info = {this, ipstack};
+		connectionLostHandler(&info);
+	}
+}
+
+
 template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::keepalive()
 {
 	int rc = 0;
@@ -376,8 +612,10 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
 			rc = -1;
 		else
 		{
+			mutex.lock();
 			int len = MQTTSerialize_pingreq(buf, limits.MAX_MQTT_PACKET_SIZE);
 			rc = sendPacket(len, 1000); // send the ping packet
+			mutex.unlock();
 			if (rc != len) 
 				rc = -1; // indicate there's a problem
 			else
@@ -390,10 +628,32 @@ exit:
 }
 
 
-template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async<Network, Timer, Thread, Mutex>::run(void const *argument)
+template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async<Network, Timer, Thread, Mutex>::run(void const *)
 {
-	while (true)
-		cycle(ping_timer.left_ms());
+	while (!stopping)
+	{
+		if (!isconnected && !connectHandler.attached())
+		{
+			// nothing to read until the next connect with a result handler, or a blocking connect reads for itself
+			Timer::sleep_ms(IDLE_CHECK_MS);
+			continue;
+		}
+
+		int timeout = ping_timer.left_ms();
+
+		if (timeout > STOP_CHECK_MS || keepAliveInterval == 0)
+			timeout = STOP_CHECK_MS;    // so that the destructor doesn't wait long for the thread to stop
+
+		// wake in time to report any commands which are going to time out
+		mutex.lock();
+		for (int i = 0; i < limits.MAX_CONCURRENT_OPERATIONS; ++i)
+		{
+			if (operations[i].id != 0 && operations[i].timer.left_ms() < timeout)
+				timeout = operations[i].timer.left_ms();
+		}
+		mutex.unlock();
+		cycle(timeout > 0 ? timeout : 0);
+	}
 }
 
 
@@ -407,7 +667,7 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
 		if (atimer.expired()) 
 			break; // we timed out
 	}
-	while ((rc = cycle(atimer.left_ms())) != packet_type);	
+	while ((rc = cycle(atimer.left_ms())) != packet_type && rc >= 0);	
 	
 	return rc;
 }
@@ -415,7 +675,7 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
 
 template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::connect(resultHandler resultHandler, MQTTPacket_connectData* options)
 {
-	connect_timer.countdown(limits.command_timeout_ms);
+	connect_timer.countdown_ms(limits.command_timeout_ms);
 
     MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
     if (options == 0)
@@ -423,8 +683,22 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
     
     this->keepAliveInterval = options->keepAliveInterval;
 	ping_timer.countdown(this->keepAliveInterval);
+    if (resultHandler != 0)
+    {
+        // set connect response callback function, before the connack can arrive
+        mutex.lock();
+        connectHandler.attach(resultHandler);
+        mutex.unlock();
+        
+        // start the background thread, the first time.  After that it is still running, and reads the connack
+        if (this->thread == 0)
+            this->thread = new Thread((void (*)(void const *argument))&MQTT::Async<Network, Timer, Thread, Mutex>::threadfn, (void*)this);
+    }
+
+    mutex.lock();
     int len = MQTTSerialize_connect(buf, limits.MAX_MQTT_PACKET_SIZE, options);
     int rc = sendPacket(len, connect_timer.left_ms()); // send the connect packet
+    mutex.unlock();
 	if (rc != len) 
 		goto exit; // there was a problem
     
@@ -433,19 +707,13 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
         // this will be a blocking call, wait for the connack
 		if (waitfor(CONNACK, connect_timer) == CONNACK)
 		{
-        	int connack_rc = -1;
-        	if (MQTTDeserialize_connack(&connack_rc, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
+        	unsigned char sessionPresent, connack_rc;
+        	rc = -1;
+        	if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
 	        	rc = connack_rc;
+	        isconnected = (rc == 0);
 	    }
     }
-    else
-    {
-        // set connect response callback function
-        connectHandler.attach(resultHandler);
-        
-        // start background thread            
-        this->thread = new Thread((void (*)(void const *argument))&MQTT::Async<Network, Timer, Thread, Mutex>::threadfn, (void*)this);
-    }
     
 exit:
     return rc;
@@ -467,75 +735,193 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
 }
 
 
+// reserve an operation slot, before the command is sent, so that the response can't arrive first
+template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::registerOperation(resultHandler rh,
+    int packet_type, unsigned short id, const char* topic, Message* message, messageHandler mh)
+{
+	mutex.lock();
+	int index = findFreeOperation();
+	if (index >= 0)
+	{
+		operations[index].id = id;
+		operations[index].type = packet_type;
+		operations[index].fp.attach(rh);
+		operations[index].topic = topic;
+		operations[index].message = message;
+		operations[index].mh = mh;
+		operations[index].timer.countdown_ms(limits.command_timeout_ms);
+	}
+	mutex.unlock();
+	return index;
+}
+
+
+// free the slot of a command which failed before it got going
+template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async<Network, Timer, Thread, Mutex>::releaseOperation(int index)
+{
+	mutex.lock();
+	operations[index].id = 0;
+	mutex.unlock();
+}
+
+
+// called from the background thread when the response to a command arrives
+template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async<Network, Timer, Thread, Mutex>::completeOperation(int packet_type, unsigned short id, int rc)
+{
+	resultHandlerFP fp;
+	const char* topic = 0;
+	messageHandler mh = 0;
+	bool found = false;
+
+	mutex.lock();
+	for (int i = 0; i < limits.MAX_CONCURRENT_OPERATIONS; ++i)
+	{
+		if (operations[i].id == id && operations[i].type == packet_type)
+		{
+			fp = operations[i].fp;
+			topic = operations[i].topic;
+			mh = operations[i].mh;
+			operations[i].id = 0;  // free the slot before the callback, so it can be reused from there
+			found = true;
+			break;
+		}
+	}
+	mutex.unlock();
+
+	if (!found)
+		return;
+	if (packet_type == SUBACK && rc != 0x80)
+	{
+		if (addMessageHandler(topic, mh) != 0)
+			rc = -1;
+	}
+	else if (packet_type == UNSUBACK)
+		removeMessageHandler(topic);
+	Result res = {this, rc, id};
+	if (fp.attached())
+		fp(&res);
+}
+
+
+// fail the commands which have timed out, or all of them if the connection has been lost
+template<class Network, class Timer, class Thread, class Mutex> void MQTT::Async<Network, Timer, Thread, Mutex>::checkOperationTimeouts(bool all)
+{
+	for (int i = 0; i < limits.MAX_CONCURRENT_OPERATIONS; ++i)
+	{
+		resultHandlerFP fp;
+		unsigned short id = 0;
+
+		mutex.lock();
+		if (operations[i].id != 0 && (all || operations[i].timer.expired()))
+		{
+			fp = operations[i].fp;
+			id = operations[i].id;
+			operations[i].id = 0;
+		}
+		mutex.unlock();
+
+		if (id != 0 && fp.attached())
+		{
+			Result res = {this, -1, id};
+			fp(&res);
+		}
+	}
+}
+
+
 template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::subscribe(resultHandler resultHandler, const char* topicFilter, enum QoS qos, messageHandler messageHandler)
 {
-	int index = 0;
-	if (this->thread)
-		index = findFreeOperation();	
-	Timer& atimer = operations[index].timer;
-	
-	atimer.countdown(limits.command_timeout_ms);
-    MQTTString topic = {(char*)topicFilter, 0, 0};
+	int index = -1;
+	Timer atimer(limits.command_timeout_ms);
+    MQTTString topic = {(char*)topicFilter, {0, 0}};
     
-    int len = MQTTSerialize_subscribe(buf, limits.MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic, (int*)&qos);
+    mutex.lock();
+    unsigned short id = packetid.getNext();
+    mutex.unlock();
+	if (this->thread && resultHandler != 0)
+	{
+		// set subscribe response callback function
+		if ((index = registerOperation(resultHandler, SUBACK, id, topicFilter, 0, messageHandler)) < 0)
+			return -1; // too many commands in progress
+	}
+
+    mutex.lock();
+    int len = MQTTSerialize_subscribe(buf, limits.MAX_MQTT_PACKET_SIZE, 0, id, 1, &topic, (int*)&qos);
     int rc = sendPacket(len, atimer.left_ms()); // send the subscribe packet
+    mutex.unlock();
 	if (rc != len) 
+	{
+		rc = -1;
 		goto exit; // there was a problem
+	}
     
     /* wait for suback */
-    if (resultHandler == 0)
+    if (this->thread == 0)
     {
         // this will block
+        rc = -1;
         if (waitfor(SUBACK, atimer) == SUBACK)
         {
-            int count = 0, grantedQoS = -1, mypacketid;
+            int count = 0, grantedQoS = -1;
+            unsigned short mypacketid;
             if (MQTTDeserialize_suback(&mypacketid, 1, &count, &grantedQoS, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
                 rc = grantedQoS; // 0, 1, 2 or 0x80 
             if (rc != 0x80)
-            {
-            	for (int i = 0; i < limits.MAX_MESSAGE_HANDLERS; ++i)
-				{
-					if (messageHandlers[i].topic == 0)
-					{
-						messageHandlers[i].topic = topicFilter;
-						messageHandlers[i].fp.attach(messageHandler);
-						rc = 0;
-						break;
-					}
-				}
-            }
+                rc = addMessageHandler(topicFilter, messageHandler);
         }
     }
     else
-    {
-        // set subscribe response callback function
-        
-    }
+    	rc = 0;
     
 exit:
+	if (rc < 0 && index >= 0)
+		releaseOperation(index); // the command never got going, so free the slot
     return rc;
 }
 
 
 template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::unsubscribe(resultHandler resultHandler, const char* topicFilter)
 {
-	int index = 0;
-	if (this->thread)
-		index = findFreeOperation();	
-	Timer& atimer = operations[index].timer;
-
-	atimer.countdown(limits.command_timeout_ms);
-    MQTTString topic = {(char*)topicFilter, 0, 0};
+	int index = -1;
+	Timer atimer(limits.command_timeout_ms);
+    MQTTString topic = {(char*)topicFilter, {0, 0}};
     
-    int len = MQTTSerialize_unsubscribe(buf, limits.MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic);
-    int rc = sendPacket(len, atimer.left_ms()); // send the subscribe packet
+    mutex.lock();
+    unsigned short id = packetid.getNext();
+    mutex.unlock();
+	if (this->thread && resultHandler != 0)
+	{
+		// set unsubscribe response callback function
+		if ((index = registerOperation(resultHandler, UNSUBACK, id, topicFilter)) < 0)
+			return -1; // too many commands in progress
+	}
+
+    mutex.lock();
+    int len = MQTTSerialize_unsubscribe(buf, limits.MAX_MQTT_PACKET_SIZE, 0, id, 1, &topic);
+    int rc = sendPacket(len, atimer.left_ms()); // send the unsubscribe packet
+    mutex.unlock();
 	if (rc != len) 
+	{
+		rc = -1;
 		goto exit; // there was a problem
+	}
     
-    // set unsubscribe response callback function
-        
+    if (this->thread == 0)
+    {
+        // this will block
+        rc = -1;
+        if (waitfor(UNSUBACK, atimer) == UNSUBACK)
+        {
+            removeMessageHandler(topicFilter);
+            rc = 0;
+        }
+    }
+    else
+    	rc = 0;
     
 exit:
+	if (rc < 0 && index >= 0)
+		releaseOperation(index);
     return rc;
 }
 
@@ -543,39 +929,55 @@ exit:
    
 template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::publish(resultHandler resultHandler, const char* topicName, Message* message)
 {
-	int index = 0;
-	if (this->thread)
-		index = findFreeOperation();	
-	Timer& atimer = operations[index].timer;
-
-	atimer.countdown(limits.command_timeout_ms);
-    MQTTString topic = {(char*)topicName, 0, 0};
+	int index = -1;
+	Timer atimer(limits.command_timeout_ms);
+    MQTTString topic = {(char*)topicName, {0, 0}};
 
 	if (message->qos == QOS1 || message->qos == QOS2)
+	{
+		mutex.lock();
 		message->id = packetid.getNext();
+		mutex.unlock();
+		if (this->thread && resultHandler != 0)
+		{
+			// set publish response callback function
+			if ((index = registerOperation(resultHandler, (message->qos == QOS1) ? PUBACK : PUBCOMP, message->id, topicName, message)) < 0)
+				return -1; // too many commands in progress
+		}
+	}
     
-	int len = MQTTSerialize_publish(buf, limits.MAX_MQTT_PACKET_SIZE, 0, message->qos, message->retained, message->id, topic, (char*)message->payload, message->payloadlen);
-    int rc = sendPacket(len, atimer.left_ms()); // send the subscribe packet
+    mutex.lock();
+	int len = MQTTSerialize_publish(buf, limits.MAX_MQTT_PACKET_SIZE, 0, message->qos, message->retained, message->id, topic, (unsigned char*)message->payload, message->payloadlen);
+    int rc = sendPacket(len, atimer.left_ms()); // send the publish packet
+    mutex.unlock();
 	if (rc != len) 
+	{
+		rc = -1;
 		goto exit; // there was a problem
+	}
     
     /* wait for acks */
-    if (resultHandler == 0)
+    if (this->thread == 0)
     {
+    	rc = 0;
  		if (message->qos == QOS1)
 		{
+			rc = -1;
 	        if (waitfor(PUBACK, atimer) == PUBACK)
     	    {
-    	        int type, dup, mypacketid;
+    	        unsigned char type, dup;
+    	        unsigned short mypacketid;
     	        if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
     	            rc = 0; 
     	    }
 		}
 		else if (message->qos == QOS2)
 		{
+			rc = -1;
 	        if (waitfor(PUBCOMP, atimer) == PUBCOMP)
 	   	    {
-	   	    	int type, dup, mypacketid;
+    	        unsigned char type, dup;
+    	        unsigned short mypacketid;
             	if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, limits.MAX_MQTT_PACKET_SIZE) == 1)
     	           	rc = 0; 
 			}
@@ -584,11 +986,17 @@ template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<
     }
     else
     {
-        // set publish response callback function
-        
+    	rc = 0;
+    	if (message->qos == QOS0 && resultHandler != 0)
+    	{
+    		Result res = {this, 0, 0}; // complete as soon as it is written
+    		resultHandler(&res);
+    	}
     }
     
 exit:
+	if (rc < 0 && index >= 0)
+		releaseOperation(index);
     return rc;
 }
 
@@ -596,10 +1004,19 @@ exit:
 template<class Network, class Timer, class Thread, class Mutex> int MQTT::Async<Network, Timer, Thread, Mutex>::disconnect(resultHandler resultHandler)
 {  
     Timer timer = Timer(limits.command_timeout_ms);     // we might wait for incomplete incoming publishes to complete
+    mutex.lock();
     int len = MQTTSerialize_disconnect(buf, limits.MAX_MQTT_PACKET_SIZE);
     int rc = sendPacket(len, timer.left_ms());   // send the disconnect packet
+    mutex.unlock();
+    isconnected = false;
     
-    return (rc == len) ? 0 : -1;
+    rc = (rc == len) ? 0 : -1;
+    if (resultHandler != 0)
+    {
+    	Result res = {this, rc, 0};
+    	resultHandler(&res);
+    }
+    return rc;
 }
 
 
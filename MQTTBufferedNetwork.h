@@ -0,0 +1,116 @@
+#if !defined(MQTT_BUFFERED_NETWORK_H)
+#define MQTT_BUFFERED_NETWORK_H
+
+#include <string.h>
+#include "MQTTGatherWrite.h"
+
+/**
+ * @class MQTTBufferedNetwork
+ * @brief receive-buffering wrapper around a Network class
+ *
+ * The client reads each packet in pieces - the header byte, each remaining length byte, then the
+ * rest of the packet.  This wrapper satisfies those reads from a receive buffer which is refilled
+ * with as much data as the network stack has available in a single non-blocking read, so a burst of
+ * small packets costs one socket call rather than one per piece.
+ * @param Network the network class being wrapped - MQTTSocket or similar
+ * @param BUFFER_SIZE the size of the receive buffer in bytes
+ */
+template<class Network, int BUFFER_SIZE = 512>
+class MQTTBufferedNetwork
+{
+public:
+    MQTTBufferedNetwork(Network& network) : network(network)
+    {
+        start = end = 0;
+    }
+
+    int connect(const char* hostname, int port, int timeout=1000)
+    {
+        start = end = 0;
+        return network.connect(hostname, port, timeout);
+    }
+
+    /* returns the number of bytes read, which could be 0.
+       -1 if there was an error on the socket
+    */
+    int read(unsigned char* buffer, int len, int timeout)
+    {
+        int bytes = copy(buffer, len);
+
+        if (bytes < len && len - bytes < BUFFER_SIZE)
+        {   // take whatever the stack already has, without waiting
+            int rc = network.read(rxbuf, BUFFER_SIZE, 0);
+            if (rc < 0)
+                return -1;
+            start = 0;
+            end = rc;
+            bytes += copy(&buffer[bytes], len - bytes);
+        }
+        if (bytes < len)
+        {   // nothing more buffered, so wait for exactly what is still needed
+            int rc = network.read(&buffer[bytes], len - bytes, timeout);
+            if (rc < 0)
+                return -1;
+            bytes += rc;
+        }
+        return bytes;
+    }
+
+    int write(unsigned char* buffer, int len, int timeout)
+    {
+        return network.write(buffer, len, timeout);
+    }
+
+    /* writes a header and payload together with the wrapped network's gather write, or only the
+       header if it has none, returning the number of bytes written from both, or -1 on error
+    */
+    int write(unsigned char* header, int headerlen, unsigned char* payload, int payloadlen, int timeout)
+    {
+        return MQTT::GatherWrite<MQTT::hasGatherWrite<Network>::value>::write(network, header, headerlen, payload, payloadlen, timeout);
+    }
+
+    int disconnect()
+    {
+        start = end = 0;
+        return network.disconnect();
+    }
+
+    /** The number of received bytes held in the buffer and not yet read
+     */
+    int buffered()
+    {
+        return end - start;
+    }
+
+    Network& getNetwork()
+    {
+        return network;
+    }
+
+    /** The handle of the wrapped network, for registering with a Reactor.  Only available if the
+     *  wrapped network has a getFd method, as MQTTPosixSocket does.
+     */
+    int getFd()
+    {
+        return network.getFd();
+    }
+
+private:
+
+    int copy(unsigned char* buffer, int len)
+    {
+        int count = end - start;
+        if (count > len)
+            count = len;
+        memcpy(buffer, &rxbuf[start], count);
+        start += count;
+        return count;
+    }
+
+    Network& network;
+    unsigned char rxbuf[BUFFER_SIZE];
+    int start, end;     // unread data is rxbuf[start] to rxbuf[end - 1]
+
+};
+
+#endif
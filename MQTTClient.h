@@ -27,7 +27,12 @@
 #include "FP.h"
 #include "MQTTPacket.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include "MQTTLogging.h"
+#include "MQTTTopicTrie.h"
+#include "MQTTTrace.h"
+#include "MQTTGatherWrite.h"
+#include "MQTTStore.h"
 
 #if !defined(MQTTCLIENT_QOS1)
     #define MQTTCLIENT_QOS1 1
@@ -35,6 +40,52 @@
 #if !defined(MQTTCLIENT_QOS2)
     #define MQTTCLIENT_QOS2 0
 #endif
+#if !defined(MQTTCLIENT_QOS2_BITMAP)
+    #define MQTTCLIENT_QOS2_BITMAP 0    // 1 to track incoming QoS 2 packet ids in an 8K bitmap, with no limit on their number
+#endif
+#if !defined(MAX_INCOMING_QOS2_MESSAGES)
+    #define MAX_INCOMING_QOS2_MESSAGES 10   // incoming QoS 2 messages which can await PUBREL, when not using the bitmap
+#endif
+#if !defined(MQTTCLIENT_TOPIC_LEVELS)
+    #define MQTTCLIENT_TOPIC_LEVELS 4   // topic filter levels allowed for, on average, per message handler
+#endif
+#if !defined(MQTTCLIENT_GATHER_PAYLOAD_SIZE)
+    #define MQTTCLIENT_GATHER_PAYLOAD_SIZE 512  // publish payloads this size or larger are not copied into sendbuf
+#endif
+#if !defined(MQTTCLIENT_OFFLINE_QUEUE_SIZE)
+    #define MQTTCLIENT_OFFLINE_QUEUE_SIZE 0     // bytes of publications to queue while disconnected, 0 for none
+#endif
+#if !defined(MQTTCLIENT_BATCH_SIZE)
+    #define MQTTCLIENT_BATCH_SIZE 0     // bytes of publish packets to write to the network at once when corked, 0 for none
+#endif
+#if !defined(MQTTCLIENT_COMPRESSION_RULES)
+    #define MQTTCLIENT_COMPRESSION_RULES 0  // topic filters which can have payload compression set, 0 for no compression
+#endif
+#if !defined(MQTTCLIENT_POST_QUEUE_SLOTS)
+    #define MQTTCLIENT_POST_QUEUE_SLOTS 0   // publish packets which other threads can queue with post, 0 for no post.  A power of 2
+#endif
+#if !defined(MQTTCLIENT_MQTT5)
+    #define MQTTCLIENT_MQTT5 0      // 1 to speak MQTT 5 rather than 3.1.1, with topic aliases and receive maximum
+#endif
+#if !defined(MQTTCLIENT_TOPIC_ALIASES)
+    #define MQTTCLIENT_TOPIC_ALIASES 8          // MQTT 5 topic aliases for each direction
+#endif
+#if !defined(MQTTCLIENT_TOPIC_ALIAS_LENGTH)
+    #define MQTTCLIENT_TOPIC_ALIAS_LENGTH 64    // the longest topic name an MQTT 5 topic alias can stand for
+#endif
+#if !defined(MQTTCLIENT_SESSION_EXPIRY)
+    #define MQTTCLIENT_SESSION_EXPIRY 0xFFFFFFFF    // seconds an MQTT 5 server keeps a session which isn't clean, 0xFFFFFFFF for ever
+#endif
+
+#if MQTTCLIENT_MQTT5
+    #include "MQTTV5.h"
+#endif
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+    #include "MQTTCompression.h"
+#endif
+#if MQTTCLIENT_POST_QUEUE_SLOTS > 0
+    #include <atomic>       // post needs C++11
+#endif
 
 namespace MQTT
 {
@@ -45,6 +96,26 @@ enum QoS { QOS0, QOS1, QOS2 };
 // all failure return codes must be negative
 enum returnCode { BUFFER_OVERFLOW = -2, FAILURE = -1, SUCCESS = 0 };
 
+// what to do with a publication when the offline queue is full
+enum OfflinePolicy
+{
+    DROP_NEWEST,    // fail the publish
+    DROP_OLDEST,    // discard queued publications until it fits
+    BLOCK           // wait for the connection to be restored and the queue drained, up to the command timeout.
+                    // Waiting for a reconnect attempt needs a Timer with sleep_ms, or it fails as DROP_NEWEST
+};
+
+// why a connection was closed by the client, as reported to the error handler
+enum ConnectionError
+{
+    NETWORK_ERROR = 1,      // a read or write failed, or the connection was closed by the server
+    PROTOCOL_ERROR,         // an invalid packet was received
+    PING_TIMEOUT,           // no ping response within the keepalive interval
+    RESPONSE_TIMEOUT,       // no response to a command within the command timeout
+    PACKET_TOO_LARGE,       // a packet was too large for the read buffer
+    STORE_ERROR             // the store failed to save or commit a packet, so it might not survive a restart
+};
+
 
 struct Message
 {
@@ -80,6 +151,69 @@ struct subackData
 };
 
 
+/**
+ * Detects whether a Timer class has a nested class Now, which while it exists makes the timers of the
+ * thread use one reading of the clock, as the Countdown of MQTTPosix.h does.
+ */
+template<class Timer>
+class hasNow
+{
+    template<class T> static char test(typename T::Now*);
+    template<class T> static long test(...);
+public:
+    enum { value = sizeof(test<Timer>(0)) == sizeof(char) };
+};
+
+// reads the clock once for the timer checks in its scope, if the Timer class allows, or does nothing
+template<class Timer, bool held = hasNow<Timer>::value>
+struct ClockHold
+{
+    typename Timer::Now now;
+};
+
+template<class Timer>
+struct ClockHold<Timer, false>
+{
+};
+
+
+/**
+ * Detects whether a Timer class has a method which puts the calling thread to sleep:
+ *    static void sleep_ms(int ms)
+ * as the Countdowns of MQTTPosix.h and MQTTmbed.h do.
+ */
+template<class Timer>
+class hasSleep
+{
+    template<class T, void (*)(int)> struct Check;
+    template<class T> static char test(Check<T, &T::sleep_ms>*);
+    template<class T> static long test(...);
+public:
+    enum { value = sizeof(test<Timer>(0)) == sizeof(char) };
+};
+
+// sleeps until a timer expires, if the Timer class allows.  If not, wait returns false at once rather than
+// spin on the timer, and the caller returns, leaving the waiting to the application's yield or cycle
+template<class Timer, bool sleep = hasSleep<Timer>::value>
+struct SleepUntil
+{
+    static bool wait(Timer& timer)
+    {
+        Timer::sleep_ms(timer.left_ms());
+        return true;
+    }
+};
+
+template<class Timer>
+struct SleepUntil<Timer, false>
+{
+    static bool wait(Timer&)
+    {
+        return false;
+    }
+};
+
+
 class PacketId
 {
 public:
@@ -99,16 +233,311 @@ private:
 };
 
 
+#if MQTTCLIENT_QOS2_BITMAP
+// the packet ids of incoming QoS 2 messages awaiting PUBREL, as one bit for each possible id
+template<int MAX_IDS>
+class QoS2PacketIds
+{
+public:
+    QoS2PacketIds()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        memset(bits, 0, sizeof(bits));
+    }
+
+    bool contains(unsigned short id)
+    {
+        return (bits[id >> 3] & (1 << (id & 7))) != 0;
+    }
+
+    bool add(unsigned short id)
+    {
+        bits[id >> 3] |= (1 << (id & 7));
+        return true;
+    }
+
+    void remove(unsigned short id)
+    {
+        bits[id >> 3] &= ~(1 << (id & 7));
+    }
+
+private:
+    unsigned char bits[65536 / 8];
+};
+#else
+// the packet ids of incoming QoS 2 messages awaiting PUBREL, as an open addressed hash set of up to MAX_IDS ids
+template<int MAX_IDS>
+class QoS2PacketIds
+{
+public:
+    QoS2PacketIds()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        for (int i = 0; i < SLOTS; ++i)
+            ids[i] = 0;
+        count = 0;
+    }
+
+    bool contains(unsigned short id)
+    {
+        return find(id) >= 0;
+    }
+
+    bool add(unsigned short id)
+    {
+        if (find(id) >= 0)
+            return true;
+        if (count == MAX_IDS)
+            return false;
+        int i = slot(id);
+        while (ids[i] != 0)
+            i = (i + 1) % SLOTS;
+        ids[i] = id;
+        ++count;
+        return true;
+    }
+
+    void remove(unsigned short id)
+    {
+        int i = find(id);
+        if (i < 0)
+            return;
+        ids[i] = 0;
+        --count;
+        // shift back any following ids which would no longer be found past the gap
+        for (int j = (i + 1) % SLOTS; ids[j] != 0; j = (j + 1) % SLOTS)
+        {
+            int home = slot(ids[j]);
+            if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+                continue;
+            ids[i] = ids[j];
+            ids[j] = 0;
+            i = j;
+        }
+    }
+
+private:
+    static const int SLOTS = MAX_IDS * 2;  // keep at least half the slots empty, so that probe sequences are short
+
+    int slot(unsigned short id)
+    {
+        return (id * 40503U) % SLOTS;
+    }
+
+    int find(unsigned short id)
+    {
+        for (int i = slot(id); ids[i] != 0; i = (i + 1) % SLOTS)
+        {
+            if (ids[i] == id)
+                return i;
+        }
+        return -1;
+    }
+
+    unsigned short ids[SLOTS];  // 0 for an empty slot, as it is not a valid packet id
+    int count;
+};
+#endif
+
+
+// serialized PUBLISH packets, oldest first, in a ring of SIZE bytes.  Each packet is preceded by its
+// length and the offset of its packet id, which is filled in when it is sent, or 0 for QoS 0
+template<int SIZE>
+class OfflineQueue
+{
+public:
+    OfflineQueue()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        head = used = count = 0;
+    }
+
+    bool empty()
+    {
+        return count == 0;
+    }
+
+    int size()
+    {
+        return count;
+    }
+
+    // can a packet of len bytes ever be queued?
+    static bool accepts(int len)
+    {
+        return len > 0 && len <= 0xFFFF && HEADER + len <= SIZE;
+    }
+
+    bool fits(int len)
+    {
+        return HEADER + len <= SIZE - used;
+    }
+
+    bool push(const unsigned char* packet, int len, int idoffset)
+    {
+        unsigned char header[HEADER] = {(unsigned char)(len >> 8), (unsigned char)len,
+                                        (unsigned char)(idoffset >> 8), (unsigned char)idoffset};
+        if (!accepts(len) || !fits(len))
+            return false;
+        copyIn((head + used) % SIZE, header, HEADER);
+        copyIn((head + used + HEADER) % SIZE, packet, len);
+        used += HEADER + len;
+        ++count;
+        return true;
+    }
+
+    // copy the oldest packet into buf, returning its length, or -1 if the queue is empty or buf too small
+    int front(unsigned char* buf, int buflen, int& idoffset)
+    {
+        unsigned char header[HEADER];
+        if (count == 0)
+            return -1;
+        copyOut(head, header, HEADER);
+        int len = (header[0] << 8) + header[1];
+        if (len > buflen)
+            return -1;
+        idoffset = (header[2] << 8) + header[3];
+        copyOut((head + HEADER) % SIZE, buf, len);
+        return len;
+    }
+
+    void pop()
+    {
+        unsigned char header[HEADER];
+        if (count == 0)
+            return;
+        copyOut(head, header, 2);
+        int len = HEADER + (header[0] << 8) + header[1];
+        head = (head + len) % SIZE;
+        used -= len;
+        --count;
+    }
+
+private:
+    static const int HEADER = 4;
+
+    void copyIn(int pos, const unsigned char* from, int len)
+    {
+        int first = (len < SIZE - pos) ? len : SIZE - pos;
+        memcpy(&ring[pos], from, first);
+        memcpy(ring, from + first, len - first);
+    }
+
+    void copyOut(int pos, unsigned char* to, int len)
+    {
+        int first = (len < SIZE - pos) ? len : SIZE - pos;
+        memcpy(to, &ring[pos], first);
+        memcpy(to + first, ring, len - first);
+    }
+
+    unsigned char ring[SIZE];
+    int head;       // offset of the oldest packet
+    int used;       // bytes in use, from head
+    int count;      // number of packets
+};
+
+
+#if MQTTCLIENT_POST_QUEUE_SLOTS > 0
+// serialized PUBLISH packets, queued by any number of threads, and taken off by the one running the client,
+// without locks.  This is D. Vyukov's bounded queue: each slot has a sequence number which tells a
+// producer whether the slot is free for the position it is claiming, and the consumer whether it's been
+// filled, so producers only contend on the claim of a position, and never on the copy of a packet.
+template<int SLOTS, int SLOT_SIZE>
+class PostQueue
+{
+public:
+    static_assert(SLOTS > 0 && (SLOTS & (SLOTS - 1)) == 0, "PostQueue SLOTS must be a power of 2");
+
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        int len;                // 0 if the producer couldn't serialize the packet after all
+        int idoffset;           // offset of the packet id, which is filled in when it is sent, or 0 for QoS 0
+        unsigned char packet[SLOT_SIZE];
+    };
+
+    PostQueue() : enqueuePos(0), dequeuePos(0)
+    {
+        for (int i = 0; i < SLOTS; ++i)
+            slots[i].sequence.store((size_t)i, std::memory_order_relaxed);
+    }
+
+    // producers: claim a slot to serialize a packet into, or 0 if the queue is full.  Every slot claimed
+    // must be published, as the consumer waits for them in order
+    Slot* claim(size_t& pos)
+    {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Slot* slot = &slots[pos & (SLOTS - 1)];
+            ptrdiff_t diff = (ptrdiff_t)(slot->sequence.load(std::memory_order_acquire) - pos);
+            if (diff == 0)
+            {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    return slot;    // otherwise pos has been updated, so try again
+            }
+            else if (diff < 0)
+                return 0;           // the slot is still in use from the previous time round
+            else
+                pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    void publish(Slot* slot, size_t pos)
+    {
+        slot->sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    // consumer: the oldest slot, or 0 if there is none, or it's not published yet
+    Slot* front()
+    {
+        Slot* slot = &slots[dequeuePos & (SLOTS - 1)];
+        return (slot->sequence.load(std::memory_order_acquire) == dequeuePos + 1) ? slot : 0;
+    }
+
+    void pop()
+    {
+        slots[dequeuePos & (SLOTS - 1)].sequence.store(dequeuePos + SLOTS, std::memory_order_release);
+        ++dequeuePos;
+    }
+
+private:
+    Slot slots[SLOTS];
+    char pad1[64];          // keep the positions on cache lines of their own
+    std::atomic<size_t> enqueuePos;
+    char pad2[64];
+    size_t dequeuePos;      // only used by the consumer
+};
+#endif
+
+
 /**
  * @class Client
  * @brief blocking, non-threaded MQTT client API
  *
  * This version of the API blocks on all method calls, until they are complete.  This means that only one
- * MQTT request can be in process at any one time.
- * @param Network a network class which supports send, receive
+ * MQTT request can be in process at any one time, with the exception of publishAsync, which allows
+ * up to MAX_INFLIGHT_MESSAGES QoS 1 and 2 publications to be awaiting acknowledgement at once.
+ * @param Network a network class which supports send, receive, and connect(hostname, port) for automatic reconnection
  * @param Timer a timer class with the methods:
+ * @param MAX_INFLIGHT_MESSAGES the number of outbound QoS 1 and 2 messages which can be unacknowledged
+ * @param Store an outbound message store, which keeps unacknowledged messages of sessions which are not
+ *     clean across restarts, such as FileStore.  See MQTTStore.h
  */
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE = 100, int MAX_MESSAGE_HANDLERS = 5>
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE = 100, int MAX_MESSAGE_HANDLERS = 5,
+    int MAX_INFLIGHT_MESSAGES = 1, class Store = NullStore>
 class Client
 {
 
@@ -116,6 +545,18 @@ public:
 
     typedef void (*messageHandler)(MessageData&);
 
+    /** Called with each part of the payload of a publication too large for the read buffer
+     *  @param md - the topic name, and message properties.  md.message.payloadlen is the total payload length
+     *  @param data - this part of the payload
+     *  @param len - the length of this part
+     *  @param last - whether this is the final part of the payload
+     */
+    typedef void (*payloadChunkHandler)(MessageData& md, const unsigned char* data, size_t len, bool last);
+
+    typedef void (*errorHandler)(ConnectionError error);
+
+    typedef Timer TimerType;    // for the deadlines of a Reactor
+
     /** Construct the client
      *  @param network - pointer to an instance of the Network class - must be connected to the endpoint
      *      before calling MQTT connect
@@ -123,6 +564,16 @@ public:
      */
     Client(Network& network, unsigned int command_timeout_ms = 30000);
 
+    /** Construct the client with an outbound message store.  At the first connect of a session which is
+     *  not clean, the messages in the store are loaded and resent.  A message is durable in the store once
+     *  the client's cycle has run after it was published, by yield or another operation.  If the store
+     *  fails to save or commit a packet, the connection is closed with STORE_ERROR, so that no more are
+     *  sent until it can, and the commit is tried again at the next cycle.
+     *  @param network - the Network, which must be connected to the endpoint before calling MQTT connect
+     *  @param store - the store, which must hold at least MAX_INFLIGHT_MESSAGES messages
+     */
+    Client(Network& network, Store& store, unsigned int command_timeout_ms = 30000);
+
     /** Set the default message handling callback - used for any message which does not match a subscription message handler
      *  @param mh - pointer to the callback function.  Set to 0 to remove.
      */
@@ -134,6 +585,41 @@ public:
             defaultMessageHandler.detach();
     }
 
+    /** Set the callback for publications too large for the read buffer.  Their payloads are passed to
+     *  this, as they are read from the network, instead of to the message handlers.  Without it, a
+     *  publication larger than MAX_MQTT_PACKET_SIZE is treated as an error and the connection closed.
+     *  @param ph - pointer to the callback function.  Set to 0 to remove.
+     */
+    void setPayloadChunkHandler(payloadChunkHandler ph)
+    {
+        chunkHandler = ph;
+    }
+
+    /** Set the callback for a failure which closes the connection.  The session state is kept
+     *  unless it was a clean session, so the application can reconnect the network and call connect
+     *  to resume where it left off.  The callback is called from within the client, so it must not
+     *  call the client itself, but should arrange for the reconnect to happen afterwards.
+     *  @param eh - pointer to the callback function.  Set to 0 to remove.
+     */
+    void setErrorHandler(errorHandler eh)
+    {
+        if (eh != 0)
+            connectionErrorHandler.attach(eh);
+        else
+            connectionErrorHandler.detach();
+    }
+
+    /** Set a member function as the callback for a failure which closes the connection, so that an
+     *  application with many connections can tell which one failed.
+     *  @param object - the object to call the method on
+     *  @param method - the method
+     */
+    template<class T>
+    void setErrorHandler(T* object, void (T::*method)(ConnectionError))
+    {
+        connectionErrorHandler.attach(object, method);
+    }
+
     /** Set a message handling callback.  This can be used outside of the the subscribe method.
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param mh - pointer to the callback function. If 0, removes the callback if any
@@ -162,6 +648,123 @@ public:
      */
     int connect(MQTTPacket_connectData& options, connackData& data);
 
+    /** Reconnect automatically whenever the connection is lost.  yield and step reconnect the network
+     *  and then the MQTT session, waiting a randomized, exponentially increasing delay between attempts.
+     *  If the server has no session for the client, the subscriptions are renewed in as few SUBSCRIBE
+     *  packets as will fit in the send buffer, and their message handlers are kept even for a clean
+     *  session.  The hostname and the strings in the options must remain valid while reconnection is on.
+     *  An explicit disconnect turns reconnection off.
+     *  @param hostname - the server to reconnect to
+     *  @param port - the server port
+     *  @param options - connect options to reconnect with
+     *  @param minDelayMs - the delay allowed for the first attempt after the connection is lost.  The delay
+     *      only returns to this once a connection has lasted a keepalive interval (or maxDelayMs, with no keepalive)
+     *  @param maxDelayMs - the longest delay between attempts
+     */
+    void setAutoReconnect(const char* hostname, int port, MQTTPacket_connectData& options,
+        unsigned long minDelayMs = 1000, unsigned long maxDelayMs = 60000);
+
+    /** Turn automatic reconnection off
+     */
+    void stopAutoReconnect()
+    {
+        reconnect.hostname = 0;
+    }
+
+#if MQTTCLIENT_MQTT5
+    /** Set how long the server keeps the session after the connection closes, when connecting with
+     *  cleansession 0.  MQTT 5 ends the session with the connection unless the client asks for longer.
+     *  Takes effect at the next connect
+     *  @param seconds - the session expiry interval, 0xFFFFFFFF, the default, for no expiry
+     */
+    void setSessionExpiry(unsigned int seconds)
+    {
+        sessionExpiry = seconds;
+    }
+#endif
+
+#if MQTTCLIENT_OFFLINE_QUEUE_SIZE > 0
+    /** Set what a publish does when the offline queue is full.  While the client is disconnected,
+     *  publications are serialized into a queue of MQTTCLIENT_OFFLINE_QUEUE_SIZE bytes, and publish returns
+     *  SUCCESS with a packet id of 0.  They are sent, in order, as soon as the client is connected again,
+     *  as fast as the inflight window allows.  Each must fit into MAX_MQTT_PACKET_SIZE.
+     *  @param policy - DROP_NEWEST, the default, DROP_OLDEST, or BLOCK
+     */
+    void setOfflinePolicy(OfflinePolicy policy)
+    {
+        offlinePolicy = policy;
+    }
+
+    /** The number of publications waiting in the offline queue
+     */
+    int queuedMessages()
+    {
+        return offlineQueue.size();
+    }
+#endif
+
+#if MQTTCLIENT_BATCH_SIZE > 0
+    /** Start packing publications into a batch, rather than writing each to the network as it's made.
+     *  The batch is written in one go when it's full, when another packet has to be sent, at the start
+     *  of yield or any other wait for the server, and by flush.  Publications with payloads written
+     *  from the caller's buffer, and any larger than MQTTCLIENT_BATCH_SIZE, are not batched.
+     */
+    void cork()
+    {
+        corked = true;
+    }
+
+    /** Write the batch of publications made since cork, and stop batching
+     *  @return success code -
+     */
+    int flush();
+
+    /** MQTT Publish - send a number of publications in as few network writes as the batch allows,
+     *  without waiting for the acks.  If the client is already corked, they are left in the batch
+     *  for the next flush.
+     *  @param topicNames - the topic to publish each message to
+     *  @param messages - the messages to send.  The packet ids used are returned in each message.id
+     *  @param count - the number of messages
+     *  @return success code - of the first publication to fail, if any do, and the rest aren't sent
+     */
+    int publishBatch(const char* const* topicNames, Message* messages, int count);
+#endif
+
+#if MQTTCLIENT_POST_QUEUE_SLOTS > 0
+    /** MQTT Publish from any thread - serialize a publish packet into a lock-free queue of
+     *  MQTTCLIENT_POST_QUEUE_SLOTS packets, for the thread running the client to send in its next cycle,
+     *  as the inflight window allows.  Unlike every other method, this can be called from any number of
+     *  threads at once, while another is in yield or any other call.  A packet waits in the queue while
+     *  the client is disconnected, and until the read in progress in the client's thread returns.  Its packet
+     *  id is assigned when it is sent, and it is sent without compression or a topic alias.
+     *  @param topic - the topic to publish to
+     *  @param payload - the data to send, which is copied into the queue
+     *  @param payloadlen - the length of the data
+     *  @param qos - the QoS to send the publish at
+     *  @param retained - whether the message should be retained
+     *  @return success code - BUFFER_OVERFLOW if the queue is full, or the packet too big for MAX_MQTT_PACKET_SIZE
+     */
+    int post(const char* topicName, void* payload, size_t payloadlen, enum QoS qos = QOS0, bool retained = false);
+#endif
+
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+    /** Compress the payloads published to topics matching a filter, and decompress those received on them
+     *  before they are passed to the message handlers.  A payload is only sent compressed if that makes it
+     *  smaller, and the publish packet then fits into MAX_MQTT_PACKET_SIZE, as it is always copied into the
+     *  send buffer, however large.  Compressed payloads received
+     *  are decompressed if they fit into MAX_MQTT_PACKET_SIZE, with the codec named in their marker header
+     *  if it is a bundled one or the rule's, and otherwise delivered as they are.  If several filters
+     *  match a topic, any one of their rules is used.  Payloads streamed to a payload chunk handler are
+     *  not decompressed.
+     *  @param topicFilter - a topic pattern which can include wildcards.  It is not copied, so must remain
+     *      valid while the rule is set
+     *  @param codec - LZ4Codec, DeflateCodec or one of the application's, or 0 to remove the rule
+     *  @param minSize - payloads smaller than this are not compressed
+     *  @return success code - FAILURE if there is no room for another rule
+     */
+    int setCompression(const char* topicFilter, const Codec* codec, int minSize = 64);
+#endif
+
     /** MQTT Publish - send an MQTT publish packet and wait for all acks to complete for all QoSs
      *  @param topic - the topic to publish to
      *  @param message - the message to send
@@ -190,6 +793,41 @@ public:
      */
     int publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos = QOS1, bool retained = false);
 
+    /** MQTT Publish - send an MQTT publish packet without waiting for the acks.  The acks are processed
+     *  by subsequent calls to yield or other operations.  If MAX_INFLIGHT_MESSAGES QoS 1 and 2 messages
+     *  are already awaiting acknowledgement, this waits for one to complete first, then handles any other
+     *  acks which have arrived, so that with a store the messages filling the freed slots share a commit.
+     *  Payloads of MQTTCLIENT_GATHER_PAYLOAD_SIZE bytes or more, or too big for MAX_MQTT_PACKET_SIZE, are
+     *  written from the payload buffer rather than copied.  If cleansession is false, such a payload must
+     *  remain valid until the message is acknowledged, as it is resent from there on reconnect.
+     *  @param topic - the topic to publish to
+     *  @param payload - the data to send
+     *  @param payloadlen - the length of the data
+     *  @param id - the packet id used - returned
+     *  @param qos - the QoS to send the publish at
+     *  @param retained - whether the message should be retained
+     *  @return success code -
+     */
+    int publishAsync(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos = QOS1, bool retained = false);
+
+    /** MQTT Publish - send an MQTT publish packet without waiting for the acks
+     *  @param topic - the topic to publish to
+     *  @param message - the message to send.  The packet id used is returned in message.id
+     *  @return success code -
+     */
+    int publishAsync(const char* topicName, Message& message);
+
+    /** Is a QoS 1 or 2 message still awaiting acknowledgement?
+     *  @param id - the packet id returned from publish or publishAsync
+     *  @return flag - true if the message has not yet been completely acknowledged
+     */
+    bool isInflight(unsigned short id);
+
+    /** The number of QoS 1 and 2 messages awaiting acknowledgement
+     *  @return count
+     */
+    int inflightCount();
+
     /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param qos - the MQTT QoS to subscribe at
@@ -213,8 +851,26 @@ public:
      */
     int unsubscribe(const char* topicFilter);
 
-    /** MQTT Disconnect - send an MQTT disconnect packet, and clean up any state
-     *  @return success code -
+    /** MQTT Subscribe - send one MQTT subscribe packet for several topic filters and wait for the suback
+     *  @param topicFilters - the topic patterns, which can include wildcards
+     *  @param qos - the MQTT QoS to subscribe to each at
+     *  @param mhs - the callback function for each subscription
+     *  @param count - the number of topic filters, at most MAX_MESSAGE_HANDLERS
+     *  @param data - returns the granted QoS of each subscription, 0x80 if it was refused.  Can be 0
+     *  @return success code - BUFFER_OVERFLOW if the packet would not fit in the send buffer, or FAILURE
+     *      if a message handler could not be set, in which case the connection is kept
+     */
+    int subscribe(const char* const* topicFilters, const enum QoS* qos, messageHandler* mhs, int count, subackData* data);
+
+    /** MQTT Unsubscribe - send one MQTT unsubscribe packet for several topic filters and wait for the unsuback
+     *  @param topicFilters - the topic patterns, which can include wildcards
+     *  @param count - the number of topic filters, at most MAX_MESSAGE_HANDLERS
+     *  @return success code - BUFFER_OVERFLOW if the packet would not fit in the send buffer
+     */
+    int unsubscribe(const char* const* topicFilters, int count);
+
+    /** MQTT Disconnect - send an MQTT disconnect packet, and clean up any state
+     *  @return success code -
      */
     int disconnect();
 
@@ -222,10 +878,19 @@ public:
      *  yield can be called if no other MQTT operation is needed.  This will also allow messages to be
      *  received.
      *  @param timeout_ms the time to wait, in milliseconds
-     *  @return success code - on failure, this means the client has disconnected
+     *  @return success code - on failure, this means the client has disconnected.  With automatic
+     *      reconnection, it sleeps until each attempt is due, and returns failure only if the client is
+     *      still not connected when the time is up.  If the Timer class has no sleep_ms, it returns failure
+     *      instead of waiting for an attempt which isn't due
      */
     int yield(unsigned long timeout_ms = 1000L);
 
+    /** Process one packet if one has arrived, and any keepalive action that is due, without waiting.
+     *  For use by an event loop which knows that the network has data, or that nextDeadlineMs has passed.
+     *  @return the MQTT packet type processed, 0 if none, or a failure code in which case the client has disconnected
+     */
+    int step();
+
     /** Is the client connected?
      *  @return flag - is the client connected or not?
      */
@@ -234,20 +899,76 @@ public:
         return isconnected;
     }
 
+    /** The time until the client next needs to run to maintain the connection - to send a ping, or
+     *  to check for its response.  An application with its own event loop can wait this long, or
+     *  until data arrives on the network, before calling yield.
+     *  When reconnecting automatically, it is the time until the next attempt.
+     *  @return the time in milliseconds, 0 if the client needs to run now, or -1 if there's no deadline
+     */
+    int nextDeadlineMs();
+
+#if MQTTCLIENT_TRACE
+    /** Copy out the trace records of the packets sent and received since a previous call.
+     *  This can be called from any thread.
+     *  @param records - the records, oldest first
+     *  @param max - the size of records
+     *  @param position - 0 for the first call, then as returned by the previous call
+     *  @return the number of records copied
+     */
+    int readTrace(TraceRecord* records, int max, uint32_t& position)
+    {
+        return trace.read(records, max, position);
+    }
+#endif
+
 private:
 
     void closeSession();
     void cleanSession();
-    int cycle(Timer& timer);
+    void connectionLost();
+    int cycle(Timer& timer, bool wait = true);
     int waitfor(int packet_type, Timer& timer);
     int keepalive();
-    int publish(int len, Timer& timer, enum QoS qos);
+    int publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained, Timer& timer);
+    int sendPublish(int len, unsigned short id, enum QoS qos, unsigned char* gather, int payloadlen, Timer& timer);
+    int resend(int index, Timer& timer);
+#if MQTTCLIENT_BATCH_SIZE > 0
+    int addToBatch(int len, Timer& timer);
+    int flushBatch(Timer& timer);
+#endif
+#if MQTTCLIENT_OFFLINE_QUEUE_SIZE > 0
+    int enqueue(MQTTString& topicName, void* payload, size_t payloadlen, enum QoS qos, bool retained, Timer& timer);
+    int drainQueue(Timer& timer);
+#endif
+#if MQTTCLIENT_POST_QUEUE_SLOTS > 0
+    int drainPosted(Timer& timer);
+#endif
+    int subscribeBatch(int count, MQTTString* topicFilters, int* qos, Timer& timer);
+    int resubscribe(Timer& timer);
+    int reconnectIfDue();
+    void scheduleReconnect();
 
     int decodePacket(int* value, int timeout);
-    int readPacket(Timer& timer);
-    int sendPacket(int length, Timer& timer);
+    int readPacket(Timer& timer, bool wait);
+    int deserializePublishHeader(MQTTString& topicName, Message& message, unsigned short& topicAlias);
+    int readPayload(MQTTString& topicName, Message& message, bool deliver, int offset);
+    int sendPacket(int length, Timer& timer, unsigned char* payload = 0, int payloadlen = 0);
+    int write(unsigned char* buf, int length, unsigned char* payload, int payloadlen, Timer& timer);
+    static int serializePublishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+        unsigned short packetid, MQTTString topicName, unsigned short topicAlias, int payloadlen);
+    static int serializePublish(unsigned char* buf, int buflen, int qos, unsigned char retained, unsigned short packetid,
+        MQTTString topicName, unsigned short topicAlias, unsigned char* payload, int payloadlen);
+#if MQTTCLIENT_MQTT5
+    unsigned short topicAlias(MQTTString& topicName);
+    bool resolveTopicAlias(MQTTString& topicName, unsigned short topicAlias);
+    void refused(unsigned short id, int reasonCode);
+#endif
     int deliverMessage(MQTTString& topicName, Message& message);
-    bool isTopicMatched(char* topicFilter, MQTTString& topicName);
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+    int findCompression(const char* topicName, int len);
+    void compress(MQTTString& topicName, void*& payload, size_t& payloadlen, enum QoS qos);
+    void decompress(MQTTString& topicName, Message& message);
+#endif
 
     Network& ipstack;
     unsigned long command_timeout_ms;
@@ -255,7 +976,11 @@ private:
     unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
     unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
 
-    Timer last_sent, last_received;
+    Timer last_sent, last_received;   // keepalive deadlines: we must send something, or check the server is there
+    Timer ping_sent;                  // deadline for a response to our ping
+#if MQTTCLIENT_TRACE
+    TraceBuffer<MQTTCLIENT_TRACE_RECORDS> trace;
+#endif
     unsigned int keepAliveInterval;
     bool ping_outstanding;
     bool cleansession;
@@ -266,28 +991,89 @@ private:
     {
         const char* topicFilter;
         FP<void, MessageData&> fp;
+        int qos;        // the granted QoS of the subscription, or -1 if the handler was set without subscribing
     } messageHandlers[MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
 
+    TopicTrie<MAX_MESSAGE_HANDLERS * MQTTCLIENT_TOPIC_LEVELS> subscriptions;  // maps topic names to messageHandlers
+
     FP<void, MessageData&> defaultMessageHandler;
+    payloadChunkHandler chunkHandler;
+    int streamlen;       // length of the payload of the current publication still to be read from the network
+
+    FP<void, ConnectionError> connectionErrorHandler;
+    ConnectionError lastError;  // the cause of the failure in progress, if it isn't an invalid packet
+
+    struct ReconnectState
+    {
+        const char* hostname;   // 0 if automatic reconnection is off
+        int port;
+        MQTTPacket_connectData options;
+        unsigned long minDelayMs;
+        unsigned long maxDelayMs;
+        unsigned long delayMs;  // the current upper limit of the delay between attempts
+        Timer next;             // when the next attempt is due
+        Timer stable;           // when the connection made by the last attempt has lasted long enough to reset delayMs
+    } reconnect;
 
     bool isconnected;
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    unsigned char pubbuf[MAX_MQTT_PACKET_SIZE];  // store the last publish for sending on reconnect
-    int inflightLen;
-    unsigned short inflightMsgid;
-    enum QoS inflightQoS;
+    struct InflightMessage
+    {
+        unsigned short msgid;   // 0 if the slot is free
+        enum QoS qos;
+        bool pubrel;            // PUBREC received, so waiting for PUBCOMP
+        int len;                // length of the stored publish, 0 if not stored
+        unsigned char buf[MAX_MQTT_PACKET_SIZE];  // store the publish for sending on reconnect
+        unsigned char* payload; // payload not copied into buf, if it was sent from the application's buffer
+        int payloadlen;
+        int storedlen;          // length of the packet to resend from the store, if it was loaded from there
+    } inflight[MAX_INFLIGHT_MESSAGES];
+    int inflightMessages;
+    int maxInflight;    // MAX_INFLIGHT_MESSAGES, or fewer if the server's receive maximum is lower
+    int findInflight(unsigned short id);
+    int restoreMore(Timer& timer);
+    bool restoring;     // the store may hold packets from a previous run which aren't in the window yet
+#endif
+
+    Store* store;       // 0 if there is none
+    bool restored;      // whether the store has been loaded
+
+#if MQTTCLIENT_OFFLINE_QUEUE_SIZE > 0
+    OfflineQueue<MQTTCLIENT_OFFLINE_QUEUE_SIZE> offlineQueue;   // publications made while disconnected
+    OfflinePolicy offlinePolicy;
+#endif
+
+#if MQTTCLIENT_POST_QUEUE_SLOTS > 0
+    PostQueue<MQTTCLIENT_POST_QUEUE_SLOTS, MAX_MQTT_PACKET_SIZE> posted;    // publications from other threads
+#endif
+
+#if MQTTCLIENT_BATCH_SIZE > 0
+    unsigned char batchbuf[MQTTCLIENT_BATCH_SIZE];  // publish packets waiting to be written together
+    int batchlen;
+    bool corked;
+#endif
+
+#if MQTTCLIENT_MQTT5
+    V5::TopicAliases<MQTTCLIENT_TOPIC_ALIASES, MQTTCLIENT_TOPIC_ALIAS_LENGTH> outboundAliases, inboundAliases;
+    unsigned int sessionExpiry;
+    unsigned short refusedId;   // the last publication the server refused with a reason code
+#endif
+
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+    struct CompressionRule
+    {
+        const char* topicFilter;    // 0 if the rule is free
+        const Codec* codec;
+        int minSize;
+    } compressionRules[MQTTCLIENT_COMPRESSION_RULES];
+    TopicTrie<MQTTCLIENT_COMPRESSION_RULES * MQTTCLIENT_TOPIC_LEVELS> compressionTopics;  // maps topic names to compressionRules
+    unsigned char compressbuf[MAX_MQTT_PACKET_SIZE];    // the payload being published, compressed
+    unsigned char decompressbuf[MAX_MQTT_PACKET_SIZE];  // the payload being delivered, decompressed
 #endif
 
 #if MQTTCLIENT_QOS2
-    bool pubrel;
-    #if !defined(MAX_INCOMING_QOS2_MESSAGES)
-        #define MAX_INCOMING_QOS2_MESSAGES 10
-    #endif
-    unsigned short incomingQoS2messages[MAX_INCOMING_QOS2_MESSAGES];
-    bool isQoS2msgidFree(unsigned short id);
-    bool useQoS2msgid(unsigned short id);
-    void freeQoS2msgid(unsigned short id);
+    QoS2PacketIds<MAX_INCOMING_QOS2_MESSAGES> incomingQoS2messages;
 #endif
 
 };
@@ -295,122 +1081,398 @@ private:
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::cleanSession()
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT_MESSAGES, class d>
+void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT_MESSAGES, d>::cleanSession()
 {
-    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
-        messageHandlers[i].topicFilter = 0;
+    if (reconnect.hostname == 0)    // when reconnecting automatically, the handlers are kept for resubscribing
+    {
+        for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+            messageHandlers[i].topicFilter = 0;
+        subscriptions.clear();
+    }
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    inflightMsgid = 0;
-    inflightQoS = QOS0;
+    for (int i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
+        inflight[i].msgid = 0;
+    inflightMessages = 0;
+    restoring = false;
 #endif
 
 #if MQTTCLIENT_QOS2
-    pubrel = false;
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
-        incomingQoS2messages[i] = 0;
+    incomingQoS2messages.clear();
 #endif
+
+    if (store)
+        store->clear();
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::closeSession()
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int c, class d>
+void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, c, d>::closeSession()
 {
     ping_outstanding = false;
     isconnected = false;
+    streamlen = 0;
+    lastError = PROTOCOL_ERROR;
+#if MQTTCLIENT_BATCH_SIZE > 0
+    batchlen = 0;
+#endif
     if (cleansession)
         cleanSession();
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid()
+// close the session after a failure, and tell the application why
+template<class Network, class Timer, int a, int b, int c, class d>
+void MQTT::Client<Network, Timer, a, b, c, d>::connectionLost()
+{
+    ConnectionError error = lastError;
+
+    closeSession();
+    if (reconnect.hostname != 0)
+        scheduleReconnect();
+    if (connectionErrorHandler.attached())
+        connectionErrorHandler(error);
+}
+
+
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int MAX_INFLIGHT_MESSAGES, class d>
+MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, MAX_INFLIGHT_MESSAGES, d>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid()
 {
     this->command_timeout_ms = command_timeout_ms;
+    chunkHandler = 0;
+    reconnect.hostname = 0;
+    store = 0;
+    restored = false;
+#if MQTTCLIENT_OFFLINE_QUEUE_SIZE > 0
+    offlinePolicy = DROP_NEWEST;
+#endif
+#if MQTTCLIENT_BATCH_SIZE > 0
+    corked = false;
+#endif
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+    for (int i = 0; i < MQTTCLIENT_COMPRESSION_RULES; ++i)
+        compressionRules[i].topicFilter = 0;
+#endif
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    maxInflight = MAX_INFLIGHT_MESSAGES;
+    restoring = false;
+#endif
+#if MQTTCLIENT_MQTT5
+    sessionExpiry = MQTTCLIENT_SESSION_EXPIRY;
+    refusedId = 0;
+#endif
     cleansession = true;
       closeSession();
 }
 
 
-#if MQTTCLIENT_QOS2
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isQoS2msgidFree(unsigned short id)
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT_MESSAGES, class Store>
+MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT_MESSAGES, Store>::Client(Network& network, Store& store, unsigned int command_timeout_ms)  : ipstack(network), packetid()
+{
+    this->command_timeout_ms = command_timeout_ms;
+    chunkHandler = 0;
+    reconnect.hostname = 0;
+    this->store = 0;    // so that closing the session doesn't clear the store before it's loaded
+    restored = false;
+#if MQTTCLIENT_OFFLINE_QUEUE_SIZE > 0
+    offlinePolicy = DROP_NEWEST;
+#endif
+#if MQTTCLIENT_BATCH_SIZE > 0
+    corked = false;
+#endif
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+    for (int i = 0; i < MQTTCLIENT_COMPRESSION_RULES; ++i)
+        compressionRules[i].topicFilter = 0;
+#endif
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    maxInflight = MAX_INFLIGHT_MESSAGES;
+    restoring = false;
+#endif
+#if MQTTCLIENT_MQTT5
+    sessionExpiry = MQTTCLIENT_SESSION_EXPIRY;
+    refusedId = 0;
+#endif
+    cleansession = true;
+    closeSession();
+    this->store = &store;
+}
+
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT_MESSAGES, class d>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT_MESSAGES, d>::findInflight(unsigned short id)
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    for (int i = 0; i < MAX_INFLIGHT_MESSAGES; ++i)
     {
-        if (incomingQoS2messages[i] == id)
-            return false;
+        if (inflight[i].msgid == id)
+            return i;
     }
-    return true;
+    return -1;
 }
 
 
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::useQoS2msgid(unsigned short id)
+// load the messages left in the store by a previous run into the free slots of the inflight window, oldest
+// first, and send them.  Any more stay in the store until acknowledgements make room for them
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT_MESSAGES, class d>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT_MESSAGES, d>::restoreMore(Timer& timer)
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    int rc = SUCCESS;
+    int index = 0;
+
+    while (rc == SUCCESS && restoring && inflightMessages < maxInflight)
     {
-        if (incomingQoS2messages[i] == 0)
+        unsigned short id = 0;
+        int len = 0, i = findInflight(0);
+        MQTTHeader header = {0};
+
+        if (store->get(index++, id, len) != 0)
         {
-            incomingQoS2messages[i] = id;
-            return true;
+            restoring = false;  // they are all in the window
+            break;
         }
+        if (id == 0 || len <= 0 || findInflight(id) >= 0 || store->read(id, 0, &header.byte, 1) != 1)
+            continue;
+
+        struct InflightMessage& m = inflight[i];
+        m.msgid = id;
+        m.pubrel = (header.bits.type == PUBREL);
+        m.qos = m.pubrel ? QOS2 : (enum QoS)header.bits.qos;
+        m.len = 0;
+        m.payload = 0;
+        m.payloadlen = 0;
+        m.storedlen = m.pubrel ? 0 : len;
+        ++inflightMessages;
+        rc = resend(i, timer);
     }
+    return rc;
+}
+#endif
+
+
+template<class Network, class Timer, int a, int b, int c, class d>
+bool MQTT::Client<Network, Timer, a, b, c, d>::isInflight(unsigned short id)
+{
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    return id != 0 && findInflight(id) >= 0;
+#else
     return false;
+#endif
 }
 
 
-template<class Network, class Timer, int a, int b>
-void MQTT::Client<Network, Timer, a, b>::freeQoS2msgid(unsigned short id)
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::inflightCount()
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
-    {
-        if (incomingQoS2messages[i] == id)
-        {
-            incomingQoS2messages[i] = 0;
-            return;
-        }
-    }
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    return inflightMessages;
+#else
+    return 0;
+#endif
 }
+
+
+/**
+ * Send the packet in sendbuf
+ * @param length the length of the packet, or the part of it in sendbuf if there is a separate payload
+ * @param payload the rest of the packet, sent from the caller's buffer without copying, or 0
+ * @param payloadlen the length of the rest of the packet
+ */
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::sendPacket(int length, Timer& timer, unsigned char* payload, int payloadlen)
+{
+    int rc = SUCCESS;
+
+#if MQTTCLIENT_BATCH_SIZE > 0
+    if (batchlen > 0)
+        rc = flushBatch(timer);     // keep the packets in the order they were made
+#endif
+    if (rc == SUCCESS)
+        rc = write(sendbuf, length, payload, payloadlen, timer);
+    MQTT_TRACE(trace, (rc == SUCCESS) ? TRACE_SEND : TRACE_SEND_FAILED, sendbuf, length, length + payloadlen);
+
+#if defined(MQTT_DEBUG)
+    char printbuf[150];
+    if (payloadlen > 0)
+        DEBUG("Rc %d from sending packet header %02x with %d byte payload\r\n", rc, sendbuf[0], payloadlen)
+    else
+        DEBUG("Rc %d from sending packet %s\r\n", rc, 
+            MQTTFormat_toServerString(printbuf, sizeof(printbuf), sendbuf, length));
 #endif
+    return rc;
+}
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
+// write a buffer, and the separate payload if there is one, to the network
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::write(unsigned char* buf, int length, unsigned char* payload, int payloadlen, Timer& timer)
 {
     int rc = FAILURE,
         sent = 0;
 
-    while (sent < length)
+    while (sent < length + payloadlen)
     {
-        rc = ipstack.write(&sendbuf[sent], length - sent, timer.left_ms());
+        if (sent < length)
+            rc = GatherWrite<hasGatherWrite<Network>::value>::write(ipstack, &buf[sent], length - sent, payload, payloadlen, timer.left_ms());
+        else
+            rc = ipstack.write(&payload[sent - length], length + payloadlen - sent, timer.left_ms());
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
         if (timer.expired()) // only check expiry after at least one attempt to write
             break;
     }
-    if (sent == length)
+    if (sent == length + payloadlen)
     {
         if (this->keepAliveInterval > 0)
             last_sent.countdown(this->keepAliveInterval); // record the fact that we have successfully sent the packet
-        rc = SUCCESS;
+        return SUCCESS;
     }
-    else
-        rc = FAILURE;
+    lastError = NETWORK_ERROR;
+    return FAILURE;
+}
+
 
+#if MQTTCLIENT_BATCH_SIZE > 0
+// add the publish packet in sendbuf to the batch, writing the batch first if there isn't room
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::addToBatch(int len, Timer& timer)
+{
+    int rc = SUCCESS;
+
+    if (batchlen + len > MQTTCLIENT_BATCH_SIZE)
+        rc = flushBatch(timer);
+    if (rc == SUCCESS)
+    {
+        memcpy(&batchbuf[batchlen], sendbuf, len);
+        batchlen += len;
+    }
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::flushBatch(Timer& timer)
+{
+    int rc = write(batchbuf, batchlen, 0, 0, timer);
+
+    MQTT_TRACE(trace, (rc == SUCCESS) ? TRACE_SEND : TRACE_SEND_FAILED, batchbuf, batchlen, batchlen);
 #if defined(MQTT_DEBUG)
-    char printbuf[150];
-    DEBUG("Rc %d from sending packet %s\r\n", rc, 
-        MQTTFormat_toServerString(printbuf, sizeof(printbuf), sendbuf, length));
+    DEBUG("Rc %d from sending a batch of %d bytes\r\n", rc, batchlen);
 #endif
+    batchlen = 0;
     return rc;
 }
+#endif
+
+
+// serialize a publish packet up to, but not including, the payload.  The topic alias is only used for MQTT 5
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::serializePublishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos,
+    unsigned char retained, unsigned short packetid, MQTTString topicName, unsigned short topicAlias, int payloadlen)
+{
+#if MQTTCLIENT_MQTT5
+    return V5::serializePublishHeader(buf, buflen, dup, qos, retained, packetid, topicName, topicAlias, payloadlen);
+#else
+    unsigned char* ptr = buf;
+    MQTTHeader header = {0};
+    int rem_len = 2 + MQTTstrlen(topicName) + payloadlen + ((qos > 0) ? 2 : 0);
+
+    (void)topicAlias;
+
+    if (MQTTPacket_len(rem_len) - payloadlen > buflen)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+
+    header.bits.type = PUBLISH;
+    header.bits.dup = dup;
+    header.bits.qos = qos;
+    header.bits.retain = retained;
+    writeChar(&ptr, header.byte); /* write header */
+    ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */
+    writeMQTTString(&ptr, topicName);
+    if (qos > 0)
+        writeInt(&ptr, packetid);
+    return ptr - buf;
+#endif
+}
+
+
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::serializePublish(unsigned char* buf, int buflen, int qos, unsigned char retained,
+    unsigned short packetid, MQTTString topicName, unsigned short topicAlias, unsigned char* payload, int payloadlen)
+{
+#if MQTTCLIENT_MQTT5
+    int len = serializePublishHeader(buf, buflen, 0, qos, retained, packetid, topicName, topicAlias, payloadlen);
+
+    if (len > 0 && len + payloadlen > buflen)
+        len = MQTTPACKET_BUFFER_TOO_SHORT;
+    if (len > 0)
+    {
+        memcpy(&buf[len], payload, payloadlen);
+        len += payloadlen;
+    }
+    return len;
+#else
+    (void)topicAlias;
+    return MQTTSerialize_publish(buf, buflen, 0, qos, retained, packetid, topicName, payload, payloadlen);
+#endif
+}
+
+
+#if MQTTCLIENT_MQTT5
+// choose the topic alias for an outbound publication, leaving out the topic name if the server has the alias
+template<class Network, class Timer, int a, int b, int c, class d>
+unsigned short MQTT::Client<Network, Timer, a, b, c, d>::topicAlias(MQTTString& topicName)
+{
+    int len = strlen(topicName.cstring);
+    int alias = outboundAliases.find(topicName.cstring, len);
+
+    if (alias > 0)
+        topicName.cstring = (char*)"";
+    else
+        alias = outboundAliases.assign(topicName.cstring, len);
+    return alias;
+}
+
+
+// record or look up the topic alias of an inbound publication, returning false if it's a protocol error
+template<class Network, class Timer, int a, int b, int c, class d>
+bool MQTT::Client<Network, Timer, a, b, c, d>::resolveTopicAlias(MQTTString& topicName, unsigned short topicAlias)
+{
+    if (topicAlias == 0)
+        return topicName.lenstring.len > 0;
+    if (topicAlias > inboundAliases.maximum())
+        return false;   // more than the topic alias maximum we sent in the CONNECT
+    if (topicName.lenstring.len == 0)
+        return inboundAliases.get(topicAlias, topicName);
+    if (!inboundAliases.set(topicAlias, topicName.lenstring.data, topicName.lenstring.len))
+        WARN("Topic alias %d not kept, for a topic name longer than MQTTCLIENT_TOPIC_ALIAS_LENGTH", topicAlias);
+    return true;
+}
+
+
+// a PUBACK or PUBREC with a failure reason code ends the exchange for the publication, which is not retried
+template<class Network, class Timer, int a, int b, int c, class d>
+void MQTT::Client<Network, Timer, a, b, c, d>::refused(unsigned short id, int reasonCode)
+{
+    WARN("Publication %d refused by the server with reason code 0x%02x", id, reasonCode);
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    int i;
+    if (id != 0 && (i = findInflight(id)) >= 0)
+    {
+        inflight[i].msgid = 0;
+        --inflightMessages;
+        if (store)
+            store->remove(id);
+    }
+#endif
+    refusedId = id;
+}
+#endif
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::decodePacket(int* value, int timeout)
+template<class Network, class Timer, int a, int b, int MAX_INFLIGHT_MESSAGES, class d>
+int MQTT::Client<Network, Timer, a, b, MAX_INFLIGHT_MESSAGES, d>::decodePacket(int* value, int timeout)
 {
     unsigned char c;
     int multiplier = 1;
@@ -442,41 +1504,87 @@ exit:
  * If any read fails in this method, then we should disconnect from the network, as on reconnect
  * the packets can be retried.
  * @param timeout the max time to wait for the packet read to complete, in milliseconds
+ * @param wait whether to wait for a packet to arrive, or only read one which has started arriving
  * @return the MQTT packet type, 0 if none, -1 if error
  */
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& timer)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::readPacket(Timer& timer, bool wait)
 {
     int rc = FAILURE;
     MQTTHeader header = {0};
     int len = 0;
     int rem_len = 0;
+    Timer packet_timer;
 
     /* 1. read the header byte.  This has the packet type in it */
-    rc = ipstack.read(readbuf, 1, timer.left_ms());
+    rc = ipstack.read(readbuf, 1, wait ? timer.left_ms() : 0);
     if (rc != 1)
         goto exit;
+    rc = FAILURE;
 
+    /* now the packet has started to arrive, allow time for the rest even if the caller's time is up */
+    packet_timer.countdown_ms(command_timeout_ms);
     len = 1;
     /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(&rem_len, timer.left_ms());
+    decodePacket(&rem_len, packet_timer.left_ms());
     len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
 
-    if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
+    header.byte = readbuf[0];
+    if (rem_len > (MAX_MQTT_PACKET_SIZE - len) && header.bits.type == PUBLISH && chunkHandler != 0)
+    {
+        /* read just the topic name and packet id, and leave the payload to be streamed */
+        int varlen = 2 + ((header.bits.qos > 0) ? 2 : 0);
+        if (MAX_MQTT_PACKET_SIZE - len < 2 || ipstack.read(readbuf + len, 2, packet_timer.left_ms()) != 2)
+            goto exit;
+        varlen += readbuf[len] * 256 + readbuf[len + 1];
+        if (varlen > rem_len || varlen > MAX_MQTT_PACKET_SIZE - len)
+        {
+            rc = BUFFER_OVERFLOW;
+            goto exit;
+        }
+#if MQTTCLIENT_MQTT5
+        {   // and the properties, which follow the packet id
+            int proplen = 0;
+            if (ipstack.read(readbuf + len + 2, varlen - 2, packet_timer.left_ms()) != varlen - 2)
+                goto exit;
+            len += varlen;
+            decodePacket(&proplen, packet_timer.left_ms());
+            int proplenlen = V5::varintLength(proplen);
+            if (varlen + proplenlen + proplen > rem_len || proplenlen + proplen > MAX_MQTT_PACKET_SIZE - len)
+            {
+                rc = BUFFER_OVERFLOW;
+                goto exit;
+            }
+            len += MQTTPacket_encode(readbuf + len, proplen);
+            streamlen = rem_len - varlen - proplenlen - proplen;
+            rem_len = proplen;
+        }
+#else
+        streamlen = rem_len - varlen;
+        rem_len = varlen - 2;
+        len += 2;
+#endif
+    }
+    else if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
     {
         rc = BUFFER_OVERFLOW;
         goto exit;
     }
 
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len))
+    if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, packet_timer.left_ms()) != rem_len))
         goto exit;
 
     header.byte = readbuf[0];
     rc = header.bits.type;
     if (this->keepAliveInterval > 0)
         last_received.countdown(this->keepAliveInterval); // record the fact that we have successfully received a packet
+    ping_outstanding = false; // any packet shows the server is still there, so don't wait on the ping response
 exit:
+    if (rc < 0)
+        lastError = (rc == BUFFER_OVERFLOW) ? PACKET_TOO_LARGE : NETWORK_ERROR;
+    if (len > 0)
+        MQTT_TRACE(trace, (rc > 0) ? TRACE_RECEIVE : TRACE_RECEIVE_FAILED, readbuf, len + rem_len, len + rem_len + streamlen);
 
 #if defined(MQTT_DEBUG)
     if (rc >= 0)
@@ -490,73 +1598,193 @@ exit:
 }
 
 
-// assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isTopicMatched(char* topicFilter, MQTTString& topicName)
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int c, class d>
+int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, c, d>::deliverMessage(MQTTString& topicName, Message& message)
 {
-    char* curf = topicFilter;
-    char* curn = topicName.lenstring.data;
-    char* curn_end = curn + topicName.lenstring.len;
+    int rc = FAILURE;
+    int handlers[MAX_MESSAGE_HANDLERS];
 
-    while (*curf && curn < curn_end)
+    // we have to find the right message handlers - indexed by topic
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+    decompress(topicName, message);
+#endif
+    int count = subscriptions.match(topicName.lenstring.data, topicName.lenstring.len, handlers, MAX_MESSAGE_HANDLERS);
+    for (int i = 0; i < count; ++i)
     {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
+        if (messageHandlers[handlers[i]].fp.attached())
+        {
+            MessageData md(topicName, message);
+            messageHandlers[handlers[i]].fp(md);
+            rc = SUCCESS;
         }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
+    }
+
+    if (rc == FAILURE && defaultMessageHandler.attached())
+    {
+        MessageData md(topicName, message);
+        defaultMessageHandler(md);
+        rc = SUCCESS;
+    }
+
+    return rc;
+}
+
 
-    return (curn == curn_end) && (*curf == '\0');
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::setCompression(const char* topicFilter, const Codec* codec, int minSize)
+{
+    int i = 0;
+
+    while (i < MQTTCLIENT_COMPRESSION_RULES && (compressionRules[i].topicFilter == 0 ||
+            strcmp(compressionRules[i].topicFilter, topicFilter) != 0))
+        ++i;
+    if (i < MQTTCLIENT_COMPRESSION_RULES)
+    {   // replace or remove the existing rule
+        compressionTopics.remove(compressionRules[i].topicFilter);
+        compressionRules[i].topicFilter = 0;
+    }
+    if (codec == 0)
+        return SUCCESS;
+    i = 0;
+    while (i < MQTTCLIENT_COMPRESSION_RULES && compressionRules[i].topicFilter != 0)
+        ++i;
+    if (i == MQTTCLIENT_COMPRESSION_RULES || compressionTopics.add(topicFilter, i) != 0)
+        return FAILURE;
+    compressionRules[i].topicFilter = topicFilter;
+    compressionRules[i].codec = codec;
+    compressionRules[i].minSize = minSize;
+    return SUCCESS;
 }
 
 
+// the index of the compression rule for a topic name, or -1 if there is none
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::findCompression(const char* topicName, int len)
+{
+    int rule = -1;
+
+    return (compressionTopics.match(topicName, len, &rule, 1) == 1) ? rule : -1;
+}
+
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTString& topicName, Message& message)
+// replace the payload of a publication with its compressed form in compressbuf, if there is a rule for
+// the topic and it is smaller.  The packet must fit into sendbuf, as it is always copied there whatever
+// the payload size, so that it's never written from compressbuf, which is reused by the next publish,
+// even if it has to be resent.
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+void MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::compress(MQTTString& topicName, void*& payload,
+    size_t& payloadlen, enum QoS qos)
 {
-    int rc = FAILURE;
+    int topiclen = strlen(topicName.cstring);
+    int rule = findCompression(topicName.cstring, topiclen);
 
-    // we have to find the right message handler - indexed by topic
-    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    if (rule < 0 || (int)payloadlen < compressionRules[rule].minSize)
+        return;
+    // the most room the payload can have with the fixed header, topic, packet id and any MQTT 5 properties
+    int room = MAX_MQTT_PACKET_SIZE - 5 - (2 + topiclen) - ((qos > 0) ? 2 : 0) - (MQTTCLIENT_MQTT5 ? 4 : 0);
+    if (room > (int)payloadlen - 1)
+        room = payloadlen - 1;
+
+    int len = compressPayload(*compressionRules[rule].codec, (unsigned char*)payload, payloadlen, compressbuf, room);
+    if (len > 0)
     {
-        if (messageHandlers[i].topicFilter != 0 && (MQTTPacket_equals(&topicName, (char*)messageHandlers[i].topicFilter) ||
-                isTopicMatched((char*)messageHandlers[i].topicFilter, topicName)))
-        {
-            if (messageHandlers[i].fp.attached())
-            {
-                MessageData md(topicName, message);
-                messageHandlers[i].fp(md);
-                rc = SUCCESS;
-            }
-        }
+        payload = compressbuf;
+        payloadlen = len;
     }
+}
 
-    if (rc == FAILURE && defaultMessageHandler.attached())
+
+// replace the payload of a received message with its decompressed form in decompressbuf, if there is a
+// rule for the topic and the payload has the marker header
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+void MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::decompress(MQTTString& topicName, Message& message)
+{
+    int rule = findCompression(topicName.lenstring.data, topicName.lenstring.len);
+    int id = compressedWith((unsigned char*)message.payload, message.payloadlen);
+    const Codec* codec = 0;
+
+    if (rule < 0 || id < 0)
+        return;
+    if (id == compressionRules[rule].codec->id)
+        codec = compressionRules[rule].codec;
+    else if (id == LZ4Codec.id)
+        codec = &LZ4Codec;
+    else if (id == DeflateCodec.id)
+        codec = &DeflateCodec;
+    else
     {
-        MessageData md(topicName, message);
-        defaultMessageHandler(md);
-        rc = SUCCESS;
+        WARN("Payload compressed with unknown codec %d delivered as it is", id);
+        return;
     }
 
-    return rc;
+    int len = decompressPayload(*codec, (unsigned char*)message.payload, message.payloadlen,
+              decompressbuf, MAX_MQTT_PACKET_SIZE);
+    if (len < 0)
+    {
+        WARN("Payload not decompressed, as it is invalid or larger than MAX_MQTT_PACKET_SIZE");
+        return;
+    }
+    message.payload = decompressbuf;
+    message.payloadlen = len;
+}
+#endif
+
+
+
+// parse the publish header left in readbuf by readPacket when the payload is to be streamed
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::deserializePublishHeader(MQTTString& topicName, Message& message,
+    unsigned short& topicAlias)
+{
+    MQTTHeader header = {0};
+    unsigned char* curdata = readbuf;
+    int rem_len = 0;
+
+    header.byte = readChar(&curdata);
+    curdata += MQTTPacket_decodeBuf(curdata, &rem_len); /* read remaining length */
+    if (!readMQTTLenString(&topicName, &curdata, readbuf + MAX_MQTT_PACKET_SIZE))
+        return FAILURE;
+    message.dup = header.bits.dup;
+    message.qos = (enum QoS)header.bits.qos;
+    message.retained = header.bits.retain;
+    message.id = (message.qos > 0) ? readInt(&curdata) : 0;
+    message.payload = 0;
+    message.payloadlen = streamlen;
+    topicAlias = 0;
+#if MQTTCLIENT_MQTT5
+    V5::Properties props;
+    if (!V5::readProperties(&curdata, readbuf + MAX_MQTT_PACKET_SIZE, props))
+        return FAILURE;
+    topicAlias = props.topicAlias;
+#endif
+    return curdata - readbuf;
 }
 
 
+// read the rest of a publication too big for readbuf, passing it to the chunk handler in readbuf sized pieces
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::readPayload(MQTTString& topicName, Message& message, bool deliver, int offset)
+{
+    MessageData md(topicName, message);
+
+    while (streamlen > 0)
+    {
+        Timer timer(command_timeout_ms);    // allow for each piece, rather than the whole payload
+        int len = (streamlen < MAX_MQTT_PACKET_SIZE - offset) ? streamlen : MAX_MQTT_PACKET_SIZE - offset;
+
+        if (ipstack.read(readbuf + offset, len, timer.left_ms()) != len)
+            return FAILURE;
+        streamlen -= len;
+        if (deliver)
+            chunkHandler(md, readbuf + offset, len, streamlen == 0);
+    }
+    return SUCCESS;
+}
+
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::yield(unsigned long timeout_ms)
 {
     int rc = SUCCESS;
     Timer timer;
@@ -564,25 +1792,86 @@ int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
     timer.countdown_ms(timeout_ms);
     while (!timer.expired())
     {
-        if (cycle(timer) < 0)
+        if (isconnected)
+        {
+            if (cycle(timer) < 0 && (isconnected || reconnect.hostname == 0))
+            {
+                rc = FAILURE;
+                break;
+            }
+        }
+        else if (reconnect.hostname == 0)
         {
             rc = FAILURE;
             break;
         }
+        else if (reconnectIfDue() != SUCCESS &&
+                 !SleepUntil<Timer>::wait((reconnect.next.left_ms() < timer.left_ms()) ? reconnect.next : timer))
+        {   // the wait for the next attempt, or the end of the yield if that is sooner, is left to the caller
+            rc = FAILURE;
+            break;
+        }
     }
+    if (!isconnected)
+        rc = FAILURE;
+
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::step()
+{
+    Timer timer(command_timeout_ms);
+    int rc = FAILURE;
 
+    if (!isconnected)
+        rc = reconnectIfDue();
+    else
+        rc = cycle(timer, false);   // only check for data that has already arrived
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT_MESSAGES, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT_MESSAGES, d>::cycle(Timer& timer, bool wait)
 {
     // get one piece of work off the wire and one pass through
     int len = 0,
         rc = SUCCESS;
 
-    int packet_type = readPacket(timer);    // read the socket, see what work is due
+    if (store && store->commit() != 0)    // make the store changes from the last pass durable, together
+    {
+        lastError = STORE_ERROR;
+        if (isconnected)
+            connectionLost();
+        return FAILURE;
+    }
+
+#if MQTTCLIENT_BATCH_SIZE > 0
+    if (batchlen > 0 && flushBatch(timer) != SUCCESS)
+    {
+        connectionLost();
+        return FAILURE;
+    }
+#endif
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (isconnected && restoring && restoreMore(timer) != SUCCESS)
+    {
+        connectionLost();
+        return FAILURE;
+    }
+#endif
+#if MQTTCLIENT_OFFLINE_QUEUE_SIZE > 0
+    if (isconnected && drainQueue(timer) != SUCCESS)
+        return FAILURE;     // the connection has been closed already
+#endif
+#if MQTTCLIENT_POST_QUEUE_SLOTS > 0
+    if (isconnected && drainPosted(timer) != SUCCESS)
+        return FAILURE;
+#endif
+
+    int packet_type = readPacket(timer, wait);    // read the socket, see what work is due
 
     switch (packet_type)
     {
@@ -593,32 +1882,102 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
         case 0: // timed out reading packet
             break;
         case CONNACK:
-        case PUBACK:
         case SUBACK:
+        case UNSUBACK:
+            break;
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+        case PUBACK:
+        case PUBCOMP:
+        {
+            unsigned short mypacketid;
+            unsigned char dup, type;
+            int i;
+#if MQTTCLIENT_MQTT5
+            unsigned char reasonCode = 0;
+            if (V5::deserializeAck(&type, &dup, &mypacketid, &reasonCode, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                rc = FAILURE;
+            else if (packet_type == PUBACK && reasonCode >= 0x80)
+                refused(mypacketid, reasonCode);
+#else
+            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                rc = FAILURE;
+#endif
+            else if (mypacketid != 0 && (i = findInflight(mypacketid)) >= 0)
+            {
+                inflight[i].msgid = 0; // complete - free the slot for the next message
+                --inflightMessages;
+                if (store)
+                    store->remove(mypacketid);
+            }
+            if (rc == FAILURE)
+                goto exit;
             break;
+        }
+#endif
         case PUBLISH:
         {
             MQTTString topicName = MQTTString_initializer;
             Message msg;
             int intQoS;
+            int offset = 0;
+            bool deliver = true;
+            unsigned short alias = 0;   // the MQTT 5 topic alias
             msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
-            if (MQTTDeserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
+            if (streamlen > 0)
+            {
+                if ((offset = deserializePublishHeader(topicName, msg, alias)) <= 0)
+                {
+                    rc = FAILURE; // the payload can't be skipped, so the connection is unusable
+                    goto exit;
+                }
+            }
+#if MQTTCLIENT_MQTT5
+            else
+            {
+                V5::Properties props;
+                int rem_len = 0;
+                int total = 1 + MQTTPacket_decodeBuf(readbuf + 1, &rem_len) + rem_len;
+                if ((offset = V5::deserializePublishHeader((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained,
+                                 &msg.id, &topicName, props, readbuf, total)) <= 0)
+                    goto exit;
+                msg.qos = (enum QoS)intQoS;
+                msg.payload = readbuf + offset;
+                msg.payloadlen = total - offset;
+                alias = props.topicAlias;
+            }
+            if (!resolveTopicAlias(topicName, alias))
+            {
+                lastError = PROTOCOL_ERROR;
+                rc = FAILURE;   // an alias we don't have, so the message can't be delivered
+                goto exit;
+            }
+#else
+            else if (MQTTDeserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
                                  (unsigned char**)&msg.payload, (int*)&msg.payloadlen, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
                 goto exit;
-            msg.qos = (enum QoS)intQoS;
-#if MQTTCLIENT_QOS2
-            if (msg.qos != QOS2)
+            else
+                msg.qos = (enum QoS)intQoS;
 #endif
-                deliverMessage(topicName, msg);
 #if MQTTCLIENT_QOS2
-            else if (isQoS2msgidFree(msg.id))
+            if (msg.qos == QOS2)
             {
-                if (useQoS2msgid(msg.id))
-                    deliverMessage(topicName, msg);
-                else
+                // a repeated id is a resend of a message already delivered.  If the id can't be recorded,
+                // deliver anyway, as a possible duplicate is better than losing the message
+                deliver = !incomingQoS2messages.contains(msg.id);
+                if (deliver && !incomingQoS2messages.add(msg.id))
+                {
+                    MQTT_TRACE(trace, TRACE_QOS2_FULL, readbuf, MAX_MQTT_PACKET_SIZE, 0);
                     WARN("Maximum number of incoming QoS2 messages exceeded");
+                }
             }
 #endif
+            if (streamlen > 0)
+            {
+                if ((rc = readPayload(topicName, msg, deliver, offset)) != SUCCESS)
+                    goto exit;
+            }
+            else if (deliver)
+                deliverMessage(topicName, msg);
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
             if (msg.qos != QOS0)
             {
@@ -641,8 +2000,20 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
         case PUBREL:
             unsigned short mypacketid;
             unsigned char dup, type;
+            int i;
+#if MQTTCLIENT_MQTT5
+            unsigned char reasonCode;
+            if (V5::deserializeAck(&type, &dup, &mypacketid, &reasonCode, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+                rc = FAILURE;
+            else if (packet_type == PUBREC && reasonCode >= 0x80)
+            {
+                refused(mypacketid, reasonCode);    // which ends the exchange, with no PUBREL
+                break;
+            }
+#else
             if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
                 rc = FAILURE;
+#endif
             else if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE,
                                  (packet_type == PUBREC) ? PUBREL : PUBCOMP, 0, mypacketid)) <= 0)
                 rc = FAILURE;
@@ -651,15 +2022,28 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
             if (rc == FAILURE)
                 goto exit; // there was a problem
             if (packet_type == PUBREL)
-                freeQoS2msgid(mypacketid);
-            break;
-
-        case PUBCOMP:
+                incomingQoS2messages.remove(mypacketid);
+            else if (mypacketid != 0 && (i = findInflight(mypacketid)) >= 0)
+            {
+                inflight[i].pubrel = true;
+                if (store && !cleansession && store->put(mypacketid, sendbuf, len, 0, 0) != 0)
+                {   // the PUBREL replaces the PUBLISH
+                    lastError = STORE_ERROR;
+                    rc = FAILURE;
+                    goto exit;
+                }
+            }
             break;
 #endif
         case PINGRESP:
             ping_outstanding = false;
             break;
+#if MQTTCLIENT_MQTT5
+        case DISCONNECT:    // the server is closing the connection, with a reason code
+            lastError = NETWORK_ERROR;
+            rc = FAILURE;
+            goto exit;
+#endif
     }
 
     if (keepalive() != SUCCESS)
@@ -670,31 +2054,37 @@ exit:
     if (rc == SUCCESS)
         rc = packet_type;
     else if (isconnected)
-        closeSession();
+        connectionLost();
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::keepalive()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::keepalive()
 {
     int rc = SUCCESS;
-    static Timer ping_sent;
+    bool ping_due = false;
 
     if (keepAliveInterval == 0)
         goto exit;
     
-    if (ping_outstanding)
     {
-        if (ping_sent.expired())
-        {
-            rc = FAILURE; // session failure
-            #if defined(MQTT_DEBUG)
-                DEBUG("PINGRESP not received in keepalive interval\r\n");
-            #endif
-        }
+        ClockHold<Timer> now;   // one read of the clock for all the deadlines
+        if (ping_outstanding && ping_sent.expired())
+            rc = FAILURE;
+        else if (!ping_outstanding)
+            ping_due = last_sent.expired() || last_received.expired();
     }
-    else if (last_sent.expired() || last_received.expired())
+
+    if (rc == FAILURE) // session failure
+    {
+        lastError = PING_TIMEOUT;
+        MQTT_TRACE(trace, TRACE_PING_TIMEOUT, 0, 0, 0);
+        #if defined(MQTT_DEBUG)
+            DEBUG("PINGRESP not received in keepalive interval\r\n");
+        #endif
+    }
+    else if (ping_due)
     {
         Timer timer(1000);
         int len = MQTTSerialize_pingreq(sendbuf, MAX_MQTT_PACKET_SIZE);
@@ -709,16 +2099,41 @@ exit:
 }
 
 
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::nextDeadlineMs()
+{
+    ClockHold<Timer> now;   // one read of the clock for all the deadlines
+    int left = -1;
+
+    if (!isconnected && reconnect.hostname != 0)
+        left = reconnect.next.left_ms();
+    else if (!isconnected || keepAliveInterval == 0)
+        return -1;
+    else if (ping_outstanding)
+        left = ping_sent.left_ms();
+    else
+    {
+        left = last_sent.left_ms();
+        if (last_received.left_ms() < left)
+            left = last_received.left_ms();
+    }
+    return (left > 0) ? left : 0;
+}
+
+
 // only used in single-threaded mode where one command at a time is in process
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::waitfor(int packet_type, Timer& timer)
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::waitfor(int packet_type, Timer& timer)
 {
     int rc = FAILURE;
 
     do
     {
         if (timer.expired())
+        {
+            lastError = RESPONSE_TIMEOUT;
             break; // we timed out
+        }
         rc = cycle(timer);
     }
     while (rc != packet_type && rc >= 0);
@@ -727,8 +2142,8 @@ int MQTT::Client<Network, Timer, a, b>::waitfor(int packet_type, Timer& timer)
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_connectData& options, connackData& data)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT_MESSAGES, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT_MESSAGES, d>::connect(MQTTPacket_connectData& options, connackData& data)
 {
     Timer connect_timer(command_timeout_ms);
     int rc = FAILURE;
@@ -739,7 +2154,15 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
 
     this->keepAliveInterval = options.keepAliveInterval;
     this->cleansession = options.cleansession;
-    if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &options)) <= 0)
+#if MQTTCLIENT_MQTT5
+    // the server can send as many QoS 2 messages at once as we can track, and QoS 1 messages are acked at once
+    len = V5::serializeConnect(sendbuf, MAX_MQTT_PACKET_SIZE, &options,
+              (MQTTCLIENT_QOS2 && !MQTTCLIENT_QOS2_BITMAP) ? MAX_INCOMING_QOS2_MESSAGES : 65535, MQTTCLIENT_TOPIC_ALIASES,
+              options.cleansession ? 0 : sessionExpiry);
+#else
+    len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &options);
+#endif
+    if (len <= 0)
         goto exit;
     if ((rc = sendPacket(len, connect_timer)) != SUCCESS)  // send the connect packet
         goto exit; // there was a problem
@@ -751,32 +2174,54 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
     {
         data.rc = 0;
         data.sessionPresent = false;
+#if MQTTCLIENT_MQTT5
+        V5::Properties props;
+        if (V5::deserializeConnack((unsigned char*)&data.sessionPresent,
+                            (unsigned char*)&data.rc, props, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        {
+            rc = data.rc;
+  #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+            maxInflight = (props.receiveMaximum < MAX_INFLIGHT_MESSAGES) ? props.receiveMaximum : MAX_INFLIGHT_MESSAGES;
+  #endif
+            outboundAliases.clear(props.topicAliasMaximum);
+            inboundAliases.clear(MQTTCLIENT_TOPIC_ALIASES);
+            if (props.serverKeepAlive >= 0)     // the server's keepalive overrides ours
+                this->keepAliveInterval = props.serverKeepAlive;
+        }
+#else
         if (MQTTDeserialize_connack((unsigned char*)&data.sessionPresent,
                             (unsigned char*)&data.rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
             rc = data.rc;
+#endif
         else
             rc = FAILURE;
     }
     else
         rc = FAILURE;
 
-#if MQTTCLIENT_QOS2
-    // resend any inflight publish
-    if (inflightMsgid > 0 && inflightQoS == QOS2 && pubrel)
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (rc == SUCCESS && store && !restored)
     {
-        if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREL, 0, inflightMsgid)) <= 0)
-            rc = FAILURE;
+        int count = store->open();
+        restored = true;
+        if (count < 0)
+        {
+            WARN("Unable to open the message store");
+        }
+        else if (cleansession)
+            store->clear();
         else
-            rc = publish(len, connect_timer, inflightQoS);
+            restoring = (count > 0);
     }
-    else
-#endif
-#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    if (inflightMsgid > 0)
+
+    // resend any inflight publishes - the acks are processed as they arrive
+    for (int i = 0; rc == SUCCESS && i < MAX_INFLIGHT_MESSAGES; ++i)
     {
-        memcpy(sendbuf, pubbuf, MAX_MQTT_PACKET_SIZE);
-        rc = publish(inflightLen, connect_timer, inflightQoS);
+        if (inflight[i].msgid > 0)
+            rc = resend(i, connect_timer);
     }
+    if (rc == SUCCESS && restoring)
+        rc = restoreMore(connect_timer);
 #endif
 
 exit:
@@ -784,29 +2229,171 @@ exit:
     {
         isconnected = true;
         ping_outstanding = false;
+#if MQTTCLIENT_OFFLINE_QUEUE_SIZE > 0
+        rc = drainQueue(connect_timer);     // as much of the offline queue as the inflight window allows
+#endif
     }
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_connectData& options)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::connect(MQTTPacket_connectData& options)
 {
     connackData data;
     return connect(options, data);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::connect()
 {
     MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
     return connect(default_options);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::setMessageHandler(const char* topicFilter, messageHandler messageHandler)
+template<class Network, class Timer, int a, int b, int c, class d>
+void MQTT::Client<Network, Timer, a, b, c, d>::setAutoReconnect(const char* hostname, int port, MQTTPacket_connectData& options,
+    unsigned long minDelayMs, unsigned long maxDelayMs)
+{
+    reconnect.hostname = hostname;
+    reconnect.port = port;
+    reconnect.options = options;
+    reconnect.minDelayMs = minDelayMs;
+    reconnect.maxDelayMs = (maxDelayMs > minDelayMs) ? maxDelayMs : minDelayMs;
+    reconnect.delayMs = minDelayMs;
+    reconnect.next.countdown_ms(0);
+    reconnect.stable.countdown_ms(0);
+}
+
+
+// pick a random time up to the current delay for the next attempt, so that a fleet of clients which lost
+// their connections together don't all return at once.  The delay only goes back to the minimum once a
+// connection has lasted a keepalive interval, so that a server which accepts connections and then drops
+// them is not hammered
+template<class Network, class Timer, int a, int b, int c, class d>
+void MQTT::Client<Network, Timer, a, b, c, d>::scheduleReconnect()
+{
+    if (reconnect.stable.expired())
+        reconnect.delayMs = reconnect.minDelayMs;
+    else
+        reconnect.delayMs = (reconnect.delayMs * 2 < reconnect.maxDelayMs) ? reconnect.delayMs * 2 : reconnect.maxDelayMs;
+    reconnect.next.countdown_ms((reconnect.delayMs > 0) ? (unsigned long)rand() % (reconnect.delayMs + 1) : 0);
+}
+
+
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::reconnectIfDue()
+{
+    int rc = FAILURE;
+    connackData data;
+
+    if (reconnect.hostname == 0 || !reconnect.next.expired())
+        goto exit;
+
+    if (reconnect.options.keepAliveInterval > 0)
+        reconnect.stable.countdown(reconnect.options.keepAliveInterval);
+    else
+        reconnect.stable.countdown_ms(reconnect.maxDelayMs);
+    ipstack.disconnect();   // close what is left of the lost connection, or of a failed attempt
+    if (ipstack.connect(reconnect.hostname, reconnect.port) == 0 && (rc = connect(reconnect.options, data)) == SUCCESS)
+    {
+        Timer timer(command_timeout_ms);
+        if (!data.sessionPresent)   // the server has no subscriptions for us
+            rc = resubscribe(timer);
+    }
+
+    if (rc != SUCCESS && reconnect.hostname != 0)
+    {
+        if (isconnected)
+            closeSession();
+        if (reconnect.next.expired())   // unless the connection was lost during resubscription, which scheduled the next attempt
+            scheduleReconnect();
+    }
+exit:
+    return rc;
+}
+
+
+// renew the subscriptions of all the message handlers, packing as many into each SUBSCRIBE as will fit
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, int c, class d>
+int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, c, d>::resubscribe(Timer& timer)
+{
+    MQTTString topicFilters[MAX_MESSAGE_HANDLERS];
+    int qos[MAX_MESSAGE_HANDLERS];
+    int handlers[MAX_MESSAGE_HANDLERS];
+    int count = 0;
+    int rc = SUCCESS;
+
+    for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
+    {
+        if (messageHandlers[i].topicFilter != 0 && messageHandlers[i].qos >= 0)
+        {
+            MQTTString topic = {(char*)messageHandlers[i].topicFilter, {0, 0}};
+            topicFilters[count] = topic;
+            qos[count] = messageHandlers[i].qos;
+            handlers[count++] = i;
+        }
+    }
+
+    for (int start = 0, batch = count; rc == SUCCESS && start < count; )
+    {
+        if (batch > count - start)
+            batch = count - start;
+        if ((rc = subscribeBatch(batch, &topicFilters[start], &qos[start], timer)) == BUFFER_OVERFLOW && batch > 1)
+        {
+            batch = (batch + 1) / 2;   // too many for one packet, so try fewer
+            rc = SUCCESS;
+            continue;
+        }
+        for (int i = start; rc == SUCCESS && i < start + batch; ++i)
+        {
+            if (qos[i] != 0x80)
+                messageHandlers[handlers[i]].qos = qos[i];
+            else
+            {
+                WARN("Resubscription to %s refused\r\n", messageHandlers[handlers[i]].topicFilter);
+            }
+        }
+        start += batch;
+    }
+    return rc;
+}
+
+
+// send one SUBSCRIBE for several topic filters, and wait for the SUBACK.  The granted QoSs are returned in qos
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::subscribeBatch(int count, MQTTString* topicFilters, int* qos, Timer& timer)
+{
+    int rc = FAILURE;
+#if MQTTCLIENT_MQTT5
+    int len = V5::serializeSubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, packetid.getNext(), count, topicFilters, qos);
+#else
+    int len = MQTTSerialize_subscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), count, topicFilters, qos);
+#endif
+
+    if (len == MQTTPACKET_BUFFER_TOO_SHORT)
+        rc = BUFFER_OVERFLOW;
+    else if (len > 0 && (rc = sendPacket(len, timer)) == SUCCESS)
+    {
+        int granted = 0;
+        unsigned short mypacketid;
+        if (waitfor(SUBACK, timer) != SUBACK)
+            rc = FAILURE;
+#if MQTTCLIENT_MQTT5
+        else if (V5::deserializeSuback(&mypacketid, count, &granted, qos, readbuf, MAX_MQTT_PACKET_SIZE) != 1 || granted != count)
+#else
+        else if (MQTTDeserialize_suback(&mypacketid, count, &granted, qos, readbuf, MAX_MQTT_PACKET_SIZE) != 1 || granted != count)
+#endif
+            rc = FAILURE;
+    }
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, c, d>::setMessageHandler(const char* topicFilter, messageHandler messageHandler)
 {
     int rc = FAILURE;
     int i = -1;
@@ -816,6 +2403,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
     {
         if (messageHandlers[i].topicFilter != 0 && strcmp(messageHandlers[i].topicFilter, topicFilter) == 0)
         {
+            subscriptions.remove(messageHandlers[i].topicFilter);
             if (messageHandler == 0) // remove existing
             {
                 messageHandlers[i].topicFilter = 0;
@@ -840,74 +2428,120 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
         }
         if (i < MAX_MESSAGE_HANDLERS)
         {
-            messageHandlers[i].topicFilter = topicFilter;
-            messageHandlers[i].fp.attach(messageHandler);
+            if (subscriptions.add(topicFilter, i) == 0)
+            {
+                if (messageHandlers[i].topicFilter == 0)
+                    messageHandlers[i].qos = -1;
+                messageHandlers[i].topicFilter = topicFilter;
+                messageHandlers[i].fp.attach(messageHandler);
+            }
+            else
+            {   // no room to index the topic filter
+                messageHandlers[i].topicFilter = 0;
+                messageHandlers[i].fp.detach();
+                rc = FAILURE;
+            }
         }
     }
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::subscribe(const char* topicFilter,
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, c, d>::subscribe(const char* topicFilter,
      enum QoS qos, messageHandler messageHandler, subackData& data)
+{
+    return subscribe(&topicFilter, &qos, &messageHandler, 1, &data);
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, c, d>::subscribe(const char* const* topicFilters,
+     const enum QoS* qos, messageHandler* mhs, int count, subackData* data)
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);
-    int len = 0;
-    MQTTString topic = {(char*)topicFilter, {0, 0}};
+    MQTTString topics[MAX_MESSAGE_HANDLERS];
+    int granted[MAX_MESSAGE_HANDLERS];
 
-    if (!isconnected)
+    if (!isconnected || count <= 0 || count > MAX_MESSAGE_HANDLERS)
         goto exit;
 
-    len = MQTTSerialize_subscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic, (int*)&qos);
-    if (len <= 0)
+    for (int i = 0; i < count; ++i)
+    {
+        MQTTString topic = {(char*)topicFilters[i], {0, 0}};
+        topics[i] = topic;
+        granted[i] = qos[i];
+    }
+    if ((rc = subscribeBatch(count, topics, granted, timer)) != SUCCESS)
         goto exit;
-    if ((rc = sendPacket(len, timer)) != SUCCESS) // send the subscribe packet
-        goto exit;             // there was a problem
 
-    if (waitfor(SUBACK, timer) == SUBACK)      // wait for suback
+    for (int i = 0; i < count; ++i)
     {
-        int count = 0;
-        unsigned short mypacketid;
-        data.grantedQoS = 0;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &data.grantedQoS, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (data)
+            data[i].grantedQoS = granted[i];
+        if (granted[i] != 0x80 && setMessageHandler(topicFilters[i], mhs[i]) == SUCCESS)
         {
-            if (data.grantedQoS != 0x80)
-                rc = setMessageHandler(topicFilter, messageHandler);
+            for (int j = 0; j < MAX_MESSAGE_HANDLERS; ++j)
+            {
+                if (messageHandlers[j].topicFilter != 0 && strcmp(messageHandlers[j].topicFilter, topicFilters[i]) == 0)
+                    messageHandlers[j].qos = granted[i];   // to resubscribe with
+            }
         }
+        else if (granted[i] != 0x80)
+            rc = FAILURE;   // subscribed, but there's no room for the handler
     }
-    else
-        rc = FAILURE;
+    return rc;
 
 exit:
-    if (rc == FAILURE)
-        closeSession();
+    if (rc == FAILURE && isconnected)
+        connectionLost();
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::subscribe(const char* topicFilter, enum QoS qos, messageHandler messageHandler)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, c, d>::subscribe(const char* topicFilter, enum QoS qos, messageHandler messageHandler)
 {
     subackData data;
     return subscribe(topicFilter, qos, messageHandler, data);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::unsubscribe(const char* topicFilter)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, c, d>::unsubscribe(const char* topicFilter)
+{
+    return unsubscribe(&topicFilter, 1);
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, c, d>::unsubscribe(const char* const* topicFilters, int count)
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);
-    MQTTString topic = {(char*)topicFilter, {0, 0}};
+    MQTTString topics[MAX_MESSAGE_HANDLERS];
     int len = 0;
 
-    if (!isconnected)
+    if (!isconnected || count <= 0 || count > MAX_MESSAGE_HANDLERS)
         goto exit;
 
-    if ((len = MQTTSerialize_unsubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic)) <= 0)
+    for (int i = 0; i < count; ++i)
+    {
+        MQTTString topic = {(char*)topicFilters[i], {0, 0}};
+        topics[i] = topic;
+    }
+#if MQTTCLIENT_MQTT5
+    len = V5::serializeUnsubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, packetid.getNext(), count, topics);
+#else
+    len = MQTTSerialize_unsubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), count, topics);
+#endif
+    if (len <= 0)
+    {
+        if (len == MQTTPACKET_BUFFER_TOO_SHORT)
+            return BUFFER_OVERFLOW;
         goto exit;
+    }
     if ((rc = sendPacket(len, timer)) != SUCCESS) // send the unsubscribe packet
         goto exit; // there was a problem
 
@@ -916,134 +2550,462 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::un
         unsigned short mypacketid;  // should be the same as the packetid above
         if (MQTTDeserialize_unsuback(&mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
         {
-            // remove the subscription message handler associated with this topic, if there is one
-            setMessageHandler(topicFilter, 0);
+            // remove the subscription message handlers associated with these topics, if there are any
+            for (int i = 0; i < count; ++i)
+                setMessageHandler(topicFilters[i], 0);
         }
     }
     else
         rc = FAILURE;
 
 exit:
-    if (rc != SUCCESS)
-        closeSession();
+    if (rc != SUCCESS && isconnected)
+        connectionLost();
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos)
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::resend(int index, Timer& timer)
 {
-    int rc;
+    struct InflightMessage& m = inflight[index];
+    int len = 0;
+
+    if (m.pubrel)
+        len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREL, 0, m.msgid);
+    else if (m.storedlen > 0)
+    {   // loaded from the store, so send it from there a buffer at a time
+        int rc = SUCCESS;
+        for (int offset = 0; rc == SUCCESS && offset < m.storedlen; offset += len)
+        {
+            int chunk = (m.storedlen - offset < MAX_MQTT_PACKET_SIZE) ? m.storedlen - offset : MAX_MQTT_PACKET_SIZE;
+            if ((len = store->read(m.msgid, offset, sendbuf, chunk)) <= 0)
+                return FAILURE;
+            if (offset == 0)
+            {
+                MQTTHeader header = {0};
+                header.byte = sendbuf[0];
+                header.bits.dup = 1;
+                sendbuf[0] = header.byte;
+            }
+            rc = sendPacket(len, timer);
+        }
+        return rc;
+    }
+    else if (m.len > 0)
+    {
+        MQTTHeader header = {0};
+        memcpy(sendbuf, m.buf, m.len);
+        header.byte = sendbuf[0];
+        header.bits.dup = 1;
+        sendbuf[0] = header.byte;
+        return sendPacket(m.len, timer, m.payload, m.payloadlen);
+    }
+    else
+        return SUCCESS;  // not stored, as this is a clean session
+    return (len > 0) ? sendPacket(len, timer) : FAILURE;
+}
+#endif
 
-    if ((rc = sendPacket(len, timer)) != SUCCESS) // send the publish packet
-        goto exit; // there was a problem
 
-#if MQTTCLIENT_QOS1
-    if (qos == QOS1)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT_MESSAGES, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT_MESSAGES, d>::publish(const char* topicName, void* payload, size_t payloadlen,
+     unsigned short& id, enum QoS qos, bool retained, Timer& timer)
+{
+    int rc = FAILURE;
+    MQTTString topicString = MQTTString_initializer;
+    int len = 0;
+    unsigned char* gather = 0;    // the payload, if it's not copied into sendbuf
+    bool copy = false;            // whether the payload is copied into sendbuf
+    unsigned short alias = 0;     // the MQTT 5 topic alias
+
+    topicString.cstring = (char*)topicName;
+
+#if MQTTCLIENT_OFFLINE_QUEUE_SIZE > 0
+    if (!isconnected)
+    {
+        id = 0;
+        rc = enqueue(topicString, payload, payloadlen, qos, retained, timer);
+        goto exit;
+    }
+    while (!offlineQueue.empty())   // send the queued publications first, to keep them in order
     {
-        if (waitfor(PUBACK, timer) == PUBACK)
+        if (timer.expired())
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
+            lastError = RESPONSE_TIMEOUT;
+            goto exit;
         }
-        else
-            rc = FAILURE;
+        if (cycle(timer) < 0)
+            goto exit;
     }
 #endif
-#if MQTTCLIENT_QOS2
-    else if (qos == QOS2)
+    if (!isconnected)
+        goto exit;
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (qos == QOS1 || qos == QOS2)
     {
-        if (waitfor(PUBCOMP, timer) == PUBCOMP)
+        bool waited = false;
+        while (inflightMessages >= maxInflight || restoring)  // wait for a free slot, after the stored messages
         {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-                rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
+            if (timer.expired())
+            {
+                lastError = RESPONSE_TIMEOUT;
+                goto exit;
+            }
+            if (cycle(timer) < 0)
+                goto exit;
+            waited = true;
         }
-        else
-            rc = FAILURE;
+        // take the other acks which have arrived too, so that the slots they free are filled by puts to
+        // the store which share one commit, rather than each message waiting for a pass with a commit
+        while (waited && store && inflightMessages > 0)
+        {
+            int packet_type = cycle(timer, false);
+            if (packet_type < 0)
+                goto exit;
+            if (packet_type == 0)
+                break;
+        }
+        do
+            id = packetid.getNext();
+        while (findInflight(id) >= 0);  // messages restored from the store may be using ids
+  #if MQTTCLIENT_MQTT5
+        if (refusedId == id)
+            refusedId = 0;      // an earlier use of the id
+  #endif
     }
 #endif
 
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+    compress(topicString, payload, payloadlen, qos);   // after any waiting, as a message handler could publish
+#endif
+#if MQTTCLIENT_MQTT5
+    if (qos == QOS0 || cleansession)    // a packet which could be resent on a later connection can't use an alias
+        alias = topicAlias(topicString);
+#endif
+
+    copy = (payloadlen < MQTTCLIENT_GATHER_PAYLOAD_SIZE);
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+    if (payload == compressbuf)
+        copy = true;    // sized to fit, and never sent from
+#endif
+    if (copy)
+        len = serializePublish(sendbuf, MAX_MQTT_PACKET_SIZE, qos, retained, id,
+              topicString, alias, (unsigned char*)payload, payloadlen);
+    if (!copy || len == MQTTPACKET_BUFFER_TOO_SHORT)
+    {   // send the payload straight from the caller's buffer
+        gather = (unsigned char*)payload;
+        len = serializePublishHeader(sendbuf, MAX_MQTT_PACKET_SIZE, 0, qos, retained, id, topicString, alias, payloadlen);
+    }
+#if MQTTCLIENT_MQTT5
+    if (len <= 0 && alias > 0 && topicString.cstring[0] != '\0')
+        outboundAliases.remove(alias);  // it was never sent, so the server doesn't have it
+#endif
+    if (len > 0)
+        rc = sendPublish(len, id, qos, gather, gather ? payloadlen : 0, timer);
 exit:
+    return rc;
+}
+
+
+// add a QoS 1 or 2 publication to the inflight window, and the store, then send it
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::sendPublish(int len, unsigned short id, enum QoS qos,
+    unsigned char* gather, int payloadlen, Timer& timer)
+{
+    int rc = FAILURE;
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (qos == QOS1 || qos == QOS2)
+    {
+        struct InflightMessage& m = inflight[findInflight(0)];
+        m.msgid = id;
+        m.qos = qos;
+        m.pubrel = false;
+        m.len = 0;
+        m.storedlen = 0;
+        if (!cleansession)
+        {
+            if (store && store->put(id, sendbuf, len, gather, payloadlen) != 0)
+            {
+                m.msgid = 0;
+                goto exit;
+            }
+            memcpy(m.buf, sendbuf, len);
+            m.len = len;
+            m.payload = gather;
+            m.payloadlen = payloadlen;
+        }
+        ++inflightMessages;
+    }
+#endif
+
+#if MQTTCLIENT_BATCH_SIZE > 0
+    if (corked && payloadlen == 0 && len <= MQTTCLIENT_BATCH_SIZE)
+        rc = addToBatch(len, timer);
+    else
+#endif
+        rc = sendPacket(len, timer, gather, payloadlen);
     if (rc != SUCCESS)
-        closeSession();
+        connectionLost();
+exit:
     return rc;
 }
 
 
+#if MQTTCLIENT_OFFLINE_QUEUE_SIZE > 0
+// serialize a publication into the offline queue, making room for it according to the policy
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::enqueue(MQTTString& topicName, void* payload,
+    size_t payloadlen, enum QoS qos, bool retained, Timer& timer)
+{
+    const int proplen = MQTTCLIENT_MQTT5 ? 1 : 0;    // the empty MQTT 5 properties follow the packet id
+    int len = MQTTPacket_len(2 + MQTTstrlen(topicName) + payloadlen + ((qos > 0) ? 2 : 0) + proplen);
+
+    if (len > MAX_MQTT_PACKET_SIZE || !offlineQueue.accepts(len))
+        return BUFFER_OVERFLOW;
+    while (!offlineQueue.fits(len))
+    {
+        if (offlinePolicy == DROP_OLDEST)
+            offlineQueue.pop();
+        else if (offlinePolicy == DROP_NEWEST || timer.expired())
+            return FAILURE;
+        else if (isconnected)
+        {
+            if (cycle(timer) < 0)   // which sends from the queue as the inflight window allows
+                return FAILURE;
+        }
+        else if (reconnect.hostname == 0 || reconnect.next.left_ms() >= timer.left_ms() ||
+                 !SleepUntil<Timer>::wait(reconnect.next))
+            return FAILURE;         // nothing will empty the queue in time, or we can't wait without spinning
+        else
+            reconnectIfDue();
+    }
+
+    // serialized after any waiting, as that uses sendbuf, and without a topic alias, as that's per connection
+#if MQTTCLIENT_COMPRESSION_RULES > 0
+    compress(topicName, payload, payloadlen, qos);
+#endif
+    if ((len = serializePublish(sendbuf, MAX_MQTT_PACKET_SIZE, qos, retained, 0,
+              topicName, 0, (unsigned char*)payload, payloadlen)) <= 0)
+        return FAILURE;
+    return offlineQueue.push(sendbuf, len, (qos > 0) ? len - payloadlen - proplen - 2 : 0) ? SUCCESS : FAILURE;
+}
+
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
+// send queued publications while there is room in the inflight window
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int MAX_INFLIGHT_MESSAGES, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, MAX_INFLIGHT_MESSAGES, d>::drainQueue(Timer& timer)
 {
-    int rc = FAILURE;
-    Timer timer(command_timeout_ms);
+    int rc = SUCCESS;
+
+    while (rc == SUCCESS && isconnected && !offlineQueue.empty())
+    {
+        int idoffset = 0;
+        int len = offlineQueue.front(sendbuf, MAX_MQTT_PACKET_SIZE, idoffset);
+        unsigned short id = 0;
+        MQTTHeader header = {0};
+
+        header.byte = sendbuf[0];
+        if (idoffset > 0)
+        {
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+            if (inflightMessages >= maxInflight)
+                break;
+            do
+                id = packetid.getNext();
+            while (findInflight(id) >= 0);
+#endif
+            sendbuf[idoffset] = (unsigned char)(id >> 8);
+            sendbuf[idoffset + 1] = (unsigned char)id;
+        }
+        offlineQueue.pop();
+        rc = sendPublish(len, id, (enum QoS)header.bits.qos, 0, 0, timer);
+    }
+    return rc;
+}
+#endif
+
+
+#if MQTTCLIENT_POST_QUEUE_SLOTS > 0
+// called from any thread, so it uses nothing of the client's but the queue
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::post(const char* topicName, void* payload,
+    size_t payloadlen, enum QoS qos, bool retained)
+{
+    const int proplen = MQTTCLIENT_MQTT5 ? 1 : 0;    // the empty MQTT 5 properties follow the packet id
     MQTTString topicString = MQTTString_initializer;
+    size_t pos = 0;
     int len = 0;
 
-    if (!isconnected)
-        goto exit;
-
     topicString.cstring = (char*)topicName;
+    if (MQTTPacket_len(2 + MQTTstrlen(topicString) + payloadlen + ((qos > 0) ? 2 : 0) + proplen) > MAX_MQTT_PACKET_SIZE)
+        return BUFFER_OVERFLOW;
+
+    typename PostQueue<MQTTCLIENT_POST_QUEUE_SLOTS, MAX_MQTT_PACKET_SIZE>::Slot* slot = posted.claim(pos);
+    if (slot == 0)
+        return BUFFER_OVERFLOW;
+    len = serializePublish(slot->packet, MAX_MQTT_PACKET_SIZE, qos, retained, 0, topicString, 0,
+          (unsigned char*)payload, payloadlen);
+    slot->len = (len > 0) ? len : 0;
+    slot->idoffset = (qos > 0) ? len - payloadlen - proplen - 2 : 0;
+    posted.publish(slot, pos);
+    return (len > 0) ? SUCCESS : FAILURE;
+}
+
+
+// send the publications from other threads while there is room in the inflight window
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::drainPosted(Timer& timer)
+{
+    typename PostQueue<MQTTCLIENT_POST_QUEUE_SLOTS, MAX_MQTT_PACKET_SIZE>::Slot* slot = 0;
+    int rc = SUCCESS;
+
+    while (rc == SUCCESS && isconnected && (slot = posted.front()) != 0)
+    {
+        int len = slot->len;
+        int idoffset = slot->idoffset;
+        unsigned short id = 0;
+        MQTTHeader header = {0};
 
+        if (len > 0 && idoffset > 0)
+        {
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    if (qos == QOS1 || qos == QOS2)
-        id = packetid.getNext();
+            if (inflightMessages >= maxInflight)
+                break;
+            do
+                id = packetid.getNext();
+            while (findInflight(id) >= 0);
+#endif
+        }
+        memcpy(sendbuf, slot->packet, len);
+        posted.pop();   // the slot is free for the producers again
+        if (len == 0)
+            continue;
+        header.byte = sendbuf[0];
+        if (idoffset > 0)
+        {
+            sendbuf[idoffset] = (unsigned char)(id >> 8);
+            sendbuf[idoffset + 1] = (unsigned char)id;
+        }
+        rc = sendPublish(len, id, (enum QoS)header.bits.qos, 0, 0, timer);
+    }
+    return rc;
+}
 #endif
 
-    len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, qos, retained, id,
-              topicString, (unsigned char*)payload, payloadlen);
-    if (len <= 0)
-        goto exit;
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
+{
+    Timer timer(command_timeout_ms);
+    int rc = publish(topicName, payload, payloadlen, id, qos, retained, timer);
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
-    if (!cleansession)
+    // wait for all the acks for this message
+    while (rc == SUCCESS && qos != QOS0 && id != 0 && findInflight(id) >= 0)
     {
-        memcpy(pubbuf, sendbuf, len);
-        inflightMsgid = id;
-        inflightLen = len;
-        inflightQoS = qos;
-#if MQTTCLIENT_QOS2
-        pubrel = false;
-#endif
+        if (timer.expired())
+        {
+            lastError = RESPONSE_TIMEOUT;
+            rc = FAILURE;
+        }
+        else if (cycle(timer) < 0)
+            rc = FAILURE;
     }
+    if (rc != SUCCESS && isconnected)
+        connectionLost();
+  #if MQTTCLIENT_MQTT5
+    else if (rc == SUCCESS && qos != QOS0 && id != 0 && refusedId == id)
+        rc = FAILURE;   // the server refused it, but the connection is fine
+  #endif
 #endif
+    return rc;
+}
 
-    rc = publish(len, timer, qos);
-exit:
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::publishAsync(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
+{
+    Timer timer(command_timeout_ms);
+    return publish(topicName, payload, payloadlen, id, qos, retained, timer);
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::publishAsync(const char* topicName, Message& message)
+{
+    return publishAsync(topicName, message.payload, message.payloadlen, message.id, message.qos, message.retained);
+}
+
+
+#if MQTTCLIENT_BATCH_SIZE > 0
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::flush()
+{
+    int rc = SUCCESS;
+
+    corked = false;
+    if (batchlen > 0)
+    {
+        Timer timer(command_timeout_ms);
+        if ((rc = flushBatch(timer)) != SUCCESS)
+            connectionLost();
+    }
+    return rc;
+}
+
+
+template<class Network, class Timer, int a, int b, int c, class d>
+int MQTT::Client<Network, Timer, a, b, c, d>::publishBatch(const char* const* topicNames, Message* messages, int count)
+{
+    Timer timer(command_timeout_ms);
+    bool wasCorked = corked;
+    int rc = SUCCESS;
+
+    corked = true;
+    for (int i = 0; rc == SUCCESS && i < count; ++i)
+    {
+        Message& m = messages[i];
+        rc = publish(topicNames[i], m.payload, m.payloadlen, m.id, m.qos, m.retained, timer);
+    }
+    if (!wasCorked)
+    {
+        int flushrc = flush();
+        if (rc == SUCCESS)
+            rc = flushrc;
+    }
     return rc;
 }
+#endif
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, void* payload, size_t payloadlen, enum QoS qos, bool retained)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::publish(const char* topicName, void* payload, size_t payloadlen, enum QoS qos, bool retained)
 {
     unsigned short id = 0;  // dummy - not used for anything
     return publish(topicName, payload, payloadlen, id, qos, retained);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, Message& message)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::publish(const char* topicName, Message& message)
 {
     return publish(topicName, message.payload, message.payloadlen, message.qos, message.retained);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::disconnect()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, int c, class d>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, c, d>::disconnect()
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);     // we might wait for incomplete incoming publishes to complete
     int len = MQTTSerialize_disconnect(sendbuf, MAX_MQTT_PACKET_SIZE);
     if (len > 0)
         rc = sendPacket(len, timer);            // send the disconnect packet
+    reconnect.hostname = 0;
     closeSession();
     return rc;
 }
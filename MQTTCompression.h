@@ -0,0 +1,481 @@
+#if !defined(MQTT_COMPRESSION_H)
+#define MQTT_COMPRESSION_H
+
+#include "MQTTPacket.h"
+#include <string.h>
+
+#if !defined(MQTT_COMPRESSION_HASH_BITS)
+    #define MQTT_COMPRESSION_HASH_BITS 9    // the match finders' hash table has 2^this 2-byte entries, on the stack
+#endif
+
+/**
+ * Payload compression for the client's per-topic compression rules.  A compressed payload starts with
+ * a marker header: the byte 0xFF, which can't start a UTF-8 text payload, the codec id, and the length
+ * of the original payload, encoded as an MQTT remaining length.  The rest is the codec's output.
+ * A receiver with no rule for the topic sees the compressed payload as it was sent.
+ */
+namespace MQTT
+{
+
+/**
+ * @struct Codec
+ * @brief a compression algorithm, identified in the marker header by its id
+ *
+ * Both functions return the length of their output, or -1 if the output would be longer than outlen,
+ * or, for decompress, if the input is invalid.  They must not use the heap.
+ */
+struct Codec
+{
+    unsigned char id;   // 1 and 2 are the bundled codecs.  128 and up are left for applications
+    int (*compress)(const unsigned char* in, int inlen, unsigned char* out, int outlen);
+    int (*decompress)(const unsigned char* in, int inlen, unsigned char* out, int outlen);
+};
+
+const unsigned char COMPRESSION_MARKER = 0xFF;
+
+namespace LZ4
+{
+
+/**
+ * The LZ4 block format, without the frame, so it's fast and small, at some cost in ratio.  The block
+ * is limited to 64K, which is more than any payload the client will compress.
+ */
+const int MIN_MATCH = 4;
+const int LAST_LITERALS = 5;    // the block must end with at least this many literals
+const int MATCH_LIMIT = 12;     // and the last match must start at least this far from the end
+
+inline unsigned int hash(const unsigned char* p)
+{
+    unsigned int value = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+    return (value * 2654435761U) >> (32 - MQTT_COMPRESSION_HASH_BITS);
+}
+
+// write the part of a length beyond what fits in the token
+inline bool writeLength(unsigned char*& op, unsigned char* oend, int len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (op == oend)
+            return false;
+        *op++ = 255;
+    }
+    if (op == oend)
+        return false;
+    *op++ = (unsigned char)len;
+    return true;
+}
+
+// write a sequence: the literals from anchor, then the match, if there is one
+inline bool writeSequence(unsigned char*& op, unsigned char* oend, const unsigned char* anchor, int literals,
+    int offset, int matchlen)
+{
+    unsigned char* token = op;
+
+    if (op == oend)
+        return false;
+    *op++ = (unsigned char)(((literals < 15) ? literals : 15) << 4);
+    if (literals >= 15 && !writeLength(op, oend, literals - 15))
+        return false;
+    if (literals > oend - op)
+        return false;
+    memcpy(op, anchor, literals);
+    op += literals;
+    if (matchlen == 0)
+        return true;
+    if (oend - op < 2)
+        return false;
+    *op++ = (unsigned char)offset;
+    *op++ = (unsigned char)(offset >> 8);
+    matchlen -= MIN_MATCH;
+    *token |= (matchlen < 15) ? matchlen : 15;
+    return matchlen < 15 || writeLength(op, oend, matchlen - 15);
+}
+
+inline int compress(const unsigned char* in, int inlen, unsigned char* out, int outlen)
+{
+    unsigned short table[1 << MQTT_COMPRESSION_HASH_BITS];     // input positions, by the hash of 4 bytes
+    const unsigned char* ip = in;
+    const unsigned char* anchor = in;   // start of the literals not yet written
+    const unsigned char* end = in + inlen;
+    unsigned char* op = out;
+    unsigned char* oend = out + outlen;
+
+    if (inlen > 65535)
+        return -1;
+    memset(table, 0, sizeof(table));
+    while (inlen >= MATCH_LIMIT + 1 && ip <= end - MATCH_LIMIT)
+    {
+        unsigned int h = hash(ip);
+        const unsigned char* ref = in + table[h];
+
+        table[h] = (unsigned short)(ip - in);
+        if (ref >= ip || memcmp(ref, ip, MIN_MATCH) != 0)
+        {
+            ++ip;
+            continue;
+        }
+        int len = MIN_MATCH;
+        while (ip + len < end - LAST_LITERALS && ref[len] == ip[len])
+            ++len;
+        if (!writeSequence(op, oend, anchor, ip - anchor, ip - ref, len))
+            return -1;
+        ip += len;
+        anchor = ip;
+    }
+    if (!writeSequence(op, oend, anchor, end - anchor, 0, 0))
+        return -1;
+    return op - out;
+}
+
+// read the part of a length beyond what fits in the token
+inline bool readLength(const unsigned char*& ip, const unsigned char* iend, int& len)
+{
+    unsigned char byte = 255;
+
+    while (byte == 255)
+    {
+        if (ip == iend)
+            return false;
+        byte = *ip++;
+        len += byte;
+    }
+    return true;
+}
+
+inline int decompress(const unsigned char* in, int inlen, unsigned char* out, int outlen)
+{
+    const unsigned char* ip = in;
+    const unsigned char* iend = in + inlen;
+    unsigned char* op = out;
+    unsigned char* oend = out + outlen;
+
+    while (ip < iend)
+    {
+        unsigned char token = *ip++;
+        int literals = token >> 4;
+
+        if (literals == 15 && !readLength(ip, iend, literals))
+            return -1;
+        if (literals > iend - ip || literals > oend - op)
+            return -1;
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == iend)
+            break;      // the last sequence has no match
+        if (iend - ip < 2)
+            return -1;
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        int len = token & 15;
+        if (len == 15 && !readLength(ip, iend, len))
+            return -1;
+        len += MIN_MATCH;
+        if (offset == 0 || offset > op - out || len > oend - op)
+            return -1;
+        for (const unsigned char* ref = op - offset; len > 0; --len)
+            *op++ = *ref++;     // byte by byte, as the match can overlap its own output
+    }
+    return op - out;
+}
+
+}
+
+namespace Deflate
+{
+
+/**
+ * Raw deflate (RFC 1951) with the fixed Huffman codes, which don't have to be sent, so small payloads
+ * compress better than with LZ4, for more CPU.  The output can be inflated by zlib.  Decompression
+ * accepts fixed Huffman and stored blocks, which is what this compressor writes, but not the dynamic
+ * Huffman blocks written by other deflate implementations.
+ */
+const int MIN_MATCH = 3;
+const int MAX_MATCH = 258;
+const int WINDOW = 32768;
+
+const unsigned short lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const unsigned char lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const unsigned short distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const unsigned char distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9,
+    10, 10, 11, 11, 12, 12, 13, 13};
+
+class BitWriter
+{
+public:
+    BitWriter(unsigned char* out, int outlen) : out(out), op(out), oend(out + outlen), bits(0), count(0), overflow(false) {}
+
+    // extra bits and header fields, least significant bit first
+    void put(unsigned int value, int n)
+    {
+        bits |= value << count;
+        for (count += n; count >= 8; count -= 8)
+        {
+            if (op == oend)
+                overflow = true;
+            else
+                *op++ = (unsigned char)bits;
+            bits >>= 8;
+        }
+    }
+
+    // Huffman codes, most significant bit first
+    void putCode(unsigned int code, int n)
+    {
+        unsigned int reversed = 0;
+        for (int i = 0; i < n; ++i, code >>= 1)
+            reversed = (reversed << 1) | (code & 1);
+        put(reversed, n);
+    }
+
+    void putLiteral(int symbol)
+    {
+        if (symbol < 144)
+            putCode(0x30 + symbol, 8);
+        else if (symbol < 256)
+            putCode(0x190 + symbol - 144, 9);
+        else if (symbol < 280)
+            putCode(symbol - 256, 7);
+        else
+            putCode(0xC0 + symbol - 280, 8);
+    }
+
+    void putMatch(int len, int distance)
+    {
+        int i = 28;
+        while (lengthBase[i] > len)
+            --i;
+        putLiteral(257 + i);
+        put(len - lengthBase[i], lengthExtra[i]);
+        i = 29;
+        while (distanceBase[i] > distance)
+            --i;
+        putCode(i, 5);
+        put(distance - distanceBase[i], distanceExtra[i]);
+    }
+
+    // returns the length written, or -1 if it didn't fit
+    int finish()
+    {
+        if (count > 0)
+            put(0, 8 - count);
+        return overflow ? -1 : op - out;
+    }
+
+private:
+    unsigned char* out;
+    unsigned char* op;
+    unsigned char* oend;
+    unsigned int bits;
+    int count;
+    bool overflow;
+};
+
+inline unsigned int hash(const unsigned char* p)
+{
+    unsigned int value = p[0] | (p[1] << 8) | (p[2] << 16);
+    return (value * 2654435761U) >> (32 - MQTT_COMPRESSION_HASH_BITS);
+}
+
+inline int compress(const unsigned char* in, int inlen, unsigned char* out, int outlen)
+{
+    unsigned short table[1 << MQTT_COMPRESSION_HASH_BITS];     // input positions, by the hash of 3 bytes
+    BitWriter writer(out, outlen);
+    int pos = 0;
+
+    if (inlen > 65535)
+        return -1;
+    memset(table, 0, sizeof(table));
+    writer.put(1, 1);   // the final block
+    writer.put(1, 2);   // with the fixed Huffman codes
+    while (pos < inlen)
+    {
+        int len = 0;
+        if (pos + MIN_MATCH <= inlen)
+        {
+            unsigned int h = hash(&in[pos]);
+            int ref = table[h];
+            table[h] = (unsigned short)pos;
+            if (ref < pos && pos - ref <= WINDOW)
+            {
+                int max = (inlen - pos < MAX_MATCH) ? inlen - pos : MAX_MATCH;
+                while (len < max && in[ref + len] == in[pos + len])
+                    ++len;
+            }
+            if (len >= MIN_MATCH)
+                writer.putMatch(len, pos - ref);
+        }
+        if (len < MIN_MATCH)
+        {
+            writer.putLiteral(in[pos]);
+            len = 1;
+        }
+        pos += len;
+    }
+    writer.putLiteral(256);     // end of block
+    return writer.finish();
+}
+
+class BitReader
+{
+public:
+    BitReader(const unsigned char* in, int inlen) : ip(in), iend(in + inlen), bits(0), count(0), overrun(false) {}
+
+    unsigned int get(int n)
+    {
+        while (count < n)
+        {
+            if (ip == iend)
+            {
+                overrun = true;
+                return 0;
+            }
+            bits |= (unsigned int)*ip++ << count;
+            count += 8;
+        }
+        unsigned int value = bits & ((1U << n) - 1);
+        bits >>= n;
+        count -= n;
+        return value;
+    }
+
+    unsigned int getCode(int n)
+    {
+        unsigned int code = 0;
+        for (int i = 0; i < n; ++i)
+            code = (code << 1) | get(1);
+        return code;
+    }
+
+    // a literal or length symbol in the fixed Huffman code, or -1
+    int getLiteral()
+    {
+        unsigned int code = getCode(7);
+        if (code <= 0x17)
+            return 256 + code;
+        code = (code << 1) | get(1);
+        if (code >= 0x30 && code <= 0xBF)
+            return code - 0x30;
+        if (code >= 0xC0 && code <= 0xC7)
+            return 280 + code - 0xC0;
+        code = (code << 1) | get(1);
+        return (code >= 0x190) ? 144 + code - 0x190 : -1;
+    }
+
+    void align()
+    {
+        bits >>= count % 8;
+        count -= count % 8;
+    }
+
+    const unsigned char* ip;
+    const unsigned char* iend;
+    unsigned int bits;
+    int count;
+    bool overrun;
+};
+
+inline int decompress(const unsigned char* in, int inlen, unsigned char* out, int outlen)
+{
+    BitReader reader(in, inlen);
+    unsigned char* op = out;
+    unsigned char* oend = out + outlen;
+    unsigned int last = 0;
+
+    while (!last)
+    {
+        last = reader.get(1);
+        unsigned int type = reader.get(2);
+        if (type == 0)
+        {   // stored
+            reader.align();
+            unsigned int len = reader.get(16);
+            if (reader.get(16) != (~len & 0xFFFF) || (int)len > oend - op)
+                return -1;
+            while (len-- > 0 && !reader.overrun)
+                *op++ = (unsigned char)reader.get(8);
+        }
+        else if (type == 1)
+        {   // fixed Huffman codes
+            int symbol;
+            while ((symbol = reader.getLiteral()) != 256 && !reader.overrun)
+            {
+                if (symbol < 0 || symbol > 285)
+                    return -1;
+                if (symbol < 256)
+                {
+                    if (op == oend)
+                        return -1;
+                    *op++ = (unsigned char)symbol;
+                    continue;
+                }
+                int len = lengthBase[symbol - 257] + reader.get(lengthExtra[symbol - 257]);
+                unsigned int code = reader.getCode(5);
+                if (code > 29)
+                    return -1;
+                int distance = distanceBase[code] + reader.get(distanceExtra[code]);
+                if (distance > op - out || len > oend - op)
+                    return -1;
+                for (const unsigned char* ref = op - distance; len > 0; --len)
+                    *op++ = *ref++;
+            }
+        }
+        else
+            return -1;  // dynamic Huffman codes, or invalid
+        if (reader.overrun)
+            return -1;
+    }
+    return op - out;
+}
+
+}
+
+const Codec LZ4Codec = {1, LZ4::compress, LZ4::decompress};
+const Codec DeflateCodec = {2, Deflate::compress, Deflate::decompress};
+
+/** Compress a payload, with the marker header
+ *  @return the length of the compressed payload, or -1 if it would be longer than outlen
+ */
+inline int compressPayload(const Codec& codec, const unsigned char* in, int inlen, unsigned char* out, int outlen)
+{
+    if (outlen < 6)
+        return -1;
+    out[0] = COMPRESSION_MARKER;
+    out[1] = codec.id;
+    int header = 2 + MQTTPacket_encode(&out[2], inlen);
+    int len = codec.compress(in, inlen, &out[header], outlen - header);
+    return (len < 0) ? -1 : header + len;
+}
+
+/** The id of the codec a payload was compressed with
+ *  @return the codec id, or -1 if the payload doesn't start with the marker header
+ */
+inline int compressedWith(const unsigned char* in, int inlen)
+{
+    return (inlen >= 3 && in[0] == COMPRESSION_MARKER) ? in[1] : -1;
+}
+
+/** Decompress a payload, which must have been compressed with this codec
+ *  @return the length of the original payload, or -1 if it is longer than outlen, or the data is invalid
+ */
+inline int decompressPayload(const Codec& codec, const unsigned char* in, int inlen, unsigned char* out, int outlen)
+{
+    int origlen = 0;
+    int header = 2;
+
+    for (int multiplier = 1; header < inlen && header < 6; multiplier *= 128)
+    {
+        origlen += (in[header] & 127) * multiplier;
+        if ((in[header++] & 128) == 0)
+            break;
+    }
+    if (header >= inlen || (in[header - 1] & 128) != 0 || origlen > outlen)
+        return -1;
+    return (codec.decompress(&in[header], inlen - header, out, origlen) == origlen) ? origlen : -1;
+}
+
+}
+
+#endif
@@ -0,0 +1,326 @@
+#if !defined(MQTT_FILESTORE_H)
+#define MQTT_FILESTORE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace MQTT
+{
+
+/**
+ * @class FileStore
+ * @brief a durable message store for POSIX systems, as an append-only log file
+ *
+ * Each put or remove appends one record to the log, and commit syncs the file once for all the records
+ * appended since the last commit.  Removes alone don't need a sync, as a remove lost in a crash only
+ * means that an acknowledged packet is resent, so they are made durable with the next put.  On open the
+ * log is read to rebuild the index of stored packets, a torn or corrupt record at the end, from a crash
+ * part way through a write, being truncated away.  The log is only compacted when the application calls
+ * compact, at a time when the copying won't hold up anything: once it has grown past a size limit and
+ * most of it is dead, the live packets are copied to a new log which atomically replaces the old one.
+ * @param MAX_MESSAGES the number of packets which can be stored, at least MAX_INFLIGHT_MESSAGES
+ */
+template<int MAX_MESSAGES = 16>
+class FileStore
+{
+public:
+
+    /** @param path - the log file, created if it doesn't exist
+     *  @param compactSize - the log size past which compact copies it, if more than half of it is dead
+     */
+    FileStore(const char* path, long compactSize = 65536) : fd(-1), count(0), end(0), live(0), dirty(false), compactSize(compactSize)
+    {
+        snprintf(this->path, sizeof(this->path), "%s", path);
+    }
+
+    ~FileStore()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    int open()
+    {
+        Record r;
+
+        if (fd < 0 && (fd = ::open(path, O_RDWR | O_CREAT, 0644)) < 0)
+            return -1;
+        count = 0;
+        end = live = 0;
+        while (pread(fd, &r, sizeof(r), end) == sizeof(r) && (r.type == PUT || r.type == REMOVE) && r.len >= 0)
+        {
+            off_t offset = end + sizeof(r);
+            if (r.type == PUT && (checksum(offset, r.len) != r.checksum || index(r.id, offset, r.len) != 0))
+                break;
+            if (r.type == REMOVE)
+                unindex(r.id);
+            end = offset + ((r.type == PUT) ? r.len : 0);
+        }
+        if (ftruncate(fd, end) != 0)   // drop any incomplete record
+            return -1;
+        return count;
+    }
+
+    int put(unsigned short id, const unsigned char* header, int headerlen, const unsigned char* payload, int payloadlen)
+    {
+        Record r = {PUT, 0, id, headerlen + payloadlen, FNV_BASIS};
+        off_t offset = end + sizeof(r);
+
+        if (count == MAX_MESSAGES && find(id) < 0)
+            return -1;
+        r.checksum = checksum(checksum(r.checksum, header, headerlen), payload, payloadlen);
+        struct iovec iov[3] = {{&r, sizeof(r)}, {(void*)header, (size_t)headerlen}, {(void*)payload, (size_t)payloadlen}};
+        if (append(iov, (payloadlen > 0) ? 3 : 2) != 0 || index(id, offset, r.len) != 0)
+            return -1;
+        dirty = true;
+        return 0;
+    }
+
+    int remove(unsigned short id)
+    {
+        Record r = {REMOVE, 0, id, 0, 0};
+        struct iovec iov[1] = {{&r, sizeof(r)}};
+
+        if (unindex(id) != 0)
+            return -1;
+        return append(iov, 1);
+    }
+
+    int get(int index, unsigned short& id, int& len)
+    {
+        if (index < 0 || index >= count)
+            return -1;
+        id = entries[index].id;
+        len = entries[index].len;
+        return 0;
+    }
+
+    int read(unsigned short id, int offset, unsigned char* buf, int len)
+    {
+        int i = find(id);
+
+        if (i < 0 || offset > entries[i].len)
+            return -1;
+        if (len > entries[i].len - offset)
+            len = entries[i].len - offset;
+        return pread(fd, buf, len, entries[i].offset + offset);
+    }
+
+    int commit()
+    {
+        if (!dirty)
+            return 0;
+#if defined(__APPLE__)
+        if (fsync(fd) != 0)
+#else
+        if (fdatasync(fd) != 0)
+#endif
+            return -1;      // still dirty, so the next commit tries again
+        dirty = false;
+        return 0;
+    }
+
+    void clear()
+    {
+        if (fd >= 0 && ftruncate(fd, 0) == 0)
+            fsync(fd);
+        count = 0;
+        end = live = 0;
+        dirty = false;
+    }
+
+    /** Copy the live packets to a new log, and rename it over the old one, if the log is past the size
+     *  limit and more than half of it is dead.  This is the only method which can take time in proportion
+     *  to the stored packets, so it is left to the application to call, for instance between yields.
+     *  @param force - compact whatever the size of the log
+     *  @return 0 if the log was compacted or didn't need to be, -1 if it couldn't be
+     */
+    int compact(bool force = false)
+    {
+        char tmp[sizeof(path) + 4];
+        unsigned char buf[256];
+        off_t offsets[MAX_MESSAGES];
+        off_t newend = 0;
+        int newfd;
+
+        if (fd < 0 || (!force && (end <= compactSize || live >= end / 2)))
+            return 0;
+        if (commit() != 0)
+            return -1;
+        snprintf(tmp, sizeof(tmp), "%s.new", path);
+        if ((newfd = ::open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+            return -1;
+        for (int i = 0; i < count; ++i)
+        {
+            Record r = {PUT, 0, entries[i].id, entries[i].len, FNV_BASIS};
+            r.checksum = checksum(entries[i].offset, entries[i].len);
+            if (pwrite(newfd, &r, sizeof(r), newend) != sizeof(r))
+                goto fail;
+            newend += sizeof(r);
+            offsets[i] = newend;
+            for (int done = 0; done < entries[i].len; )
+            {
+                int n = read(entries[i].id, done, buf, sizeof(buf));
+                if (n <= 0 || pwrite(newfd, buf, n, newend) != n)
+                    goto fail;
+                done += n;
+                newend += n;
+            }
+        }
+        if (fsync(newfd) != 0 || rename(tmp, path) != 0)
+            goto fail;
+        close(fd);
+        fd = newfd;
+        end = newend;
+        for (int i = 0; i < count; ++i)
+            entries[i].offset = offsets[i];
+        return syncdir();   // the rename isn't durable until the directory entry is
+    fail:
+        close(newfd);
+        unlink(tmp);
+        return -1;
+    }
+
+private:
+
+    enum { PUT = 1, REMOVE = 2 };
+    static const uint32_t FNV_BASIS = 2166136261u;
+
+    struct Record
+    {
+        uint8_t type;
+        uint8_t reserved;
+        uint16_t id;
+        int32_t len;        // of the packet which follows a PUT
+        uint32_t checksum;  // FNV-1a of the packet
+    };
+
+    static uint32_t checksum(uint32_t hash, const unsigned char* data, int len)
+    {
+        for (int i = 0; i < len; ++i)
+            hash = (hash ^ data[i]) * 16777619u;
+        return hash;
+    }
+
+    uint32_t checksum(off_t offset, int len)
+    {
+        unsigned char buf[256];
+        uint32_t hash = FNV_BASIS;
+
+        while (len > 0)
+        {
+            int n = pread(fd, buf, (len < (int)sizeof(buf)) ? len : sizeof(buf), offset);
+            if (n <= 0)
+                return ~hash;   // a short read can't match
+            hash = checksum(hash, buf, n);
+            offset += n;
+            len -= n;
+        }
+        return hash;
+    }
+
+    int append(struct iovec* iov, int iovcnt)
+    {
+        ssize_t len = 0;
+
+        for (int i = 0; i < iovcnt; ++i)
+            len += iov[i].iov_len;
+        if (fd < 0 || lseek(fd, end, SEEK_SET) != end || writev(fd, iov, iovcnt) != len)
+        {
+            if (fd >= 0 && ftruncate(fd, end) != 0)   // don't leave part of a record before the next one
+                return -1;
+            return -1;
+        }
+        end += len;
+        return 0;
+    }
+
+    int find(unsigned short id)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (entries[i].id == id)
+                return i;
+        }
+        return -1;
+    }
+
+    // record the location of a packet, keeping the position of one it replaces
+    int index(unsigned short id, off_t offset, int len)
+    {
+        int i = find(id);
+
+        if (i < 0)
+        {
+            if (count == MAX_MESSAGES)
+                return -1;
+            i = count++;
+            entries[i].id = id;
+        }
+        else
+            live -= entries[i].len;
+        entries[i].offset = offset;
+        entries[i].len = len;
+        live += len;
+        return 0;
+    }
+
+    int unindex(unsigned short id)
+    {
+        int i = find(id);
+
+        if (i < 0)
+            return -1;
+        live -= entries[i].len;
+        --count;
+        for (; i < count; ++i)
+            entries[i] = entries[i + 1];
+        return 0;
+    }
+
+    int syncdir()
+    {
+        char dir[sizeof(path)];
+        const char* slash = strrchr(path, '/');
+        int dirfd, rc;
+
+        if (slash == 0)
+            snprintf(dir, sizeof(dir), ".");
+        else if (slash == path)
+            snprintf(dir, sizeof(dir), "/");
+        else
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+        if ((dirfd = ::open(dir, O_RDONLY)) < 0)
+            return -1;
+        rc = fsync(dirfd);
+        close(dirfd);
+        return rc;
+    }
+
+    char path[256];
+    int fd;
+
+    struct Entry
+    {
+        unsigned short id;
+        off_t offset;       // of the packet in the log
+        int len;
+    } entries[MAX_MESSAGES];    // oldest first
+    int count;
+
+    off_t end;          // of the log
+    long live;          // bytes of packets still stored
+    bool dirty;         // puts appended since the last commit
+    long compactSize;
+
+};
+
+}
+
+#endif
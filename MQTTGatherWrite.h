@@ -0,0 +1,45 @@
+#if !defined(MQTT_GATHER_WRITE_H)
+#define MQTT_GATHER_WRITE_H
+
+namespace MQTT
+{
+
+/**
+ * Detects whether a Network class has a gather write method, which sends two buffers as one:
+ *    int write(unsigned char* header, int headerlen, unsigned char* payload, int payloadlen, int timeout)
+ * returning the number of bytes written from both buffers together, or -1 on error.
+ */
+template<class Network>
+class hasGatherWrite
+{
+    template<class T, int (T::*)(unsigned char*, int, unsigned char*, int, int)> struct Check;
+    template<class T> static char test(Check<T, &T::write>*);
+    template<class T> static long test(...);
+public:
+    enum { value = sizeof(test<Network>(0)) == sizeof(char) };
+};
+
+// writes a header and payload with the network's gather write if it has one, or just the header if not
+template<bool gather>
+struct GatherWrite
+{
+    template<class Network>
+    static int write(Network& network, unsigned char* header, int headerlen, unsigned char* payload, int payloadlen, int timeout)
+    {
+        return network.write(header, headerlen, payload, payloadlen, timeout);
+    }
+};
+
+template<>
+struct GatherWrite<false>
+{
+    template<class Network>
+    static int write(Network& network, unsigned char* header, int headerlen, unsigned char*, int, int timeout)
+    {
+        return network.write(header, headerlen, timeout);
+    }
+};
+
+}
+
+#endif
@@ -32,7 +32,6 @@
     fprintf(STREAM, "ERROR: %s L#%d ", __PRETTY_FUNCTION__, __LINE__); \
     fprintf(STREAM, ##__VA_ARGS__); \
     fflush(STREAM); \
-    exit(1); \
     }
 #endif
 
@@ -0,0 +1,346 @@
+#if !defined(MQTTLOOPBACK_H)
+#define MQTTLOOPBACK_H
+
+#include "MQTTPacket.h"
+#include "MQTTTopicTrie.h"
+
+/**
+ * @class MQTTLoopback
+ * @brief Network implementation with a minimal MQTT 3.1.1 broker in place of a real connection
+ *
+ * Each packet written by the client is handled as soon as it is complete, and the broker's
+ * responses are queued to be read back.  Publications are routed to the client's own
+ * subscriptions, so a client can publish to itself, and the whole exchange happens in memory on
+ * the calling thread.  This makes it possible to exercise and time the client with no hardware or
+ * broker.  Only one connection is served, and retained messages and wills are not supported.
+ * @param BUFFER_SIZE the size of each of the buffers holding data in flight in either direction
+ * @param MAX_SUBSCRIPTIONS the number of topic filters which can be subscribed to
+ * @param MAX_FILTER_LENGTH the longest topic filter which can be subscribed to
+ */
+template<int BUFFER_SIZE = 1024, int MAX_SUBSCRIPTIONS = 8, int MAX_FILTER_LENGTH = 64>
+class MQTTLoopback
+{
+public:
+
+    MQTTLoopback() : connected(false), session(false), nextId(0)
+    {
+        for (int i = 0; i < MAX_SUBSCRIPTIONS; ++i)
+            subscriptions[i].filter[0] = '\0';
+        for (int i = 0; i <= DISCONNECT; ++i)
+            counts[i] = 0;
+        reset();
+    }
+
+    int connect(const char* = 0, int = 0, int = 0)
+    {
+        reset();
+        connected = true;
+        return 0;
+    }
+
+    /* returns the number of bytes read, which could be 0.
+       -1 if the connection has been dropped
+    */
+    int read(unsigned char* buffer, int len, int)
+    {
+        int bytes = 0;
+
+        if (!connected)
+            return -1;
+        while (bytes < len && outlen > 0)
+        {
+            buffer[bytes++] = outbuf[outstart];
+            outstart = (outstart + 1) % BUFFER_SIZE;
+            --outlen;
+        }
+        return bytes;
+    }
+
+    int write(unsigned char* buffer, int len, int)
+    {
+        if (!connected || inlen + len > BUFFER_SIZE)
+            return -1;
+        memcpy(&inbuf[inlen], buffer, len);
+        inlen += len;
+
+        int packetlen;
+        while ((packetlen = complete()) > 0)
+        {
+            if (handle(packetlen) != 0)
+                return -1;
+            inlen -= packetlen;
+            memmove(inbuf, &inbuf[packetlen], inlen);
+        }
+        return (packetlen < 0) ? -1 : len;
+    }
+
+    int disconnect()
+    {
+        connected = false;
+        return 0;
+    }
+
+    /** Break the connection, as if it had been lost, so that reads and writes fail until the
+     *  next connect
+     */
+    void drop()
+    {
+        connected = false;
+    }
+
+    /** Queue data to be read by the client, as though sent by the broker
+     *  @return 0 on success, -1 if there is not enough space
+     */
+    int inject(const unsigned char* buffer, int len)
+    {
+        if (outlen + len > BUFFER_SIZE)
+            return -1;
+        for (int i = 0; i < len; ++i)
+            outbuf[(outstart + outlen++) % BUFFER_SIZE] = buffer[i];
+        return 0;
+    }
+
+    /** The number of bytes waiting to be read by the client
+     */
+    int pending()
+    {
+        return outlen;
+    }
+
+    /** The number of packets of a type which the broker has received from the client
+     *  @param packettype - the MQTT packet type, such as PUBLISH
+     */
+    int count(int packettype)
+    {
+        return (packettype > 0 && packettype <= DISCONNECT) ? counts[packettype] : 0;
+    }
+
+private:
+
+    void reset()
+    {
+        inlen = outstart = outlen = 0;
+    }
+
+    // the length of the complete packet at the start of inbuf, 0 if it is not complete yet, -1 if it never will be
+    int complete()
+    {
+        int rem_len = 0;
+        int multiplier = 1;
+        int i = 1;
+
+        do
+        {
+            if (i >= inlen)
+                return 0;
+            if (i > 4)
+                return -1; // malformed remaining length
+            rem_len += (inbuf[i] & 127) * multiplier;
+            multiplier *= 128;
+        } while ((inbuf[i++] & 128) != 0);
+
+        if (i + rem_len > BUFFER_SIZE)
+            return -1;
+        return (i + rem_len <= inlen) ? i + rem_len : 0;
+    }
+
+    int handle(int len)
+    {
+        MQTTHeader header = {0};
+        unsigned char buf[BUFFER_SIZE];
+        int rc = 0;
+
+        header.byte = inbuf[0];
+        if (header.bits.type < CONNECT || header.bits.type > DISCONNECT)
+            return -1;
+        counts[header.bits.type]++;
+        switch (header.bits.type)
+        {
+            case CONNECT:
+            {
+                MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+                if (MQTTDeserialize_connect(&data, inbuf, len) != 1)
+                    return -1;
+                if (data.cleansession)
+                    unsubscribeAll();
+                rc = respond(buf, MQTTSerialize_connack(buf, BUFFER_SIZE, 0, session && !data.cleansession));
+                session = true;
+                break;
+            }
+            case PUBLISH:
+            {
+                unsigned char dup, retained;
+                int qos, payloadlen;
+                unsigned short id;
+                MQTTString topicName = MQTTString_initializer;
+                unsigned char* payload;
+                if (MQTTDeserialize_publish(&dup, &qos, &retained, &id, &topicName, &payload, &payloadlen, inbuf, len) != 1)
+                    return -1;
+                if (qos == 1)
+                    rc = respond(buf, MQTTSerialize_ack(buf, BUFFER_SIZE, PUBACK, 0, id));
+                else if (qos == 2)
+                    rc = respond(buf, MQTTSerialize_ack(buf, BUFFER_SIZE, PUBREC, 0, id));
+                if (rc == 0)
+                    rc = route(topicName, qos, payload, payloadlen);
+                break;
+            }
+            case PUBREC:
+            case PUBREL:
+            {
+                unsigned char type, dup;
+                unsigned short id;
+                if (MQTTDeserialize_ack(&type, &dup, &id, inbuf, len) != 1)
+                    return -1;
+                if (type == PUBREC)
+                    rc = respond(buf, MQTTSerialize_ack(buf, BUFFER_SIZE, PUBREL, 0, id));
+                else
+                    rc = respond(buf, MQTTSerialize_ack(buf, BUFFER_SIZE, PUBCOMP, 0, id));
+                break;
+            }
+            case SUBSCRIBE:
+            {
+                unsigned char dup;
+                unsigned short id;
+                int count;
+                MQTTString filters[MAX_SUBSCRIPTIONS];
+                int qoss[MAX_SUBSCRIPTIONS];
+                if (MQTTDeserialize_subscribe(&dup, &id, MAX_SUBSCRIPTIONS, &count, filters, qoss, inbuf, len) != 1)
+                    return -1;
+                for (int i = 0; i < count; ++i)
+                {
+                    if (subscribe(filters[i], qoss[i]) != 0)
+                        qoss[i] = 0x80;
+                }
+                rc = respond(buf, MQTTSerialize_suback(buf, BUFFER_SIZE, id, count, qoss));
+                break;
+            }
+            case UNSUBSCRIBE:
+            {
+                unsigned char dup;
+                unsigned short id;
+                int count;
+                MQTTString filters[MAX_SUBSCRIPTIONS];
+                if (MQTTDeserialize_unsubscribe(&dup, &id, MAX_SUBSCRIPTIONS, &count, filters, inbuf, len) != 1)
+                    return -1;
+                for (int i = 0; i < count; ++i)
+                    unsubscribe(filters[i]);
+                rc = respond(buf, MQTTSerialize_unsuback(buf, BUFFER_SIZE, id));
+                break;
+            }
+            case PINGREQ:
+            {
+                const unsigned char pingresp[] = {PINGRESP << 4, 0};
+                rc = inject(pingresp, sizeof(pingresp));
+                break;
+            }
+            case DISCONNECT:
+                connected = false;
+                break;
+            default:    // PUBACK and PUBCOMP for our publications need no response
+                break;
+        }
+        return rc;
+    }
+
+    int respond(unsigned char* buf, int len)
+    {
+        return (len > 0) ? inject(buf, len) : -1;
+    }
+
+    // send a publication back to the client once for each of its matching subscriptions
+    int route(MQTTString& topicName, int qos, unsigned char* payload, int payloadlen)
+    {
+        int matched[MAX_SUBSCRIPTIONS];
+        unsigned char buf[BUFFER_SIZE];
+        int count = trie.match(topicName.lenstring.data, topicName.lenstring.len, matched, MAX_SUBSCRIPTIONS);
+        int rc = 0;
+
+        for (int i = 0; i < count && rc == 0; ++i)
+        {
+            int granted = (subscriptions[matched[i]].qos < qos) ? subscriptions[matched[i]].qos : qos;
+            unsigned short id = 0;
+            if (granted > 0)
+                id = nextId = (nextId == MAX_PACKET_ID) ? 1 : nextId + 1;
+            rc = respond(buf, MQTTSerialize_publish(buf, BUFFER_SIZE, 0, granted, 0, id, topicName, payload, payloadlen));
+        }
+        return rc;
+    }
+
+    int subscribe(MQTTString& filter, int qos)
+    {
+        int freeSlot = -1;
+        int len = filter.lenstring.len;
+
+        if (len >= MAX_FILTER_LENGTH)
+            return -1;
+        for (int i = 0; i < MAX_SUBSCRIPTIONS; ++i)
+        {
+            if (subscriptions[i].filter[0] == '\0')
+            {
+                if (freeSlot == -1)
+                    freeSlot = i;
+            }
+            else if (MQTTPacket_equals(&filter, subscriptions[i].filter))
+            {
+                subscriptions[i].qos = qos;    // a repeated subscription replaces the existing one
+                return 0;
+            }
+        }
+        if (freeSlot == -1)
+            return -1;
+        memcpy(subscriptions[freeSlot].filter, filter.lenstring.data, len);
+        subscriptions[freeSlot].filter[len] = '\0';
+        subscriptions[freeSlot].qos = qos;
+        if (trie.add(subscriptions[freeSlot].filter, freeSlot) != 0)
+        {
+            subscriptions[freeSlot].filter[0] = '\0';
+            return -1;
+        }
+        return 0;
+    }
+
+    void unsubscribe(MQTTString& filter)
+    {
+        for (int i = 0; i < MAX_SUBSCRIPTIONS; ++i)
+        {
+            if (subscriptions[i].filter[0] != '\0' && MQTTPacket_equals(&filter, subscriptions[i].filter))
+            {
+                trie.remove(subscriptions[i].filter);
+                subscriptions[i].filter[0] = '\0';
+            }
+        }
+    }
+
+    void unsubscribeAll()
+    {
+        trie.clear();
+        for (int i = 0; i < MAX_SUBSCRIPTIONS; ++i)
+            subscriptions[i].filter[0] = '\0';
+        session = false;
+    }
+
+    static const unsigned short MAX_PACKET_ID = 65535;
+
+    bool connected;
+    bool session;       // whether subscriptions are kept from a previous connection
+    unsigned short nextId;
+
+    unsigned char inbuf[BUFFER_SIZE];   // from the client, up to the end of the last partial packet
+    int inlen;
+    unsigned char outbuf[BUFFER_SIZE];  // to the client, as a ring
+    int outstart;
+    int outlen;
+
+    int counts[DISCONNECT + 1];
+
+    struct Subscription
+    {
+        char filter[MAX_FILTER_LENGTH];    // empty if the slot is free
+        int qos;
+    } subscriptions[MAX_SUBSCRIPTIONS];
+
+    MQTT::TopicTrie<MAX_SUBSCRIPTIONS * 8> trie;   // allows for filters of up to 8 levels
+
+};
+
+#endif
@@ -0,0 +1,104 @@
+#if !defined(MQTT_POSIX_H)
+#define MQTT_POSIX_H
+
+#include <time.h>
+#include <errno.h>
+
+/**
+ * A deadline on the monotonic clock, which is not affected by changes to the time of day
+ */
+class Countdown
+{
+public:
+    Countdown()
+    {
+        countdown_ms(0);
+    }
+    
+    Countdown(int ms)
+    {
+        countdown_ms(ms);
+    }
+    
+    /** While an instance exists, Countdowns in the same thread use the time it read on construction
+     *  rather than reading the clock, so that a group of deadlines can be checked for the cost of one
+     *  read.  The held time does not advance, so it must only be used around code which does not wait.
+     */
+    class Now
+    {
+    public:
+        Now()
+        {
+            if (depth()++ == 0)
+                held() = clock_ms();
+        }
+        
+        ~Now()
+        {
+            --depth();
+        }
+    };
+    
+    
+    bool expired()
+    {
+        return left_ms() <= 0;
+    }
+    
+    void countdown_ms(unsigned long ms)
+    {
+        end_ms = now_ms() + ms;
+    }
+    
+    void countdown(int seconds)
+    {
+        countdown_ms((unsigned long)seconds * 1000L);
+    }
+    
+    /** Put the calling thread to sleep
+     */
+    static void sleep_ms(int ms)
+    {
+        struct timespec ts;
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (ms % 1000) * 1000000L;
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            ;
+    }
+    
+    int left_ms()
+    {
+        long long left = end_ms - now_ms();
+        return (left < 0) ? 0 : (int)left;
+    }
+    
+private:
+
+    static long long now_ms()
+    {
+        return (depth() > 0) ? held() : clock_ms();
+    }
+
+    static long long clock_ms()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    static int& depth()
+    {
+        static thread_local int d = 0;
+        return d;
+    }
+
+    static long long& held()
+    {
+        static thread_local long long h = 0;
+        return h;
+    }
+
+    long long end_ms;
+};
+
+#endif
@@ -0,0 +1,195 @@
+#if !defined(MQTTPOSIXSOCKET_H)
+#define MQTTPOSIXSOCKET_H
+
+#include "MQTTPosix.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+/**
+ * Network implementation for POSIX hosts, using a non-blocking BSD socket and waiting in poll()
+ * so that timeouts are honoured.  Nagle's algorithm is turned off, as MQTT packets are written whole.
+ */
+class MQTTPosixSocket
+{
+public:
+    /** @param sndbuf - the socket send buffer size (SO_SNDBUF), 0 to keep the system default
+     *  @param rcvbuf - the socket receive buffer size (SO_RCVBUF), 0 to keep the system default
+     */
+    MQTTPosixSocket(int sndbuf = 0, int rcvbuf = 0) : fd(-1), sndbuf(sndbuf), rcvbuf(rcvbuf)
+    {
+    }
+    
+    ~MQTTPosixSocket()
+    {
+        disconnect();
+    }
+    
+    int connect(const char* hostname, int port, int timeout=1000)
+    {
+        struct addrinfo hints;
+        struct addrinfo* result = 0;
+        char service[6];
+        int rc = -1;
+        
+        if (fd >= 0)
+            disconnect();
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        snprintf(service, sizeof(service), "%d", port);
+        if (getaddrinfo(hostname, service, &hints, &result) != 0)
+            return -1;
+            
+        for (struct addrinfo* addr = result; addr && rc != 0; addr = addr->ai_next)
+        {
+            if ((fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0)
+                continue;
+            setOptions();
+            rc = ::connect(fd, addr->ai_addr, addr->ai_addrlen);
+            if (rc != 0 && errno == EINPROGRESS && wait(POLLOUT, timeout) > 0)
+            {
+                int error = 0;
+                socklen_t len = sizeof(error);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+                    rc = 0;
+            }
+            if (rc != 0)
+                disconnect();
+        }
+        freeaddrinfo(result);
+        return rc;
+    }
+
+    /* returns the number of bytes read, which could be 0.
+       -1 if there was an error on the socket
+    */
+    int read(unsigned char* buffer, int len, int timeout)
+    {
+        Countdown timer(timeout);
+        int bytes = 0;
+        
+        while (bytes < len)
+        {
+            ssize_t rc = ::recv(fd, &buffer[bytes], len - bytes, 0);
+            if (rc > 0)
+                bytes += rc;
+            else if (rc == 0)
+                return -1; // connection closed by the peer
+            else if (errno == EINTR)
+                continue;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            else if (timer.expired() || wait(POLLIN, timer.left_ms()) < 0)
+                break;
+        }
+        return bytes;
+    }
+
+    int write(unsigned char* buffer, int len, int timeout)
+    {
+        return write(buffer, len, 0, 0, timeout);
+    }
+
+    // gather write, so that a large payload is sent without first being copied after its header
+    int write(unsigned char* header, int headerlen, unsigned char* payload, int payloadlen, int timeout)
+    {
+        Countdown timer(timeout);
+        int total = headerlen + payloadlen;
+        int bytes = 0;
+        
+        while (bytes < total)
+        {
+            struct iovec iov[2];
+            int count = 0;
+            if (bytes < headerlen)
+            {
+                iov[count].iov_base = &header[bytes];
+                iov[count++].iov_len = headerlen - bytes;
+            }
+            if (payloadlen > 0)
+            {
+                int offset = (bytes > headerlen) ? bytes - headerlen : 0;
+                iov[count].iov_base = &payload[offset];
+                iov[count++].iov_len = payloadlen - offset;
+            }
+            
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ssize_t rc = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+            if (rc >= 0)
+                bytes += rc;
+            else if (errno == EINTR)
+                continue;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            else if (timer.expired() || wait(POLLOUT, timer.left_ms()) < 0)
+                break;
+        }
+        return bytes;
+    }
+
+    int disconnect()
+    {
+        int rc = 0;
+        if (fd >= 0)
+        {
+            rc = ::close(fd);
+            fd = -1;
+        }
+        return rc;
+    }
+    
+    /** The socket file descriptor, for registering with a poller such as MQTT::EpollPoller
+     *  @return the descriptor, -1 if not connected
+     */
+    int getFd()
+    {
+        return fd;
+    }
+
+private:
+
+    void setOptions()
+    {
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        if (sndbuf > 0)
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        if (rcvbuf > 0)
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    // wait for the socket to become readable or writable.  > 0 if it is ready, 0 on timeout, < 0 on error
+    int wait(short events, int timeout)
+    {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = events;
+        pfd.revents = 0;
+        int rc = poll(&pfd, 1, timeout);
+        if (rc < 0 && errno == EINTR)
+            rc = 0;
+        return rc;
+    }
+
+    int fd;
+    int sndbuf;
+    int rcvbuf;
+
+};
+
+#endif
@@ -0,0 +1,84 @@
+#if !defined(MQTT_POSIX_THREAD_H)
+#define MQTT_POSIX_THREAD_H
+
+#include <pthread.h>
+
+/**
+ * A thread with the constructor of the mbed RTOS Thread, so that MQTT::Async can run its
+ * background thread on POSIX hosts.  The thread starts on construction.
+ */
+class PosixThread
+{
+public:
+    PosixThread(void (*task)(void const *argument), void *argument = 0) : task(task), argument(argument), started(false)
+    {
+        started = (pthread_create(&thread, 0, &PosixThread::start, this) == 0);
+    }
+
+    ~PosixThread()
+    {
+        join();
+    }
+
+    /** Wait for the thread function to return
+     *  @return 0 on success, or an error from pthread_join
+     */
+    int join()
+    {
+        int rc = 0;
+
+        if (started)
+        {
+            rc = pthread_join(thread, 0);
+            started = false;
+        }
+        return rc;
+    }
+
+private:
+
+    static void* start(void* arg)
+    {
+        PosixThread* t = (PosixThread*)arg;
+        t->task(t->argument);
+        return 0;
+    }
+
+    void (*task)(void const *argument);
+    void* argument;
+    pthread_t thread;
+    bool started;
+};
+
+
+class PosixMutex
+{
+public:
+    PosixMutex()
+    {
+        pthread_mutex_init(&mutex, 0);
+    }
+
+    ~PosixMutex()
+    {
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void lock()
+    {
+        pthread_mutex_lock(&mutex);
+    }
+
+    void unlock()
+    {
+        pthread_mutex_unlock(&mutex);
+    }
+
+private:
+    PosixMutex(const PosixMutex&);
+    PosixMutex& operator=(const PosixMutex&);
+
+    pthread_mutex_t mutex;
+};
+
+#endif
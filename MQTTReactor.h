@@ -0,0 +1,314 @@
+#if !defined(MQTT_REACTOR_H)
+#define MQTT_REACTOR_H
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+namespace MQTT
+{
+
+/**
+ * A Poller tells the Reactor which connections have data to read.  It needs the methods:
+ *    int add(int handle, int index)    - watch a handle for readability, reporting it as index.  0 for success
+ *    int remove(int handle)            - stop watching a handle, which is still open.  0 for success
+ *    int wait(int* ready, int max, int timeout_ms)
+ *                                      - wait up to timeout_ms (-1 for ever) for handles to become readable,
+ *                                        returning the number of indexes put in ready, or -1 on error
+ * where handle is whatever identifies a connection to the network stack, such as a socket descriptor.
+ */
+
+#if defined(__linux__)
+/**
+ * @class EpollPoller
+ * @brief Poller using Linux epoll, where the handles are socket file descriptors
+ */
+class EpollPoller
+{
+public:
+    EpollPoller()
+    {
+        fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    ~EpollPoller()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    int add(int handle, int index)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = 0;
+        event.data.u32 = index;
+        return epoll_ctl(fd, EPOLL_CTL_ADD, handle, &event);
+    }
+
+    int remove(int handle)
+    {
+        struct epoll_event event;   // ignored, but must not be null for older kernels
+        return epoll_ctl(fd, EPOLL_CTL_DEL, handle, &event);
+    }
+
+    int wait(int* ready, int max, int timeout_ms)
+    {
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(fd, events, (max < MAX_EVENTS) ? max : MAX_EVENTS, timeout_ms);
+
+        if (count < 0)
+            return (errno == EINTR) ? 0 : -1;
+        for (int i = 0; i < count; ++i)
+            ready[i] = events[i].data.u32;
+        return count;
+    }
+
+private:
+
+    static const int MAX_EVENTS = 64;
+    int fd;
+
+};
+#endif
+
+
+/**
+ * @class Reactor
+ * @brief drives many MQTT clients from one thread
+ *
+ * Waits on the networks of all the registered clients at once, and runs a client only when data
+ * has arrived for it or its keepalive deadline has passed.  The deadlines are kept in a heap, so each
+ * pass costs in proportion to the clients which run rather than to all those registered.  A client
+ * which disconnects stays registered, but its network is no longer watched until it is connected
+ * again, by automatic reconnection when the reactor runs it.  A client connected again by the
+ * application instead must be removed and added again.
+ * @param Client an MQTT::Client instantiation
+ * @param Poller a class which waits for network handles to become readable, such as EpollPoller
+ * @param MAX_CONNECTIONS the maximum number of clients which can be registered
+ */
+template<class Client, class Poller, int MAX_CONNECTIONS = 64>
+class Reactor
+{
+public:
+
+    Reactor(Poller& poller) : poller(poller), scheduled(0)
+    {
+        for (int i = 0; i < MAX_CONNECTIONS; ++i)
+            connections[i].client = 0;
+    }
+
+    /** Register a client
+     *  @param client - the client
+     *  @param network - the client's network, which has a method getFd() returning the handle by which
+     *      the poller identifies the connection, or -1 if there is none.  It is asked again each time the
+     *      client connects, as a new connection has a new handle
+     *  @return success code -
+     */
+    template<class Network>
+    int add(Client& client, Network& network)
+    {
+        for (int i = 0; i < MAX_CONNECTIONS; ++i)
+        {
+            if (connections[i].client == 0)
+            {
+                Connection& c = connections[i];
+                c.client = &client;
+                c.network = &network;
+                c.getHandle = &getFd<Network>;
+                c.handle = -1;
+                c.position = -1;
+                update(i);
+                return SUCCESS;
+            }
+        }
+        return FAILURE;
+    }
+
+    /** Unregister a client
+     *  @param client - the client
+     *  @return success code -
+     */
+    int remove(Client& client)
+    {
+        for (int i = 0; i < MAX_CONNECTIONS; ++i)
+        {
+            if (connections[i].client == &client)
+            {
+                unwatch(i);
+                unschedule(i);
+                connections[i].client = 0;
+                return SUCCESS;
+            }
+        }
+        return FAILURE;
+    }
+
+    /** Wait for network data or a keepalive deadline, and run the clients which need it
+     *  @param timeout_ms - the longest time to wait, -1 to wait until there is something to do
+     *  @return the number of clients run, or a failure code if the poller failed
+     */
+    int run(int timeout_ms)
+    {
+        int ready[MAX_CONNECTIONS];
+        int timeout = timeout_ms;
+        int run = 0;
+
+        if (scheduled > 0 && (timeout < 0 || heap[0].due.left_ms() < timeout))
+            timeout = heap[0].due.left_ms();
+
+        int count = poller.wait(ready, MAX_CONNECTIONS, timeout);
+        if (count < 0)
+            return FAILURE;
+
+        for (int i = 0; i < count; ++i)
+        {
+            Client* client = connections[ready[i]].client;
+            if (client == 0)
+                continue;
+            // read everything which has arrived, as the network may buffer more than the poller knows of
+            while (client->step() > 0)
+                ;
+            update(ready[i]);
+            ++run;
+        }
+
+        // each client which is due runs once, as its next deadline could be due already
+        for (int n = scheduled; n > 0 && scheduled > 0 && heap[0].due.expired(); --n)
+        {
+            int i = heap[0].index;
+            connections[i].client->step();
+            update(i);
+            ++run;
+        }
+        return run;
+    }
+
+private:
+
+    typedef typename Client::TimerType Timer;
+
+    template<class Network>
+    static int getFd(void* network)
+    {
+        return static_cast<Network*>(network)->getFd();
+    }
+
+    // after a client has run, follow it to the handle of a new connection, and reschedule it
+    void update(int i)
+    {
+        Connection& c = connections[i];
+        int handle = c.client->isConnected() ? c.getHandle(c.network) : -1;
+
+        if (handle != c.handle)
+        {
+            unwatch(i);
+            if (handle >= 0 && poller.add(handle, i) == 0)
+                c.handle = handle;
+        }
+        schedule(i, c.client->nextDeadlineMs());
+    }
+
+    void unwatch(int i)
+    {
+        Connection& c = connections[i];
+
+        // a handle which is no longer the network's has been closed, which removed it from the poller
+        // already, and the same number could now belong to another connection
+        if (c.handle >= 0 && c.getHandle(c.network) == c.handle)
+            poller.remove(c.handle);
+        c.handle = -1;
+    }
+
+    void schedule(int i, int deadline_ms)
+    {
+        ClockHold<Timer> now;   // one read of the clock for all the comparisons
+        int pos = connections[i].position;
+
+        if (deadline_ms < 0)
+        {
+            unschedule(i);
+            return;
+        }
+        if (pos < 0)
+            pos = scheduled++;
+        heap[pos].index = i;
+        heap[pos].due.countdown_ms(deadline_ms);
+        connections[i].position = pos;
+        sift(pos);
+    }
+
+    void unschedule(int i)
+    {
+        ClockHold<Timer> now;
+        int pos = connections[i].position;
+
+        if (pos < 0)
+            return;
+        connections[i].position = -1;
+        if (pos < --scheduled)
+        {
+            heap[pos] = heap[scheduled];
+            connections[heap[pos].index].position = pos;
+            sift(pos);
+        }
+    }
+
+    // move an entry up or down the heap to where its deadline belongs
+    void sift(int pos)
+    {
+        while (pos > 0 && earlier(pos, (pos - 1) / 2))
+        {
+            swap(pos, (pos - 1) / 2);
+            pos = (pos - 1) / 2;
+        }
+        for (int child = 2 * pos + 1; child < scheduled; child = 2 * pos + 1)
+        {
+            if (child + 1 < scheduled && earlier(child + 1, child))
+                ++child;
+            if (!earlier(child, pos))
+                break;
+            swap(pos, child);
+            pos = child;
+        }
+    }
+
+    bool earlier(int a, int b)
+    {
+        return heap[a].due.left_ms() < heap[b].due.left_ms();
+    }
+
+    void swap(int a, int b)
+    {
+        Deadline t = heap[a];
+        heap[a] = heap[b];
+        heap[b] = t;
+        connections[heap[a].index].position = a;
+        connections[heap[b].index].position = b;
+    }
+
+    Poller& poller;
+
+    struct Connection
+    {
+        Client* client;     // 0 if the slot is free
+        void* network;
+        int (*getHandle)(void* network);
+        int handle;         // being watched by the poller, -1 if none
+        int position;       // in the heap, -1 if the client has no deadline
+    } connections[MAX_CONNECTIONS];
+
+    struct Deadline
+    {
+        Timer due;
+        int index;          // of the connection
+    } heap[MAX_CONNECTIONS];    // earliest first
+    int scheduled;
+
+};
+
+}
+
+#endif
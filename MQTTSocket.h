@@ -12,9 +12,10 @@ public:
     {
         net = anet;
         open = false;
+        mysock.sigio(callback(this, &MQTTSocket::signal));
     }
     
-    int connect(char* hostname, int port, int timeout=1000)
+    int connect(const char* hostname, int port, int timeout=1000)
     {
         if (open)
             disconnect();
@@ -27,24 +28,22 @@ public:
         return rc;
     }
 
-    // common read/write routine, avoiding blocking timeouts
+    // common read/write routine, avoiding blocking timeouts.  Rather than polling, wait on the
+    // socket's sigio event so that we wake as soon as data or send buffer space is available
     int common(unsigned char* buffer, int len, int timeout, bool read)
     {
+        timer.reset();
         timer.start();
         mysock.set_blocking(false); // blocking timeouts seem not to work
         int bytes = 0;
-        bool first = true;
         do 
         {
-            if (first)
-                first = false;
-            else
-                wait_ms(timeout < 100 ? timeout : 100);
+            events.clear(SOCKET_EVENT);
             int rc;
             if (read)
-                rc = mysock.recv((char*)buffer, len);
+                rc = mysock.recv((char*)&buffer[bytes], len - bytes);
             else
-                rc = mysock.send((char*)buffer, len);
+                rc = mysock.send((char*)&buffer[bytes], len - bytes);
             if (rc < 0)
             {
                 if (rc != NSAPI_ERROR_WOULD_BLOCK)
@@ -52,7 +51,16 @@ public:
                     bytes = -1;
                     break;
                 }
+                int left = timeout - timer.read_ms();
+                if (left <= 0)
+                    break;
+                events.wait_any(SOCKET_EVENT, left); // returns early when the socket signals
             } 
+            else if (rc == 0 && read)
+            {
+                bytes = -1; // connection closed by the peer
+                break;
+            }
             else
                 bytes += rc;
         }
@@ -87,10 +95,19 @@ public:
 
 private:
 
+    static const uint32_t SOCKET_EVENT = 1;
+
+    // called from the network stack whenever the socket state changes
+    void signal()
+    {
+        events.set(SOCKET_EVENT);
+    }
+
     bool open;
     TCPSocket mysock;
     EthernetInterface *net;
     Timer timer;
+    EventFlags events;
 
 };
 
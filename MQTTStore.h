@@ -0,0 +1,210 @@
+#if !defined(MQTT_STORE_H)
+#define MQTT_STORE_H
+
+#include <string.h>
+
+namespace MQTT
+{
+
+/**
+ * An outbound message store keeps the serialized PUBLISH packets of unacknowledged QoS 1 and 2 messages,
+ * and the PUBREL packets which replace them once they are received by the server, so that they can be
+ * resent after a restart.  Packets are keyed by packet id, and kept in the order they were first stored.
+ * A store class has the methods:
+ *    int open()                    - called at the first connect.  Returns the number of stored packets, or -1
+ *    int put(unsigned short id, const unsigned char* header, int headerlen, const unsigned char* payload, int payloadlen)
+ *                                  - store the packet, in two parts, for a packet id, replacing any stored for it
+ *    int remove(unsigned short id) - delete the packet for a packet id
+ *    int get(int index, unsigned short& id, int& len)
+ *                                  - the packet id and length of the index'th stored packet, oldest first
+ *    int read(unsigned short id, int offset, unsigned char* buf, int len)
+ *                                  - copy part of a stored packet, returning the number of bytes copied
+ *    int commit()                  - make the changes since the last commit durable
+ *    void clear()                  - delete all the packets
+ * returning 0 for success or -1 for failure, except where noted.  Commit is called once for each pass of the
+ * client's cycle, so the cost of making a batch of puts and removes durable is shared between them.
+ */
+
+
+/**
+ * @class NullStore
+ * @brief the default store, which stores nothing
+ */
+class NullStore
+{
+public:
+    int open() { return 0; }
+    int put(unsigned short, const unsigned char*, int, const unsigned char*, int) { return 0; }
+    int remove(unsigned short) { return 0; }
+    int get(int, unsigned short&, int&) { return -1; }
+    int read(unsigned short, int, unsigned char*, int) { return -1; }
+    int commit() { return 0; }
+    void clear() { }
+};
+
+
+/**
+ * @class RamStore
+ * @brief a store in a fixed block of memory
+ *
+ * This doesn't survive a power cycle, but can be placed in memory which survives a reset.  It also holds
+ * whole packets, so the payloads of large publications don't have to be kept by the application until
+ * they are acknowledged.
+ * @param SIZE the number of bytes for the packets
+ * @param MAX_MESSAGES the number of packets which can be stored, at least MAX_INFLIGHT_MESSAGES
+ */
+template<int SIZE = 1024, int MAX_MESSAGES = 8>
+class RamStore
+{
+public:
+
+    RamStore()
+    {
+        clear();
+    }
+
+    int open()
+    {
+        return count;
+    }
+
+    int put(unsigned short id, const unsigned char* header, int headerlen, const unsigned char* payload, int payloadlen)
+    {
+        int len = headerlen + payloadlen;
+        int i = find(id);
+
+        if (i >= 0 && len <= entries[i].len)
+        {   // overwrite in place, so the packet keeps its position
+            write(entries[i].offset, header, headerlen, payload, payloadlen);
+            entries[i].len = len;
+            return 0;
+        }
+        if ((i < 0 && count == MAX_MESSAGES) || live() - ((i >= 0) ? entries[i].len : 0) + len > SIZE)
+            return -1;
+        if (i < 0)
+        {
+            i = count++;
+            entries[i].id = id;
+            entries[i].offset = 0;
+        }
+        entries[i].len = 0;     // any old copy is being replaced, so it need not be kept by compact
+        if (used + len > SIZE)
+            compact();
+        write(used, header, headerlen, payload, payloadlen);
+        entries[i].offset = used;
+        entries[i].len = len;
+        used += len;
+        return 0;
+    }
+
+    int remove(unsigned short id)
+    {
+        int i = find(id);
+
+        if (i < 0)
+            return -1;
+        --count;
+        for (; i < count; ++i)
+            entries[i] = entries[i + 1];
+        if (count == 0)
+            used = 0;
+        return 0;
+    }
+
+    int get(int index, unsigned short& id, int& len)
+    {
+        if (index < 0 || index >= count)
+            return -1;
+        id = entries[index].id;
+        len = entries[index].len;
+        return 0;
+    }
+
+    int read(unsigned short id, int offset, unsigned char* buf, int len)
+    {
+        int i = find(id);
+
+        if (i < 0 || offset > entries[i].len)
+            return -1;
+        if (len > entries[i].len - offset)
+            len = entries[i].len - offset;
+        memcpy(buf, &data[entries[i].offset + offset], len);
+        return len;
+    }
+
+    int commit()
+    {
+        return 0;
+    }
+
+    void clear()
+    {
+        count = used = 0;
+    }
+
+private:
+
+    int find(unsigned short id)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            if (entries[i].id == id)
+                return i;
+        }
+        return -1;
+    }
+
+    void write(int offset, const unsigned char* header, int headerlen, const unsigned char* payload, int payloadlen)
+    {
+        memcpy(&data[offset], header, headerlen);
+        if (payloadlen > 0)
+            memcpy(&data[offset + headerlen], payload, payloadlen);
+    }
+
+    int live()
+    {
+        int total = 0;
+        for (int i = 0; i < count; ++i)
+            total += entries[i].len;
+        return total;
+    }
+
+    // move the packets to the start of the block, closing the gaps left by removed ones.  Packets are
+    // moved lowest offset first, so none is overwritten before it has been moved
+    void compact()
+    {
+        int order[MAX_MESSAGES];
+
+        for (int i = 0; i < count; ++i)
+        {   // insertion sort of the entries by offset
+            int j = i;
+            for (; j > 0 && entries[order[j - 1]].offset > entries[i].offset; --j)
+                order[j] = order[j - 1];
+            order[j] = i;
+        }
+        used = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            Entry& e = entries[order[i]];
+            memmove(&data[used], &data[e.offset], e.len);
+            e.offset = used;
+            used += e.len;
+        }
+    }
+
+    struct Entry
+    {
+        unsigned short id;
+        int offset;
+        int len;
+    } entries[MAX_MESSAGES];    // oldest first
+    int count;
+
+    unsigned char data[SIZE];
+    int used;
+
+};
+
+}
+
+#endif
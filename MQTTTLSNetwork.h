@@ -0,0 +1,248 @@
+#if !defined(MQTT_TLS_NETWORK_H)
+#define MQTT_TLS_NETWORK_H
+
+#include <string.h>
+
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/net_sockets.h"    // for the MBEDTLS_ERR_NET_ codes the BIO callbacks return
+
+/**
+ * @class MQTTTLSNetwork
+ * @brief TLS wrapper around a Network class, using mbed TLS
+ *
+ * The TLS records are carried over the wrapped network's read and write, so this works over MQTTSocket
+ * on mbed and MQTTPosixSocket on Linux alike.  The session agreed at each connect is kept, and offered
+ * to the server at the next connect, so that a reconnect needs only an abbreviated handshake if the
+ * server still has it, by session ticket or session id.
+ * @param Network the network class being wrapped - MQTTSocket or similar
+ * @param Timer a timer class, such as Countdown, for the read, write and handshake timeouts
+ * @param WRITE_BUFFER_SIZE the largest packet header and payload written as one TLS record by the gather write
+ */
+template<class Network, class Timer, int WRITE_BUFFER_SIZE = 512>
+class MQTTTLSNetwork
+{
+public:
+    /** @param network - the network to carry the TLS records
+     *  @param ca - the certificates of the authorities trusted to sign the server's certificate, PEM
+     *      (including the terminating null) or DER
+     *  @param calen - the length of ca
+     *  @param maxFragLen - the largest TLS record to ask the server for, as one of the mbed TLS
+     *      MBEDTLS_SSL_MAX_FRAG_LEN_ values, so that a small device can have small record buffers.
+     *      MBEDTLS_SSL_MAX_FRAG_LEN_NONE to leave it at the default of 16K
+     */
+    MQTTTLSNetwork(Network& network, const unsigned char* ca, size_t calen,
+                   unsigned char maxFragLen = MBEDTLS_SSL_MAX_FRAG_LEN_NONE) : network(network)
+    {
+        static const char pers[] = "MQTTTLSNetwork";
+
+        mbedtls_ssl_init(&ssl);
+        mbedtls_ssl_config_init(&conf);
+        mbedtls_ssl_session_init(&session);
+        mbedtls_x509_crt_init(&cacert);
+        mbedtls_ctr_drbg_init(&drbg);
+        mbedtls_entropy_init(&entropy);
+        haveSession = false;
+        timeout = 0;
+
+        int rc = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, (const unsigned char*)pers, sizeof(pers) - 1);
+        if (rc == 0)
+            rc = mbedtls_x509_crt_parse(&cacert, ca, calen);
+        if (rc == 0)
+            rc = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                             MBEDTLS_SSL_PRESET_DEFAULT);
+        if ((setupError = rc) != 0)
+            return;
+        mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_ca_chain(&conf, &cacert, 0);
+        mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+        mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+        if ((setupError = mbedtls_ssl_conf_max_frag_len(&conf, maxFragLen)) != 0)
+            return;
+#endif
+        if ((setupError = mbedtls_ssl_setup(&ssl, &conf)) == 0)
+            mbedtls_ssl_set_bio(&ssl, this, bioSend, bioRecv, 0);
+    }
+
+    ~MQTTTLSNetwork()
+    {
+        mbedtls_ssl_free(&ssl);
+        mbedtls_ssl_config_free(&conf);
+        mbedtls_ssl_session_free(&session);
+        mbedtls_x509_crt_free(&cacert);
+        mbedtls_ctr_drbg_free(&drbg);
+        mbedtls_entropy_free(&entropy);
+    }
+
+    /** Connect the network, and perform the TLS handshake, resuming the previous session if the server
+     *  allows.  The hostname is checked against the server's certificate.
+     */
+    int connect(const char* hostname, int port, int timeout=1000)
+    {
+        Timer timer(timeout);
+
+        if (setupError != 0 || network.connect(hostname, port, timeout) != 0)
+            return -1;
+        if (mbedtls_ssl_session_reset(&ssl) != 0 || mbedtls_ssl_set_hostname(&ssl, hostname) != 0)
+            goto fail;
+        if (haveSession && mbedtls_ssl_set_session(&ssl, &session) != 0)
+            forgetSession();
+
+        int rc;
+        do
+        {
+            this->timeout = timer.left_ms();
+            rc = mbedtls_ssl_handshake(&ssl);
+        }
+        while ((rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE) && !timer.expired());
+        if (rc != 0)
+        {
+            forgetSession();    // it may be the cause, so don't offer it again
+            goto fail;
+        }
+        if (mbedtls_ssl_get_verify_result(&ssl) != 0)
+            goto fail;
+
+        // keep the session for the next connect
+        forgetSession();
+        haveSession = (mbedtls_ssl_get_session(&ssl, &session) == 0);
+        return 0;
+
+    fail:
+        network.disconnect();
+        return -1;
+    }
+
+    /* returns the number of bytes read, which could be 0.
+       -1 if there was an error on the socket
+    */
+    int read(unsigned char* buffer, int len, int timeout)
+    {
+        Timer timer(timeout);
+        int bytes = 0;
+
+        while (bytes < len)
+        {
+            this->timeout = timer.left_ms();
+            int rc = mbedtls_ssl_read(&ssl, &buffer[bytes], len - bytes);
+            if (rc > 0)
+                bytes += rc;
+            else if (rc != MBEDTLS_ERR_SSL_WANT_READ && rc != MBEDTLS_ERR_SSL_WANT_WRITE)
+                return -1;  // an error, or the connection was closed by the server
+            else if (timer.expired())
+                break;
+        }
+        return bytes;
+    }
+
+    int write(unsigned char* buffer, int len, int timeout)
+    {
+        Timer timer(timeout);
+        return send(buffer, len, timer);
+    }
+
+    /** Write a packet header and payload, with as much of the payload as fits in the write buffer
+     *  sent in the same TLS record as the header, rather than one record for each
+     */
+    int write(unsigned char* header, int headerlen, unsigned char* payload, int payloadlen, int timeout)
+    {
+        Timer timer(timeout);
+        int first = 0;      // the part of the payload sent with the header
+        int sent = 0;
+
+        if (headerlen >= WRITE_BUFFER_SIZE)
+            sent = send(header, headerlen, timer);
+        else
+        {
+            first = (payloadlen < WRITE_BUFFER_SIZE - headerlen) ? payloadlen : WRITE_BUFFER_SIZE - headerlen;
+            memcpy(txbuf, header, headerlen);
+            memcpy(&txbuf[headerlen], payload, first);
+            sent = send(txbuf, headerlen + first, timer);
+        }
+        if (sent == headerlen + first && first < payloadlen)
+        {
+            int rc = send(&payload[first], payloadlen - first, timer);
+            sent = (rc < 0) ? -1 : sent + rc;
+        }
+        return sent;
+    }
+
+    int disconnect()
+    {
+        mbedtls_ssl_close_notify(&ssl);
+        return network.disconnect();
+    }
+
+    /** Don't offer the previous session at the next connect, so that a full handshake is made
+     */
+    void forgetSession()
+    {
+        mbedtls_ssl_session_free(&session);
+        mbedtls_ssl_session_init(&session);
+        haveSession = false;
+    }
+
+    Network& getNetwork()
+    {
+        return network;
+    }
+
+private:
+
+    int send(unsigned char* buffer, int len, Timer& timer)
+    {
+        int bytes = 0;
+
+        while (bytes < len)
+        {
+            this->timeout = timer.left_ms();
+            int rc = mbedtls_ssl_write(&ssl, &buffer[bytes], len - bytes);
+            if (rc > 0)
+                bytes += rc;
+            else if (rc != MBEDTLS_ERR_SSL_WANT_READ && rc != MBEDTLS_ERR_SSL_WANT_WRITE)
+                return -1;
+            else if (timer.expired())
+                break;
+        }
+        return bytes;
+    }
+
+    // the mbed TLS bio callbacks, which carry the records over the network within the current timeout
+    static int bioSend(void* context, const unsigned char* buffer, size_t len)
+    {
+        MQTTTLSNetwork* tls = (MQTTTLSNetwork*)context;
+        int rc = tls->network.write((unsigned char*)buffer, (int)len, tls->timeout);
+        if (rc < 0)
+            return MBEDTLS_ERR_NET_SEND_FAILED;
+        return (rc == 0) ? MBEDTLS_ERR_SSL_WANT_WRITE : rc;
+    }
+
+    static int bioRecv(void* context, unsigned char* buffer, size_t len)
+    {
+        MQTTTLSNetwork* tls = (MQTTTLSNetwork*)context;
+        int rc = tls->network.read(buffer, (int)len, tls->timeout);
+        if (rc < 0)
+            return MBEDTLS_ERR_NET_RECV_FAILED;
+        return (rc == 0) ? MBEDTLS_ERR_SSL_WANT_READ : rc;
+    }
+
+    Network& network;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_ssl_session session;    // from the last successful handshake
+    bool haveSession;
+    mbedtls_x509_crt cacert;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_entropy_context entropy;
+    int setupError;                 // the failure of the setup in the constructor, or 0
+    int timeout;                    // the time left for the current operation, for the bio callbacks
+    unsigned char txbuf[WRITE_BUFFER_SIZE];
+
+};
+
+#endif
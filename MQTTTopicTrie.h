@@ -0,0 +1,284 @@
+#if !defined(MQTT_TOPIC_TRIE_H)
+#define MQTT_TOPIC_TRIE_H
+
+#include <string.h>
+
+namespace MQTT
+{
+
+/**
+ * @class TopicTrie
+ * @brief index of topic filters, split by topic level, for matching incoming topic names
+ *
+ * Each node is one level of one or more topic filters, with the + and # wildcard levels held as
+ * dedicated children so that matching a topic name visits only the filters which can match it,
+ * rather than every filter.  Nodes come from a fixed pool, so no heap is used.  The filter strings
+ * are not copied, and must remain valid until they are removed.
+ * @param MAX_NODES the size of the node pool - one node for each level of each distinct filter prefix
+ */
+template<int MAX_NODES>
+class TopicTrie
+{
+public:
+
+    TopicTrie()
+    {
+        clear();
+    }
+
+    /** Remove all the topic filters
+     */
+    void clear()
+    {
+        init(ROOT, NONE, 0, 0);
+        for (int i = 1; i <= MAX_NODES; ++i)
+            nodes[i].sibling = (i < MAX_NODES) ? i + 1 : NONE;
+        freeNodes = 1;
+    }
+
+    /** Add a topic filter
+     *  @param topicFilter - a topic pattern which can include wildcards
+     *  @param handler - the value to be returned by match for topic names matching this filter
+     *  @return 0 on success, -1 if there are not enough free nodes
+     */
+    int add(const char* topicFilter, int handler)
+    {
+        int node = ROOT;
+        const char* level = topicFilter;
+
+        while (true)
+        {
+            int len = levelLength(level);
+            int next = child(node, level, len);
+
+            if (next == NONE && (next = alloc(node, level, len)) == NONE)
+            {
+                prune(node, topicFilter);
+                return -1;
+            }
+            node = next;
+            if (level[len] == '\0')
+                break;
+            level += len + 1;
+        }
+        nodes[node].handler = handler;
+        nodes[node].filter = topicFilter;
+        return 0;
+    }
+
+    /** Remove a topic filter
+     *  @param topicFilter - a topic pattern previously added, or an identical string
+     */
+    void remove(const char* topicFilter)
+    {
+        int node = ROOT;
+        const char* level = topicFilter;
+
+        while (node != NONE)
+        {
+            int len = levelLength(level);
+            node = child(node, level, len);
+            if (level[len] == '\0')
+                break;
+            level += len + 1;
+        }
+        if (node == NONE || nodes[node].handler == NONE)
+            return;
+        const char* filter = nodes[node].filter;
+        nodes[node].handler = NONE;
+        nodes[node].filter = 0;
+        prune(node, filter);
+    }
+
+    /** Find the topic filters matching a topic name
+     *  @param topicName - the topic name, which need not be null terminated
+     *  @param len - the length of the topic name
+     *  @param handlers - returns the handler values of the matching filters
+     *  @param max - the size of the handlers array
+     *  @return the number of matching filters
+     */
+    int match(const char* topicName, int len, int* handlers, int max)
+    {
+        int count = 0;
+        match(ROOT, topicName, topicName + len, handlers, max, count);
+        return count;
+    }
+
+private:
+
+    static const short NONE = -1;
+    static const short ROOT = 0;
+
+    struct Node
+    {
+        const char* level;      // this level of the filter - not null terminated
+        const char* filter;     // the whole filter, if one ends at this node
+        unsigned short len;
+        short parent;
+        short children;         // first child, excluding the wildcards
+        short sibling;          // next child of the parent, or next free node
+        short plus, hash;       // wildcard children
+        short handler;          // handler for the filter ending at this node, or NONE
+    } nodes[MAX_NODES + 1];     // node 0 is the root
+    short freeNodes;
+
+    static int levelLength(const char* level)
+    {
+        int len = 0;
+        while (level[len] != '\0' && level[len] != '/')
+            ++len;
+        return len;
+    }
+
+    static bool isWildcard(const char* level, int len, char wildcard)
+    {
+        return len == 1 && level[0] == wildcard;
+    }
+
+    void init(int node, int parent, const char* level, int len)
+    {
+        nodes[node].level = level;
+        nodes[node].len = len;
+        nodes[node].filter = 0;
+        nodes[node].parent = parent;
+        nodes[node].children = nodes[node].sibling = NONE;
+        nodes[node].plus = nodes[node].hash = NONE;
+        nodes[node].handler = NONE;
+    }
+
+    int child(int node, const char* level, int len)
+    {
+        if (isWildcard(level, len, '+'))
+            return nodes[node].plus;
+        if (isWildcard(level, len, '#'))
+            return nodes[node].hash;
+        for (int c = nodes[node].children; c != NONE; c = nodes[c].sibling)
+        {
+            if (nodes[c].len == len && memcmp(nodes[c].level, level, len) == 0)
+                return c;
+        }
+        return NONE;
+    }
+
+    int alloc(int parent, const char* level, int len)
+    {
+        int node = freeNodes;
+        if (node == NONE)
+            return NONE;
+        freeNodes = nodes[node].sibling;
+        init(node, parent, level, len);
+        if (isWildcard(level, len, '+'))
+            nodes[parent].plus = node;
+        else if (isWildcard(level, len, '#'))
+            nodes[parent].hash = node;
+        else
+        {
+            nodes[node].sibling = nodes[parent].children;
+            nodes[parent].children = node;
+        }
+        return node;
+    }
+
+    void unlink(int node)
+    {
+        int parent = nodes[node].parent;
+        if (nodes[parent].plus == node)
+            nodes[parent].plus = NONE;
+        else if (nodes[parent].hash == node)
+            nodes[parent].hash = NONE;
+        else
+        {
+            short* c = &nodes[parent].children;
+            while (*c != node)
+                c = &nodes[*c].sibling;
+            *c = nodes[node].sibling;
+        }
+        nodes[node].sibling = freeNodes;
+        freeNodes = node;
+    }
+
+    // find any filter string ending at this node or below it
+    const char* anyFilter(int node)
+    {
+        if (nodes[node].handler != NONE)
+            return nodes[node].filter;
+        int next[3] = {nodes[node].children, nodes[node].plus, nodes[node].hash};
+        for (int i = 0; i < 3; ++i)
+        {
+            const char* filter = (next[i] != NONE) ? anyFilter(next[i]) : 0;
+            if (filter)
+                return filter;
+        }
+        return 0;
+    }
+
+    // Free the unused nodes on the path up from node, and make sure that no node left on that path
+    // refers to the storage of the filter string, as it is not needed by the trie any longer.
+    void prune(int node, const char* filter)
+    {
+        size_t filterlen = strlen(filter);
+
+        for (; node != ROOT; node = nodes[node].parent)
+        {
+            if (nodes[node].handler == NONE && nodes[node].children == NONE &&
+                    nodes[node].plus == NONE && nodes[node].hash == NONE)
+                unlink(node);
+            else if (nodes[node].level >= filter && nodes[node].level < filter + filterlen)
+            {
+                int depth = 0;
+                for (int n = node; n != ROOT; n = nodes[n].parent)
+                    ++depth;
+                const char* level = anyFilter(node);
+                while (--depth > 0)
+                    level += levelLength(level) + 1;
+                nodes[node].level = level;
+            }
+        }
+    }
+
+    void add(int node, int* handlers, int max, int& count)
+    {
+        if (node != NONE && nodes[node].handler != NONE && count < max)
+            handlers[count++] = nodes[node].handler;
+    }
+
+    void match(int node, const char* level, const char* end, int* handlers, int max, int& count)
+    {
+        // wildcards at the first level don't match topic names starting with $
+        bool wildcards = !(node == ROOT && level < end && *level == '$');
+        const char* next = level;
+
+        while (next < end && *next != '/')
+            ++next;
+        if (wildcards)
+            add(nodes[node].hash, handlers, max, count); // # matches this level and all below
+
+        int candidates[2] = {NONE, wildcards ? nodes[node].plus : NONE};
+        for (int c = nodes[node].children; c != NONE; c = nodes[c].sibling)
+        {
+            if (nodes[c].len == next - level && memcmp(nodes[c].level, level, next - level) == 0)
+            {
+                candidates[0] = c;
+                break;
+            }
+        }
+        for (int i = 0; i < 2; ++i)
+        {
+            int c = candidates[i];
+            if (c == NONE)
+                continue;
+            if (next == end)
+            {   // last level of the topic name, also matched by a trailing # level
+                add(c, handlers, max, count);
+                add(nodes[c].hash, handlers, max, count);
+            }
+            else
+                match(c, next + 1, end, handlers, max, count);
+        }
+    }
+
+};
+
+}
+
+#endif
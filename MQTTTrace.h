@@ -0,0 +1,178 @@
+#if !defined(MQTT_TRACE_H)
+#define MQTT_TRACE_H
+
+/**
+ * Binary tracing of the packets a client sends and receives.  Rather than formatting text, each event
+ * is stored as a fixed size record in a ring buffer belonging to the client, cheap enough to leave on
+ * in production.  The records can be copied out at any time, from any thread, and written to a file
+ * for tools/MQTTTraceDecode.cpp to print.  When MQTTCLIENT_TRACE is 0, MQTT_TRACE compiles to nothing.
+ */
+
+#if !defined(MQTTCLIENT_TRACE)
+    #define MQTTCLIENT_TRACE 0
+#endif
+#if !defined(MQTTCLIENT_TRACE_RECORDS)
+    #define MQTTCLIENT_TRACE_RECORDS 64     // must be a power of 2
+#endif
+
+#if !defined(MQTT_TRACE_TIMESTAMP)  // microseconds, wrapping, from any free running clock
+    #if defined(__MBED__)
+        #define MQTT_TRACE_TIMESTAMP() us_ticker_read()
+    #elif defined(__unix__) || defined(__APPLE__)
+        #include <time.h>
+        #define MQTT_TRACE_TIMESTAMP() MQTT::traceTimestamp()
+    #else
+        #define MQTT_TRACE_TIMESTAMP() 0
+    #endif
+#endif
+
+#if MQTTCLIENT_TRACE && !defined(MQTT_TRACE_FENCE)  // a full memory barrier, between the ring buffer writer and its readers
+    #if __cplusplus >= 201103L
+        #include <atomic>
+        #define MQTT_TRACE_FENCE() std::atomic_thread_fence(std::memory_order_seq_cst)
+    #elif defined(__GNUC__)
+        #define MQTT_TRACE_FENCE() __sync_synchronize()
+    #elif defined(__CC_ARM)
+        #define MQTT_TRACE_FENCE() __dmb(0xF)
+    #elif defined(__ICCARM__)
+        #include <intrinsics.h>
+        #define MQTT_TRACE_FENCE() __DMB()
+    #else
+        #error "MQTT_TRACE_FENCE must be defined as a full memory barrier for this compiler"
+    #endif
+#endif
+
+#include <stdint.h>
+
+namespace MQTT
+{
+
+enum TraceEvent
+{
+    TRACE_SEND = 1,         // a packet was sent
+    TRACE_SEND_FAILED,      // a packet could not be sent
+    TRACE_RECEIVE,          // a packet was received
+    TRACE_RECEIVE_FAILED,   // a packet started to arrive, but could not be read
+    TRACE_PING_TIMEOUT,     // no response to a ping within the keepalive interval
+    TRACE_QOS2_FULL         // an incoming QoS 2 packet id could not be recorded
+};
+
+struct TraceRecord
+{
+    uint32_t timestamp;     // from MQTT_TRACE_TIMESTAMP
+    uint8_t event;          // a TraceEvent
+    uint8_t packet_type;    // the MQTT packet type, 0 if none
+    uint16_t packet_id;     // the MQTT packet id, 0 if none
+    int32_t length;         // the length of the packet, including the payload
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+inline uint32_t traceTimestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+#endif
+
+
+// the packet id of a serialized packet, or 0 if it doesn't have one
+inline uint16_t tracePacketId(const unsigned char* buf, int len)
+{
+    int type = buf[0] >> 4;
+    int pos = 1;
+
+    while (pos < len && pos < 5 && (buf[pos] & 128) != 0)
+        ++pos;
+    ++pos;  // past the remaining length
+    if (type == 3)  // PUBLISH, where the packet id follows the topic name
+    {
+        if (((buf[0] >> 1) & 3) == 0 || pos + 2 > len)
+            return 0;
+        pos += 2 + buf[pos] * 256 + buf[pos + 1];
+    }
+    else if (type < 4 || type > 11)    // PUBACK to UNSUBACK have packet ids
+        return 0;
+    return (pos + 2 <= len) ? (uint16_t)(buf[pos] * 256 + buf[pos + 1]) : 0;
+}
+
+
+#if MQTTCLIENT_TRACE
+/**
+ * @class TraceBuffer
+ * @brief ring buffer of trace records, written by one thread and read by any
+ *
+ * The writer never waits: when the buffer is full the oldest records are overwritten.  Readers check
+ * afterwards whether the writer overtook them, and discard any records which might have changed while
+ * they were being copied, so no lock is needed on either side.
+ * @param RECORDS the number of records kept, a power of 2
+ */
+template<int RECORDS>
+class TraceBuffer
+{
+public:
+
+    TraceBuffer() : head(0)
+    {
+    }
+
+    void add(uint8_t event, const unsigned char* buf, int len, int total)
+    {
+        uint32_t h = head;
+        TraceRecord& r = records[h & (RECORDS - 1)];
+
+        r.timestamp = MQTT_TRACE_TIMESTAMP();
+        r.event = event;
+        r.packet_type = (buf && len > 0) ? buf[0] >> 4 : 0;
+        r.packet_id = (buf && len > 0) ? tracePacketId(buf, len) : 0;
+        r.length = total;
+        MQTT_TRACE_FENCE();     // the record must be complete before it is published
+        head = h + 1;
+    }
+
+    /** Copy out the records written since a previous read
+     *  @param out - the records, oldest first
+     *  @param max - the size of out
+     *  @param position - on entry, the position returned by the last read, or 0 for the first.  On
+     *      return, the position to pass next time
+     *  @return the number of records copied.  Records overwritten since the last read are skipped
+     */
+    int read(TraceRecord* out, int max, uint32_t& position)
+    {
+        uint32_t end = head;
+        MQTT_TRACE_FENCE();
+        uint32_t start = (end - position > (uint32_t)RECORDS) ? end - RECORDS : position;
+        int count = 0;
+
+        if (end - start > (uint32_t)max)
+            end = start + max;
+        for (uint32_t i = start; i != end; ++i)
+            out[count++] = records[i & (RECORDS - 1)];
+        MQTT_TRACE_FENCE();
+
+        // drop any records the writer may have been overwriting while they were copied
+        uint32_t overwritten = head - RECORDS + 1;
+        int skip = ((int32_t)(overwritten - start) > 0) ? (int)(overwritten - start) : 0;
+        if (skip > count)
+            skip = count;
+        for (int i = skip; i < count; ++i)
+            out[i - skip] = out[i];
+        position = end;
+        return count - skip;
+    }
+
+private:
+
+    TraceRecord records[RECORDS];
+    volatile uint32_t head;     // the number of records ever written
+
+};
+
+    #define MQTT_TRACE(trace, event, buf, len, total) (trace).add((event), (buf), (len), (total))
+#else
+    #define MQTT_TRACE(trace, event, buf, len, total) ((void)0)
+#endif
+
+}
+
+#endif
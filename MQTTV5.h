@@ -0,0 +1,532 @@
+#if !defined(MQTT_V5_H)
+#define MQTT_V5_H
+
+#include "MQTTPacket.h"
+#include <string.h>
+
+/**
+ * Serialization of the MQTT 5 packets which differ from MQTT 3.1.1, for MQTTCLIENT_MQTT5 mode.  The
+ * packets which are the same, or which MQTT 5 allows to be sent in their 3.1.1 form, such as PUBACK
+ * without a reason code, are left to MQTTPacket.  The functions follow the MQTTPacket conventions:
+ * serialize returns the packet length or MQTTPACKET_BUFFER_TOO_SHORT, deserialize returns 1 for success.
+ */
+namespace MQTT
+{
+
+namespace V5
+{
+
+enum PropertyId
+{
+    PAYLOAD_FORMAT_INDICATOR = 1, MESSAGE_EXPIRY_INTERVAL = 2, CONTENT_TYPE = 3, RESPONSE_TOPIC = 8,
+    CORRELATION_DATA = 9, SUBSCRIPTION_IDENTIFIER = 11, SESSION_EXPIRY_INTERVAL = 17,
+    ASSIGNED_CLIENT_IDENTIFIER = 18, SERVER_KEEP_ALIVE = 19, AUTHENTICATION_METHOD = 21,
+    AUTHENTICATION_DATA = 22, REQUEST_PROBLEM_INFORMATION = 23, WILL_DELAY_INTERVAL = 24,
+    REQUEST_RESPONSE_INFORMATION = 25, RESPONSE_INFORMATION = 26, SERVER_REFERENCE = 28, REASON_STRING = 31,
+    RECEIVE_MAXIMUM = 33, TOPIC_ALIAS_MAXIMUM = 34, TOPIC_ALIAS = 35, MAXIMUM_QOS = 36, RETAIN_AVAILABLE = 37,
+    USER_PROPERTY = 38, MAXIMUM_PACKET_SIZE = 39, WILDCARD_SUBSCRIPTION_AVAILABLE = 40,
+    SUBSCRIPTION_IDENTIFIER_AVAILABLE = 41, SHARED_SUBSCRIPTION_AVAILABLE = 42
+};
+
+// the properties the client acts on.  Others are skipped
+struct Properties
+{
+    unsigned short receiveMaximum;      // 65535 if absent, as then there is no limit
+    unsigned short topicAliasMaximum;   // 0 if absent
+    unsigned short topicAlias;          // 0 if absent
+    int serverKeepAlive;                // -1 if absent
+};
+
+
+inline void clearProperties(Properties& props)
+{
+    props.receiveMaximum = 65535;
+    props.topicAliasMaximum = 0;
+    props.topicAlias = 0;
+    props.serverKeepAlive = -1;
+}
+
+
+// the number of bytes in the variable byte integer encoding of a value
+inline int varintLength(int value)
+{
+    return (value < 128) ? 1 : (value < 16384) ? 2 : (value < 2097152) ? 3 : 4;
+}
+
+
+// decode a variable byte integer from a buffer, returning the number of bytes used or 0 if it's invalid
+inline int decodeVarint(unsigned char* ptr, unsigned char* enddata, int* value)
+{
+    int multiplier = 1;
+    int len = 0;
+
+    *value = 0;
+    do
+    {
+        if (len == 4 || ptr + len >= enddata)
+            return 0;
+        *value += (ptr[len] & 127) * multiplier;
+        multiplier *= 128;
+    } while ((ptr[len++] & 128) != 0);
+    return len;
+}
+
+
+// read a property length and the properties which follow it, returning 1 if they are well formed
+inline int readProperties(unsigned char** pptr, unsigned char* enddata, Properties& props)
+{
+    int proplen = 0;
+    int len = decodeVarint(*pptr, enddata, &proplen);
+    unsigned char* curdata = *pptr + len;
+    unsigned char* propend = curdata + proplen;
+
+    clearProperties(props);
+    if (len == 0 || propend > enddata)
+        return 0;
+    while (curdata < propend)
+    {
+        int id = readChar(&curdata);
+        int value = 0;
+        switch (id)
+        {
+            case PAYLOAD_FORMAT_INDICATOR: case REQUEST_PROBLEM_INFORMATION: case REQUEST_RESPONSE_INFORMATION:
+            case MAXIMUM_QOS: case RETAIN_AVAILABLE: case WILDCARD_SUBSCRIPTION_AVAILABLE:
+            case SUBSCRIPTION_IDENTIFIER_AVAILABLE: case SHARED_SUBSCRIPTION_AVAILABLE:
+                curdata += 1;
+                break;
+            case SERVER_KEEP_ALIVE: case RECEIVE_MAXIMUM: case TOPIC_ALIAS_MAXIMUM: case TOPIC_ALIAS:
+                if (propend - curdata < 2)
+                    return 0;
+                value = readInt(&curdata);
+                if (id == SERVER_KEEP_ALIVE)
+                    props.serverKeepAlive = value;
+                else if (id == RECEIVE_MAXIMUM)
+                    props.receiveMaximum = value;
+                else if (id == TOPIC_ALIAS_MAXIMUM)
+                    props.topicAliasMaximum = value;
+                else
+                    props.topicAlias = value;
+                break;
+            case MESSAGE_EXPIRY_INTERVAL: case SESSION_EXPIRY_INTERVAL: case WILL_DELAY_INTERVAL:
+            case MAXIMUM_PACKET_SIZE:
+                curdata += 4;
+                break;
+            case SUBSCRIPTION_IDENTIFIER:
+                if ((len = decodeVarint(curdata, propend, &value)) == 0)
+                    return 0;
+                curdata += len;
+                break;
+            case USER_PROPERTY:     // a pair of strings
+                if (propend - curdata < 2)
+                    return 0;
+                curdata += 2 + curdata[0] * 256 + curdata[1];
+                // fall through to the second string
+            case CONTENT_TYPE: case RESPONSE_TOPIC: case CORRELATION_DATA: case ASSIGNED_CLIENT_IDENTIFIER:
+            case AUTHENTICATION_METHOD: case AUTHENTICATION_DATA: case RESPONSE_INFORMATION:
+            case SERVER_REFERENCE: case REASON_STRING:
+                if (propend - curdata < 2)
+                    return 0;
+                curdata += 2 + curdata[0] * 256 + curdata[1];
+                break;
+            default:
+                return 0;
+        }
+        if (curdata > propend)
+            return 0;
+    }
+    *pptr = propend;
+    return 1;
+}
+
+
+inline bool present(MQTTString& string)
+{
+    return string.cstring != 0 || string.lenstring.data != 0;
+}
+
+
+/**
+ * Serialize a CONNECT packet, asking for no more than receiveMaximum QoS 1 and 2 messages to be sent
+ * to us unacknowledged, and allowing the server up to topicAliasMaximum topic aliases.  The session is
+ * kept for sessionExpiry seconds after the connection closes, 0xFFFFFFFF for ever, or ends with it if 0
+ */
+inline int serializeConnect(unsigned char* buf, int buflen, MQTTPacket_connectData* options,
+                            unsigned short receiveMaximum, unsigned short topicAliasMaximum, unsigned int sessionExpiry)
+{
+    unsigned char* ptr = buf;
+    MQTTHeader header = {0};
+    unsigned char flags = 0;
+    int proplen = ((receiveMaximum < 65535) ? 3 : 0) + ((topicAliasMaximum > 0) ? 3 : 0) + ((sessionExpiry > 0) ? 5 : 0);
+    int rem_len = 10 + varintLength(proplen) + proplen + 2 + MQTTstrlen(options->clientID);
+
+    if (options->willFlag)
+        rem_len += 1 + 2 + MQTTstrlen(options->will.topicName) + 2 + MQTTstrlen(options->will.message);
+    if (present(options->username))
+        rem_len += 2 + MQTTstrlen(options->username);
+    if (present(options->password))
+        rem_len += 2 + MQTTstrlen(options->password);
+    if (MQTTPacket_len(rem_len) > buflen)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+
+    header.bits.type = CONNECT;
+    writeChar(&ptr, header.byte);
+    ptr += MQTTPacket_encode(ptr, rem_len);
+    writeCString(&ptr, "MQTT");
+    writeChar(&ptr, 5);     // protocol version
+
+    if (options->cleansession)
+        flags |= 0x02;
+    if (options->willFlag)
+        flags |= 0x04 | ((options->will.qos & 3) << 3) | (options->will.retained ? 0x20 : 0);
+    if (present(options->password))
+        flags |= 0x40;
+    if (present(options->username))
+        flags |= 0x80;
+    writeChar(&ptr, flags);
+    writeInt(&ptr, options->keepAliveInterval);
+
+    ptr += MQTTPacket_encode(ptr, proplen);
+    if (sessionExpiry > 0)
+    {
+        writeChar(&ptr, SESSION_EXPIRY_INTERVAL);
+        writeInt(&ptr, sessionExpiry >> 16);
+        writeInt(&ptr, sessionExpiry & 0xFFFF);
+    }
+    if (receiveMaximum < 65535)
+    {
+        writeChar(&ptr, RECEIVE_MAXIMUM);
+        writeInt(&ptr, receiveMaximum);
+    }
+    if (topicAliasMaximum > 0)
+    {
+        writeChar(&ptr, TOPIC_ALIAS_MAXIMUM);
+        writeInt(&ptr, topicAliasMaximum);
+    }
+
+    writeMQTTString(&ptr, options->clientID);
+    if (options->willFlag)
+    {
+        writeChar(&ptr, 0);     // no will properties
+        writeMQTTString(&ptr, options->will.topicName);
+        writeMQTTString(&ptr, options->will.message);
+    }
+    if (present(options->username))
+        writeMQTTString(&ptr, options->username);
+    if (present(options->password))
+        writeMQTTString(&ptr, options->password);
+    return ptr - buf;
+}
+
+
+inline int deserializeConnack(unsigned char* sessionPresent, unsigned char* reasonCode, Properties& props,
+                              unsigned char* buf, int buflen)
+{
+    unsigned char* curdata = buf;
+    int rem_len = 0;
+
+    if (readChar(&curdata) != (char)(CONNACK << 4))
+        return 0;
+    curdata += MQTTPacket_decodeBuf(curdata, &rem_len);
+    unsigned char* enddata = curdata + rem_len;
+    if (rem_len < 2 || enddata > buf + buflen)
+        return 0;
+    *sessionPresent = readChar(&curdata) & 0x01;
+    *reasonCode = readChar(&curdata);
+    if (curdata == enddata)     // properties may be left out when the connection is refused
+    {
+        clearProperties(props);
+        return 1;
+    }
+    return readProperties(&curdata, enddata, props);
+}
+
+
+/**
+ * Deserialize a PUBACK, PUBREC, PUBREL or PUBCOMP packet.  The reason code after the packet id is 0,
+ * success, if it is left out, and any properties are skipped
+ */
+inline int deserializeAck(unsigned char* packettype, unsigned char* dup, unsigned short* packetid,
+                          unsigned char* reasonCode, unsigned char* buf, int buflen)
+{
+    MQTTHeader header = {0};
+    unsigned char* curdata = buf;
+    int rem_len = 0;
+
+    header.byte = readChar(&curdata);
+    *dup = header.bits.dup;
+    *packettype = header.bits.type;
+    curdata += MQTTPacket_decodeBuf(curdata, &rem_len);
+    unsigned char* enddata = curdata + rem_len;
+    if (rem_len < 2 || enddata > buf + buflen)
+        return 0;
+    *packetid = readInt(&curdata);
+    *reasonCode = (curdata < enddata) ? readChar(&curdata) : 0;
+    return 1;
+}
+
+
+/**
+ * Serialize a PUBLISH packet up to, but not including, the payload.  If topicAlias is not 0 it is sent
+ * as a property, and the topic name can be empty to use an alias set earlier.
+ */
+inline int serializePublishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+                                  unsigned short packetid, MQTTString topicName, unsigned short topicAlias, int payloadlen)
+{
+    unsigned char* ptr = buf;
+    MQTTHeader header = {0};
+    int proplen = (topicAlias > 0) ? 3 : 0;
+    int rem_len = 2 + MQTTstrlen(topicName) + ((qos > 0) ? 2 : 0) + 1 + proplen + payloadlen;
+
+    if (MQTTPacket_len(rem_len) - payloadlen > buflen)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+
+    header.bits.type = PUBLISH;
+    header.bits.dup = dup;
+    header.bits.qos = qos;
+    header.bits.retain = retained;
+    writeChar(&ptr, header.byte);
+    ptr += MQTTPacket_encode(ptr, rem_len);
+    writeMQTTString(&ptr, topicName);
+    if (qos > 0)
+        writeInt(&ptr, packetid);
+    writeChar(&ptr, proplen);
+    if (topicAlias > 0)
+    {
+        writeChar(&ptr, TOPIC_ALIAS);
+        writeInt(&ptr, topicAlias);
+    }
+    return ptr - buf;
+}
+
+
+/**
+ * Deserialize the topic name, packet id and properties of a PUBLISH packet of which len bytes are in buf.
+ * Returns the offset of the payload, or 0 if the packet is malformed
+ */
+inline int deserializePublishHeader(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid,
+                                    MQTTString* topicName, Properties& props, unsigned char* buf, int len)
+{
+    MQTTHeader header = {0};
+    unsigned char* curdata = buf;
+    unsigned char* enddata = buf + len;
+    int rem_len = 0;
+
+    header.byte = readChar(&curdata);
+    if (header.bits.type != PUBLISH)
+        return 0;
+    *dup = header.bits.dup;
+    *qos = header.bits.qos;
+    *retained = header.bits.retain;
+    curdata += MQTTPacket_decodeBuf(curdata, &rem_len);
+    if (!readMQTTLenString(topicName, &curdata, enddata) || enddata - curdata < ((*qos > 0) ? 2 : 0))
+        return 0;
+    *packetid = (*qos > 0) ? readInt(&curdata) : 0;
+    if (!readProperties(&curdata, enddata, props))
+        return 0;
+    return curdata - buf;
+}
+
+
+/**
+ * Serialize a SUBSCRIBE packet, each topic filter with subscription options of just its maximum QoS
+ */
+inline int serializeSubscribe(unsigned char* buf, int buflen, unsigned short packetid, int count,
+                              MQTTString topicFilters[], int requestedQoSs[])
+{
+    unsigned char* ptr = buf;
+    MQTTHeader header = {0};
+    int rem_len = 2 + 1;
+
+    for (int i = 0; i < count; ++i)
+        rem_len += 2 + MQTTstrlen(topicFilters[i]) + 1;
+    if (MQTTPacket_len(rem_len) > buflen)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+
+    header.byte = 0;
+    header.bits.type = SUBSCRIBE;
+    header.bits.qos = 1;
+    writeChar(&ptr, header.byte);
+    ptr += MQTTPacket_encode(ptr, rem_len);
+    writeInt(&ptr, packetid);
+    writeChar(&ptr, 0);     // no properties
+    for (int i = 0; i < count; ++i)
+    {
+        writeMQTTString(&ptr, topicFilters[i]);
+        writeChar(&ptr, requestedQoSs[i] & 3);
+    }
+    return ptr - buf;
+}
+
+
+/**
+ * Deserialize a SUBACK packet into the granted QoSs.  Any of the MQTT 5 failure reason codes is returned
+ * as 0x80, as in MQTT 3.1.1
+ */
+inline int deserializeSuback(unsigned short* packetid, int maxcount, int* count, int grantedQoSs[],
+                             unsigned char* buf, int buflen)
+{
+    unsigned char* curdata = buf;
+    int rem_len = 0;
+    Properties props;
+
+    if (readChar(&curdata) != (char)(SUBACK << 4))
+        return 0;
+    curdata += MQTTPacket_decodeBuf(curdata, &rem_len);
+    unsigned char* enddata = curdata + rem_len;
+    if (rem_len < 3 || enddata > buf + buflen)
+        return 0;
+    *packetid = readInt(&curdata);
+    if (!readProperties(&curdata, enddata, props))
+        return 0;
+    *count = 0;
+    while (curdata < enddata)
+    {
+        if (*count >= maxcount)
+            return 0;
+        unsigned char reasonCode = readChar(&curdata);
+        grantedQoSs[(*count)++] = (reasonCode >= 0x80) ? 0x80 : reasonCode;
+    }
+    return 1;
+}
+
+
+inline int serializeUnsubscribe(unsigned char* buf, int buflen, unsigned short packetid, int count,
+                                MQTTString topicFilters[])
+{
+    unsigned char* ptr = buf;
+    MQTTHeader header = {0};
+    int rem_len = 2 + 1;
+
+    for (int i = 0; i < count; ++i)
+        rem_len += 2 + MQTTstrlen(topicFilters[i]);
+    if (MQTTPacket_len(rem_len) > buflen)
+        return MQTTPACKET_BUFFER_TOO_SHORT;
+
+    header.byte = 0;
+    header.bits.type = UNSUBSCRIBE;
+    header.bits.qos = 1;
+    writeChar(&ptr, header.byte);
+    ptr += MQTTPacket_encode(ptr, rem_len);
+    writeInt(&ptr, packetid);
+    writeChar(&ptr, 0);     // no properties
+    for (int i = 0; i < count; ++i)
+        writeMQTTString(&ptr, topicFilters[i]);
+    return ptr - buf;
+}
+
+
+/**
+ * @class TopicAliases
+ * @brief topic aliases for one direction of a connection
+ *
+ * Each alias is the copy of a topic name of up to MAX_LENGTH bytes.  Outbound, the least recently
+ * used alias is reassigned when they are all in use.
+ */
+template<int ALIASES, int MAX_LENGTH>
+class TopicAliases
+{
+public:
+    TopicAliases()
+    {
+        clear(0);
+    }
+
+    // forget all the aliases, as at the start of a connection, and allow up to limit of them
+    void clear(int limit)
+    {
+        this->limit = (limit < ALIASES) ? limit : ALIASES;
+        for (int i = 0; i < SLOTS; ++i)
+        {
+            lengths[i] = 0;
+            used[i] = 0;
+        }
+        clock = 0;
+    }
+
+    // the alias for a topic name, or 0 if it has none
+    int find(const char* topic, int len)
+    {
+        for (int i = 0; i < limit; ++i)
+        {
+            if (lengths[i] == len && len > 0 && memcmp(topics[i], topic, len) == 0)
+            {
+                used[i] = ++clock;
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+
+    // give a topic name an alias, the least recently used if all are taken, or return 0 if it can't have one
+    int assign(const char* topic, int len)
+    {
+        int oldest = 0;
+
+        if (limit == 0 || len <= 0 || len > MAX_LENGTH)
+            return 0;
+        for (int i = 1; i < limit; ++i)
+        {
+            if (used[i] < used[oldest])
+                oldest = i;
+        }
+        return set(oldest + 1, topic, len) ? oldest + 1 : 0;
+    }
+
+    // the number of aliases allowed on this connection
+    int maximum()
+    {
+        return limit;
+    }
+
+    // forget an alias
+    void remove(int alias)
+    {
+        if (alias >= 1 && alias <= limit)
+        {
+            lengths[alias - 1] = 0;
+            used[alias - 1] = 0;
+        }
+    }
+
+    // set an alias chosen by the other side, returning false if it isn't allowed or the topic name is too long
+    bool set(int alias, const char* topic, int len)
+    {
+        if (alias < 1 || alias > limit)
+            return false;
+        if (len > MAX_LENGTH)
+        {
+            lengths[alias - 1] = 0;     // forget the topic name it had
+            return false;
+        }
+        memcpy(topics[alias - 1], topic, len);
+        lengths[alias - 1] = len;
+        used[alias - 1] = ++clock;
+        return true;
+    }
+
+    // the topic name for an alias, returning false if it isn't set
+    bool get(int alias, MQTTString& topic)
+    {
+        if (alias < 1 || alias > limit || lengths[alias - 1] == 0)
+            return false;
+        topic.cstring = 0;
+        topic.lenstring.data = topics[alias - 1];
+        topic.lenstring.len = lengths[alias - 1];
+        return true;
+    }
+
+private:
+    static const int SLOTS = (ALIASES > 0) ? ALIASES : 1;
+
+    char topics[SLOTS][MAX_LENGTH];
+    int lengths[SLOTS];         // 0 if the alias is not set
+    unsigned long used[SLOTS];  // when each alias was last used, for replacement
+    unsigned long clock;
+    int limit;                  // the number of aliases allowed on this connection
+};
+
+}
+
+}
+
+#endif
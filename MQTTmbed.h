@@ -3,31 +3,32 @@
 
 #include "mbed.h"
 
+/**
+ * A deadline on the system microsecond ticker, so that starting one is an addition and checking one
+ * is a read of the ticker, rather than starting, stopping and reading a Timer of its own.  There is no
+ * Now class to hold the time, as it would have to be per thread, and reading the ticker is cheap.
+ */
 class Countdown
 {
 public:
-    Countdown() : t()
+    Countdown() : end_ms(0)
     {
   
     }
     
-    Countdown(int ms) : t()
+    Countdown(int ms)
     {
         countdown_ms(ms);   
     }
     
-    
     bool expired()
     {
-        return t.read_ms() >= interval_end_ms;
+        return left_ms() <= 0;
     }
     
     void countdown_ms(unsigned long ms)  
     {
-        t.stop();
-        interval_end_ms = ms;
-        t.reset();
-        t.start();
+        end_ms = now_ms() + ms;
     }
     
     void countdown(int seconds)
@@ -35,14 +36,28 @@ public:
         countdown_ms((unsigned long)seconds * 1000L);
     }
     
+    /** Put the calling thread to sleep
+     */
+    static void sleep_ms(int ms)
+    {
+        wait_ms(ms);
+    }
+    
     int left_ms()
     {
-        return interval_end_ms - t.read_ms();
+        long long left = (long long)(end_ms - now_ms());
+        return (left < 0) ? 0 : (int)left;
     }
     
 private:
-    Timer t;
-    unsigned long interval_end_ms; 
+
+    // milliseconds from the microsecond ticker, which is read under a lock, so any thread can use it
+    static uint64_t now_ms()
+    {
+        return ticker_read_us(get_us_ticker_data()) / 1000;
+    }
+
+    uint64_t end_ms; 
 };
 
 #endif
\ No newline at end of file
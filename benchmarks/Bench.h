@@ -0,0 +1,109 @@
+#if !defined(MQTT_BENCH_H)
+#define MQTT_BENCH_H
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+/**
+ * Timing and reporting for the benchmarks.  Each prints a line for every configuration it runs, with
+ * the rate and the 50th, 99th and 99.9th percentile latencies of the operation it measures.  Given -q
+ * on the command line, as when run by ctest, they run only a few operations of each, which checks
+ * that they work rather than measuring anything.
+ */
+namespace Bench
+{
+
+inline long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// the processor time used by the calling thread, so that a server thread in the same process isn't counted
+inline long long cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+inline bool quick(int argc, char** argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-q") == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @class Latencies
+ * @brief collects the time each operation took, and reports their rate and distribution
+ */
+class Latencies
+{
+public:
+
+    Latencies(int max) : started(0), ended(0)
+    {
+        samples.reserve(max);
+    }
+
+    /** Mark the start of the timed run, from which the rate is worked out */
+    void begin()
+    {
+        started = now_ns();
+    }
+
+    void add(long long ns)
+    {
+        samples.push_back(ns);
+    }
+
+    /** Mark the end of the timed run */
+    void end()
+    {
+        ended = now_ns();
+    }
+
+    /** Print the number of operations, their rate, and the latency percentiles in microseconds
+     *  @param name - what was measured
+     *  @param unit - what an operation is, such as "msgs"
+     *  @param perSample - the operations each time added covers, such as the messages in a batch
+     */
+    void report(const char* name, const char* unit = "msgs", int perSample = 1)
+    {
+        double seconds = (ended - started) / 1e9;
+        int count = (int)samples.size() * perSample;
+
+        std::sort(samples.begin(), samples.end());
+        printf("%-36s %8d %s %11.0f %s/s   p50 %9.2f  p99 %9.2f  p99.9 %9.2f us\n", name, count,
+               unit, (seconds > 0) ? count / seconds : 0.0, unit,
+               percentile(0.5), percentile(0.99), percentile(0.999));
+        fflush(stdout);
+    }
+
+private:
+
+    double percentile(double p)
+    {
+        if (samples.empty())
+            return 0.0;
+        size_t i = (size_t)(p * samples.size());
+        return samples[(i < samples.size()) ? i : samples.size() - 1] / 1e3;
+    }
+
+    std::vector<long long> samples;
+    long long started;
+    long long ended;
+
+};
+
+}
+
+#endif
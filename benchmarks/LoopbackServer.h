@@ -0,0 +1,154 @@
+#if !defined(MQTT_LOOPBACK_SERVER_H)
+#define MQTT_LOOPBACK_SERVER_H
+
+#include "MQTTLoopback.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <vector>
+
+/**
+ * @class LoopbackServer
+ * @brief a TCP front for MQTTLoopback, so that the benchmarks can run clients over real sockets with no broker
+ *
+ * One thread serves all the connections, waiting on them with epoll.  Each connection has a loopback
+ * broker of its own, so a client's publications only go back to that client's subscriptions.
+ * @param BUFFER_SIZE the size of the loopback buffers of each connection
+ * @param MAX_SUBSCRIPTIONS the number of topic filters each connection can subscribe to
+ */
+template<int BUFFER_SIZE = 65536, int MAX_SUBSCRIPTIONS = 8>
+class LoopbackServer
+{
+public:
+
+    LoopbackServer() : listener(-1), epoll(-1), stopping(false), started(false)
+    {
+    }
+
+    ~LoopbackServer()
+    {
+        stopping = true;
+        if (started)
+            pthread_join(thread, 0);
+        for (size_t i = 0; i < connections.size(); ++i)
+        {
+            if (connections[i]->fd >= 0)
+                close(connections[i]->fd);
+            delete connections[i];
+        }
+        if (listener >= 0)
+            close(listener);
+        if (epoll >= 0)
+            close(epoll);
+    }
+
+    /** Listen on a port of the loopback interface chosen by the system, and start serving
+     *  @return the port, or -1 on failure
+     */
+    int start()
+    {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        struct epoll_event event;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if ((listener = socket(AF_INET, SOCK_STREAM, 0)) < 0 || bind(listener, (struct sockaddr*)&addr, len) != 0 ||
+            listen(listener, 1024) != 0 || getsockname(listener, (struct sockaddr*)&addr, &len) != 0)
+            return -1;
+        if ((epoll = epoll_create1(0)) < 0)
+            return -1;
+        event.events = EPOLLIN;
+        event.data.ptr = 0;     // the listener
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event) != 0)
+            return -1;
+        if (pthread_create(&thread, 0, &LoopbackServer::run, this) != 0)
+            return -1;
+        started = true;
+        return ntohs(addr.sin_port);
+    }
+
+private:
+
+    struct Connection
+    {
+        int fd;
+        MQTTLoopback<BUFFER_SIZE, MAX_SUBSCRIPTIONS> broker;
+    };
+
+    static void* run(void* argument)
+    {
+        LoopbackServer* server = (LoopbackServer*)argument;
+        struct epoll_event events[64];
+
+        while (!server->stopping)
+        {
+            int count = epoll_wait(server->epoll, events, 64, 100);   // wakes to check for stopping
+            for (int i = 0; i < count; ++i)
+            {
+                if (events[i].data.ptr == 0)
+                    server->accept();
+                else
+                    server->serve((Connection*)events[i].data.ptr);
+            }
+        }
+        return 0;
+    }
+
+    void accept()
+    {
+        int fd = ::accept(listener, 0, 0);
+        int flag = 1;
+        struct epoll_event event;
+
+        if (fd < 0)
+            return;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        Connection* c = new Connection;
+        c->fd = fd;
+        c->broker.connect();
+        event.events = EPOLLIN;
+        event.data.ptr = c;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+        connections.push_back(c);
+    }
+
+    // pass what the client sent to its broker, and send back what the broker responds with
+    void serve(Connection* c)
+    {
+        unsigned char buf[4096];
+        ssize_t len = recv(c->fd, buf, sizeof(buf), 0);
+
+        if (len <= 0 || c->broker.write(buf, (int)len, 0) != len)
+        {
+            close(c->fd);   // which takes it out of the epoll set
+            c->fd = -1;
+            return;
+        }
+        while ((len = c->broker.read(buf, sizeof(buf), 0)) > 0)
+        {
+            for (ssize_t sent = 0, rc = 0; sent < len; sent += rc)
+            {
+                if ((rc = send(c->fd, &buf[sent], len - sent, MSG_NOSIGNAL)) <= 0)
+                    return;
+            }
+        }
+    }
+
+    int listener;
+    int epoll;
+    volatile bool stopping;
+    bool started;
+    pthread_t thread;
+    std::vector<Connection*> connections;
+
+};
+
+#endif
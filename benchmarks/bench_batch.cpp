@@ -0,0 +1,113 @@
+/*******************************************************************************
+ * QoS 0 publishing rate of MQTT::Client over MQTTPosixSocket to the TCP loopback broker, writing each
+ * publication to the socket as it's made, against packing them into batches with cork and flush, and
+ * with publishBatch.  The batches are of 64 messages, and their latencies are of a whole batch.  Each
+ * run ends with a QoS 1 round trip, so that its time includes the broker receiving every message.
+ *
+ *    bench_batch [-q]
+ *******************************************************************************/
+
+#define MQTTCLIENT_BATCH_SIZE 4096
+
+#include "MQTTPosixSocket.h"
+#include "MQTTClient.h"
+#include "LoopbackServer.h"
+#include "Bench.h"
+
+#include <stdlib.h>
+
+static const int BATCH = 64;
+static const int MAX_PAYLOAD = 256;
+
+typedef MQTT::Client<MQTTPosixSocket, Countdown, MAX_PAYLOAD + 100> Client;
+
+static char payload[MAX_PAYLOAD];
+static const char* topics[BATCH];
+static MQTT::Message messages[BATCH];
+
+enum Mode { EACH, CORK, BATCHED };
+
+
+static void fail(const char* what)
+{
+    printf("%s failed\n", what);
+    exit(1);
+}
+
+
+static void publish(Client& client, int count, int size, Mode mode)
+{
+    const char* names[] = {"publish", "cork and flush", "publishBatch"};
+    Bench::Latencies latencies(count);
+    char name[64];
+
+    for (int i = 0; i < BATCH; ++i)
+        messages[i].payloadlen = size;
+
+    latencies.begin();
+    for (int i = 0; i < count; i += (mode == EACH) ? 1 : BATCH)
+    {
+        long long start = Bench::now_ns();
+        int rc = MQTT::SUCCESS;
+
+        if (mode == EACH)
+            rc = client.publish(topics[0], payload, size, MQTT::QOS0);
+        else if (mode == CORK)
+        {
+            client.cork();
+            for (int j = 0; rc == MQTT::SUCCESS && j < BATCH; ++j)
+                rc = client.publish(topics[j], payload, size, MQTT::QOS0);
+            if (rc == MQTT::SUCCESS)
+                rc = client.flush();
+        }
+        else
+            rc = client.publishBatch(topics, messages, BATCH);
+        if (rc != MQTT::SUCCESS)
+            fail("publish");
+        latencies.add(Bench::now_ns() - start);
+    }
+    if (client.publish(topics[0], payload, 16, MQTT::QOS1) != MQTT::SUCCESS)
+        fail("publish");
+    latencies.end();
+    snprintf(name, sizeof(name), "%s qos0 %dB", names[mode], size);
+    latencies.report(name, "msgs", (mode == EACH) ? 1 : BATCH);
+}
+
+
+int main(int argc, char* argv[])
+{
+    const int count = Bench::quick(argc, argv) ? 128 : 1000000;
+    const int sizes[] = {16, 64, MAX_PAYLOAD};
+    LoopbackServer<> server;
+    MQTTPosixSocket network;
+    Client client(network);
+    int port = server.start();
+
+    memset(payload, 'x', sizeof(payload));
+    for (int i = 0; i < BATCH; ++i)
+    {
+        topics[i] = "bench/batch";
+        messages[i].qos = MQTT::QOS0;
+        messages[i].retained = false;
+        messages[i].dup = false;
+        messages[i].payload = payload;
+    }
+    if (port < 0 || network.connect("127.0.0.1", port) != 0)
+        fail("TCP connect");
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = 4;
+    data.clientID.cstring = (char*)"bench";
+    if (client.connect(data) != MQTT::SUCCESS)
+        fail("connect");
+
+    for (int s = 0; s < 3; ++s)
+    {
+        publish(client, count, sizes[s], EACH);
+        publish(client, count, sizes[s], CORK);
+        publish(client, count, sizes[s], BATCHED);
+    }
+
+    client.disconnect();
+    network.disconnect();
+    return 0;
+}
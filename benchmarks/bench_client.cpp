@@ -0,0 +1,260 @@
+/*******************************************************************************
+ * Throughput and latency of MQTT::Client through the in-memory loopback broker, timed with the POSIX
+ * clock.  There are three kinds of run:
+ *  - publish: publications to the client's own subscription at each QoS, for each payload size and
+ *    each MAX_MQTT_PACKET_SIZE the client is instantiated with.  The latency is from the publish
+ *    call to the message handler.
+ *  - fan-in: publications from many publishers, each on a topic of its own, arriving at the one
+ *    wildcard subscription.  The latency is the time the client takes to deliver each message after
+ *    the one before.
+ *  - reconnect: dropping the connection, then connecting and subscribing again.
+ * The client reads the messages with step(), which returns when there is nothing more to read.
+ *
+ *    bench_client [-q] [payload size ...]
+ *******************************************************************************/
+
+#define MQTTCLIENT_QOS2 1
+
+#include "MQTTPosix.h"
+#include "MQTTLoopback.h"
+#include "MQTTClient.h"
+#include "Bench.h"
+
+#include <stdlib.h>
+
+static const int MAX_TOPICS = 64;
+static const int MAX_SIZES = 16;
+
+typedef MQTTLoopback<64 * 1024, MAX_TOPICS> Network;
+
+static int arrived = 0;
+static long long arrivedAt = 0;
+static Bench::Latencies* deliveries = 0;   // if set, the time since the previous message is added
+static char topics[MAX_TOPICS][16];
+static char payload[8192];
+
+void messageArrived(MQTT::MessageData&)
+{
+    long long now = Bench::now_ns();
+
+    if (deliveries)
+        deliveries->add(now - arrivedAt);
+    arrivedAt = now;
+    ++arrived;
+}
+
+
+static void fail(const char* what)
+{
+    printf("%s failed\n", what);
+    exit(1);
+}
+
+
+static MQTTPacket_connectData connectData()
+{
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = 4;
+    data.clientID.cstring = (char*)"bench";
+    return data;
+}
+
+
+// read messages until the one expected has arrived
+template<class Client>
+static void receive(Client& client, int expected)
+{
+    while (arrived < expected)
+    {
+        if (client.step() < 0)
+            fail("step");
+    }
+}
+
+
+// publish messages to a subscription of the client's own, reading each back before sending the next
+template<int PACKET_SIZE>
+static void publish(int count, int size, MQTT::QoS qos)
+{
+    typedef MQTT::Client<Network, Countdown, PACKET_SIZE, MAX_TOPICS> Client;
+    Network network;
+    Client client(network);
+    MQTTPacket_connectData data = connectData();
+    Bench::Latencies latencies(count);
+    char name[64];
+
+    if (network.connect() != 0 || client.connect(data) != MQTT::SUCCESS)
+        fail("connect");
+    if (client.subscribe("bench/data", MQTT::QOS2, messageArrived) != MQTT::SUCCESS)
+        fail("subscribe");
+
+    latencies.begin();
+    for (int i = 0; i < count; ++i)
+    {
+        int expected = arrived + 1;
+        long long start = Bench::now_ns();
+
+        if (client.publish("bench/data", payload, size, qos) != MQTT::SUCCESS)
+            fail("publish");
+        receive(client, expected);
+        latencies.add(arrivedAt - start);
+    }
+    latencies.end();
+    client.disconnect();
+    snprintf(name, sizeof(name), "publish qos%d %dB packet %d", qos, size, PACKET_SIZE);
+    latencies.report(name);
+}
+
+
+// have the broker send the client messages from a number of publishers, half a buffer full at a time
+static void fanIn(int count, int publishers, MQTT::QoS qos)
+{
+    typedef MQTT::Client<Network, Countdown, 512, MAX_TOPICS> Client;
+    Network network;
+    Client client(network);
+    MQTTPacket_connectData data = connectData();
+    Bench::Latencies latencies(count);
+    unsigned char buf[256];
+    unsigned short id = 0;
+    char name[64];
+
+    if (network.connect() != 0 || client.connect(data) != MQTT::SUCCESS)
+        fail("connect");
+    if (client.subscribe("bench/+/data", MQTT::QOS2, messageArrived) != MQTT::SUCCESS)
+        fail("subscribe");
+
+    latencies.begin();
+    for (int sent = 0; sent < count; )
+    {
+        int expected = arrived;
+
+        while (sent < count)
+        {
+            char topic[32];
+            MQTTString topicName = MQTTString_initializer;
+
+            snprintf(topic, sizeof(topic), "bench/%d/data", sent % publishers);
+            topicName.cstring = topic;
+            id = (id == 65535) ? 1 : id + 1;
+            int len = MQTTSerialize_publish(buf, sizeof(buf), 0, qos, 0, id, topicName, (unsigned char*)payload, 16);
+            if (network.pending() + len > 32 * 1024)
+                break;      // leaves room for the replies to the client
+            if (network.inject(buf, len) != 0)
+                fail("inject");
+            ++sent;
+            ++expected;
+        }
+
+        arrivedAt = Bench::now_ns();
+        deliveries = &latencies;
+        receive(client, expected);
+        deliveries = 0;
+    }
+    latencies.end();
+    client.disconnect();
+    snprintf(name, sizeof(name), "fan-in qos%d %d publishers", qos, publishers);
+    latencies.report(name);
+}
+
+
+template<class Client>
+static void subscribe(Client& client, int topicCount)
+{
+    for (int t = 0; t < topicCount; ++t)
+    {
+        if (client.subscribe(topics[t], MQTT::QOS2, messageArrived) != MQTT::SUCCESS)
+            fail("subscribe");
+    }
+}
+
+
+// drop the connection, and time noticing it, reconnecting and renewing the subscriptions
+static void reconnect(int count, int topicCount)
+{
+    typedef MQTT::Client<Network, Countdown, 512, MAX_TOPICS> Client;
+    Network network;
+    Client client(network);
+    MQTTPacket_connectData data = connectData();
+    Bench::Latencies latencies(count);
+    char name[64];
+
+    if (network.connect() != 0 || client.connect(data) != MQTT::SUCCESS)
+        fail("connect");
+    subscribe(client, topicCount);
+
+    latencies.begin();
+    for (int i = 0; i < count; ++i)
+    {
+        network.drop();
+        long long start = Bench::now_ns();
+        if (client.yield(100) == MQTT::SUCCESS || client.isConnected())
+            fail("noticing the lost connection");
+        if (network.connect() != 0 || client.connect(data) != MQTT::SUCCESS)
+            fail("reconnect");
+        subscribe(client, topicCount);
+        latencies.add(Bench::now_ns() - start);
+    }
+    latencies.end();
+    if (network.count(SUBSCRIBE) != topicCount * (count + 1))
+        fail("resubscribe");
+    client.disconnect();
+    snprintf(name, sizeof(name), "reconnect %d topics", topicCount);
+    latencies.report(name, "reconnects");
+}
+
+
+// run the payload sizes which fit in the packet size at each QoS
+template<int PACKET_SIZE>
+static void publishAll(int count, const int* sizes, int sizeCount)
+{
+    const MQTT::QoS qoss[] = {MQTT::QOS0, MQTT::QOS1, MQTT::QOS2};
+
+    for (int s = 0; s < sizeCount; ++s)
+    {
+        if (sizes[s] + 32 > PACKET_SIZE)
+            continue;   // leaves room for the fixed header and topic
+        for (int q = 0; q < 3; ++q)
+            publish<PACKET_SIZE>(count, sizes[s], qoss[q]);
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    const int count = Bench::quick(argc, argv) ? 100 : 50000;
+    int sizes[MAX_SIZES] = {16, 256, 1024, 4096};
+    int sizeCount = 4;
+
+    if (argc > 1 + Bench::quick(argc, argv))
+    {
+        sizeCount = 0;
+        for (int i = 1; i < argc && sizeCount < MAX_SIZES; ++i)
+        {
+            int size = atoi(argv[i]);
+            if (size > 0 && size + 32 <= (int)sizeof(payload))
+                sizes[sizeCount++] = size;
+            else if (strcmp(argv[i], "-q") != 0)
+                printf("payload size %s skipped: up to %d bytes can be published\n", argv[i], (int)sizeof(payload) - 32);
+        }
+    }
+    for (int i = 0; i < MAX_TOPICS; ++i)
+        snprintf(topics[i], sizeof(topics[i]), "bench/%d", i);
+    memset(payload, 'x', sizeof(payload));
+
+    publishAll<128>(count, sizes, sizeCount);
+    publishAll<512>(count, sizes, sizeCount);
+    publishAll<2048>(count, sizes, sizeCount);
+    publishAll<(int)sizeof(payload)>(count, sizes, sizeCount);
+
+    const int publishers[] = {1, 16, 256};
+    for (int p = 0; p < 3; ++p)
+    {
+        fanIn(count, publishers[p], MQTT::QOS0);
+        fanIn(count, publishers[p], MQTT::QOS1);
+    }
+
+    const int topicCounts[] = {1, 8, MAX_TOPICS};
+    for (int t = 0; t < 3; ++t)
+        reconnect(count / 10 + 1, topicCounts[t]);
+    return 0;
+}
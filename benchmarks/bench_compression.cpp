@@ -0,0 +1,109 @@
+/*******************************************************************************
+ * Compression ratio and processor time of the bundled codecs on JSON telemetry: one reading of a
+ * device, and batches of 4, 16 and 64 readings, as a device might publish them.  Each codec runs
+ * through compressPayload and decompressPayload, as the client does, and each round trip is checked.
+ * The rates are of the original payload bytes per second of processor time.
+ *
+ *    bench_compression [-q]
+ *******************************************************************************/
+
+#include "MQTTCompression.h"
+#include "Bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static const int MAX_PAYLOAD = 16384;
+
+static char json[MAX_PAYLOAD];
+static unsigned char compressed[MAX_PAYLOAD + 64];
+static unsigned char decompressed[MAX_PAYLOAD];
+
+
+static void fail(const char* what)
+{
+    printf("%s failed\n", what);
+    exit(1);
+}
+
+
+// readings of the device's sensors, as a JSON object, or an array of them
+static int telemetry(int readings)
+{
+    int len = 0;
+
+    srand(1);
+    if (readings > 1)
+        json[len++] = '[';
+    for (int i = 0; i < readings; ++i)
+    {
+        len += snprintf(&json[len], sizeof(json) - len,
+            "%s{\"device\":\"sensor-%04d\",\"ts\":%lld,\"temp\":%.2f,\"humidity\":%.1f,\"battery\":%.2f,\"rssi\":%d,\"status\":\"%s\"}",
+            (i > 0) ? "," : "", 42, 1760000000000LL + i * 1000LL, 18 + (rand() % 600) / 100.0, 40 + (rand() % 200) / 10.0,
+            3.5 + (rand() % 50) / 100.0, -60 - rand() % 30, (rand() % 16) ? "ok" : "low battery");
+    }
+    if (readings > 1)
+        json[len++] = ']';
+    return len;
+}
+
+
+static void run(const char* codecName, const MQTT::Codec& codec, int count, int readings)
+{
+    int len = telemetry(readings);
+    int clen = 0;
+    long long compressCpu, decompressCpu;
+    char name[64];
+
+    Bench::Latencies compression(count);
+    compressCpu = Bench::cpu_ns();
+    compression.begin();
+    for (int i = 0; i < count; ++i)
+    {
+        long long start = Bench::now_ns();
+        clen = MQTT::compressPayload(codec, (unsigned char*)json, len, compressed, sizeof(compressed));
+        compression.add(Bench::now_ns() - start);
+    }
+    compression.end();
+    compressCpu = Bench::cpu_ns() - compressCpu;
+    if (clen <= 0)
+        fail("compress");
+
+    Bench::Latencies decompression(count);
+    decompressCpu = Bench::cpu_ns();
+    decompression.begin();
+    for (int i = 0; i < count; ++i)
+    {
+        long long start = Bench::now_ns();
+        if (MQTT::decompressPayload(codec, compressed, clen, decompressed, sizeof(decompressed)) != len)
+            fail("decompress");
+        decompression.add(Bench::now_ns() - start);
+    }
+    decompression.end();
+    decompressCpu = Bench::cpu_ns() - decompressCpu;
+    if (memcmp(json, decompressed, len) != 0)
+        fail("round trip");
+
+    snprintf(name, sizeof(name), "%s compress %dB", codecName, len);
+    compression.report(name, "payloads");
+    snprintf(name, sizeof(name), "%s decompress %dB", codecName, len);
+    decompression.report(name, "payloads");
+    snprintf(name, sizeof(name), "%s %d reading%s", codecName, readings, (readings > 1) ? "s" : "");
+    printf("%-36s %5d -> %5d bytes, ratio %.2f, compress %.1f MB/s, decompress %.1f MB/s\n", name, len, clen,
+        (double)len / clen, (compressCpu > 0) ? (double)len * count * 1e3 / compressCpu : 0.0,
+        (decompressCpu > 0) ? (double)len * count * 1e3 / decompressCpu : 0.0);
+}
+
+
+int main(int argc, char* argv[])
+{
+    const int count = Bench::quick(argc, argv) ? 10 : 10000;
+    const int readings[] = {1, 4, 16, 64};
+
+    for (int r = 0; r < 4; ++r)
+    {
+        run("LZ4", MQTT::LZ4Codec, count, readings[r]);
+        run("deflate", MQTT::DeflateCodec, count, readings[r]);
+    }
+    return 0;
+}
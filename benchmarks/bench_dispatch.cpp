@@ -0,0 +1,220 @@
+/*******************************************************************************
+ * Matching incoming topic names against large numbers of subscriptions.  The first runs time the
+ * TopicTrie which MQTT::Client dispatches messages with, against a scan of every filter with the
+ * isTopicMatched function the client used before, for the same filters and topic names.  One filter
+ * in eight has a + or # wildcard.  The last runs time the whole of the client's handling of an
+ * incoming publication, from reading the packet to calling the handler, with 1 and 1024
+ * subscriptions.
+ *
+ *    bench_dispatch [-q]
+ *******************************************************************************/
+
+#define MQTTCLIENT_TOPIC_LEVELS 6
+
+#include "MQTTPosix.h"
+#include "MQTTLoopback.h"
+#include "MQTTClient.h"
+#include "Bench.h"
+
+#include <stdlib.h>
+
+static const int MAX_FILTERS = 4096;
+static const int DEVICES = 16;       // the devices at each site, so that filters share their first levels
+
+static char filters[MAX_FILTERS][32];
+static char names[1024][32];
+static int handlers[MAX_FILTERS];
+
+static MQTT::TopicTrie<MAX_FILTERS * MQTTCLIENT_TOPIC_LEVELS> trie;
+
+
+static void fail(const char* what)
+{
+    printf("%s failed\n", what);
+    exit(1);
+}
+
+
+// the topic filter matching of the client before the TopicTrie, checking one filter at a time
+static bool isTopicMatched(const char* topicFilter, const char* topicName, int len)
+{
+    const char* curf = topicFilter;
+    const char* curn = topicName;
+    const char* curn_end = curn + len;
+
+    while (*curf && curn < curn_end)
+    {
+        if (*curn == '/' && *curf != '/')
+            break;
+        if (*curf != '+' && *curf != '#' && *curf != *curn)
+            break;
+        if (*curf == '+')
+        {   // skip until we meet the next separator, or end of string
+            const char* nextpos = curn + 1;
+            while (nextpos < curn_end && *nextpos != '/')
+                nextpos = ++curn + 1;
+        }
+        else if (*curf == '#')
+            curn = curn_end - 1;    // skip until end of string
+        curf++;
+        curn++;
+    };
+
+    return (curn == curn_end) && (*curf == '\0');
+}
+
+
+static void makeFilters(int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        int site = i / DEVICES, device = i % DEVICES;
+
+        if (i % 16 == 7)
+            snprintf(filters[i], sizeof(filters[i]), "site/%d/+/%d/temp", site, device);
+        else if (i % 16 == 15)
+            snprintf(filters[i], sizeof(filters[i]), "site/%d/#", site);
+        else
+            snprintf(filters[i], sizeof(filters[i]), "site/%d/dev/%d/temp", site, device);
+    }
+}
+
+
+// topic names spread over the sites of the filters, each matching one or more of them
+static void makeNames(int filterCount)
+{
+    srand(1);
+    for (int i = 0; i < 1024; ++i)
+    {
+        int filter = rand() % filterCount;
+        snprintf(names[i], sizeof(names[i]), "site/%d/dev/%d/temp", filter / DEVICES, filter % DEVICES);
+    }
+}
+
+
+static int matchTrie(const char* name, int len)
+{
+    return trie.match(name, len, handlers, MAX_FILTERS);
+}
+
+
+static int matchScan(const char* name, int len, int filterCount)
+{
+    int count = 0;
+
+    for (int i = 0; i < filterCount; ++i)
+    {
+        if (isTopicMatched(filters[i], name, len))
+            handlers[count++] = i;
+    }
+    return count;
+}
+
+
+static void match(int count, int filterCount, bool useTrie)
+{
+    Bench::Latencies latencies(count);
+    char name[64];
+    int matched = 0;
+
+    latencies.begin();
+    for (int i = 0; i < count; ++i)
+    {
+        const char* topicName = names[i % 1024];
+        int len = strlen(topicName);
+        long long start = Bench::now_ns();
+
+        matched += useTrie ? matchTrie(topicName, len) : matchScan(topicName, len, filterCount);
+        latencies.add(Bench::now_ns() - start);
+    }
+    latencies.end();
+    if (matched < count)
+        fail("match");
+    snprintf(name, sizeof(name), "%s %d filters", useTrie ? "trie" : "scan", filterCount);
+    latencies.report(name, "matches");
+}
+
+
+static const int MAX_HANDLERS = 1024;
+
+typedef MQTTLoopback<4096, MAX_HANDLERS, 32> Network;
+typedef MQTT::Client<Network, Countdown, 200, MAX_HANDLERS, 1> Client;
+
+static int arrived = 0;
+
+void messageArrived(MQTT::MessageData&)
+{
+    ++arrived;
+}
+
+
+// feed the client publications as though from the broker, and time it handling each
+static void dispatch(int count, int filterCount)
+{
+    static Network network;
+    Client client(network);
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    unsigned char packet[64];
+    char name[64];
+
+    data.MQTTVersion = 4;
+    data.clientID.cstring = (char*)"bench";
+    if (network.connect() != 0 || client.connect(data) != MQTT::SUCCESS)
+        fail("connect");
+    for (int i = 0; i < filterCount; ++i)
+    {
+        if (client.subscribe(filters[i], MQTT::QOS0, messageArrived) != MQTT::SUCCESS)
+            fail("subscribe");
+    }
+
+    Bench::Latencies latencies(count);
+    latencies.begin();
+    for (int i = 0; i < count; ++i)
+    {
+        MQTTString topicName = MQTTString_initializer;
+        topicName.cstring = names[i % 1024];
+        int len = MQTTSerialize_publish(packet, sizeof(packet), 0, 0, 0, 0, topicName, (unsigned char*)"21.5", 4);
+        int expected = arrived + 1;
+        long long start = Bench::now_ns();
+
+        if (len <= 0 || network.inject(packet, len) != 0)
+            fail("inject");
+        while (arrived < expected)
+        {
+            if (client.step() < 0)
+                fail("step");
+        }
+        latencies.add(Bench::now_ns() - start);
+    }
+    latencies.end();
+    client.disconnect();
+    snprintf(name, sizeof(name), "dispatch %d subscriptions", filterCount);
+    latencies.report(name);
+}
+
+
+int main(int argc, char* argv[])
+{
+    const int count = Bench::quick(argc, argv) ? 100 : 100000;
+    const int filterCounts[] = {1024, 2048, MAX_FILTERS};
+
+    makeFilters(MAX_FILTERS);
+    for (int f = 0; f < 3; ++f)
+    {
+        trie.clear();
+        for (int i = 0; i < filterCounts[f]; ++i)
+        {
+            if (trie.add(filters[i], i) != 0)
+                fail("add");
+        }
+        makeNames(filterCounts[f]);
+        match(count, filterCounts[f], true);
+        match(count / 10, filterCounts[f], false);
+    }
+
+    makeNames(1);
+    dispatch(count, 1);
+    makeNames(MAX_HANDLERS);
+    dispatch(count, MAX_HANDLERS);
+    return 0;
+}
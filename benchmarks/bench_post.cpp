@@ -0,0 +1,155 @@
+/*******************************************************************************
+ * QoS 0 publishing from many threads at once, with post against publish behind one mutex.  One thread
+ * runs the client, stepping it in a loop, while 1, 2, 4, 8 or 16 producer threads publish through it:
+ * with post, into the client's lock-free queue, retrying while it is full, and otherwise by calling
+ * publish with a mutex held, which the client's thread also holds while stepping.  The network is the
+ * in-memory loopback broker, so that the times are those of the threads' contention, and the rate is
+ * of messages the broker has received.  The latencies are of the producers' post or publish calls.
+ * The threads only contend with as many processors as there are threads.
+ *
+ *    bench_post [-q]
+ *******************************************************************************/
+
+#define MQTTCLIENT_POST_QUEUE_SLOTS 1024
+
+#include "MQTTPosix.h"
+#include "MQTTPosixThread.h"
+#include "MQTTLoopback.h"
+#include "MQTTClient.h"
+#include "Bench.h"
+
+#include <atomic>
+#include <sched.h>
+#include <stdlib.h>
+
+static const int MAX_PRODUCERS = 16;
+
+typedef MQTTLoopback<4096> Network;
+typedef MQTT::Client<Network, Countdown, 100> Client;
+
+static Network network;
+static Client client(network);
+static PosixMutex mutex;
+
+static std::atomic<bool> go;
+static bool posting;
+static int total;       // messages to publish in the run
+static int received;    // by the broker before the run
+static std::vector<long long> samples[MAX_PRODUCERS];
+
+
+static void fail(const char* what)
+{
+    printf("%s failed\n", what);
+    exit(1);
+}
+
+
+static void produce(void const* argument)
+{
+    std::vector<long long>& latencies = *(std::vector<long long>*)argument;
+    char payload[32];
+
+    memset(payload, 'x', sizeof(payload));
+    while (!go)
+        sched_yield();
+    for (size_t i = 0; i < latencies.size(); ++i)
+    {
+        long long start = Bench::now_ns();
+        if (posting)
+        {
+            int rc;
+            while ((rc = client.post("bench/post", payload, sizeof(payload))) == MQTT::BUFFER_OVERFLOW)
+                sched_yield();      // the queue is full
+            if (rc != MQTT::SUCCESS)
+                fail("post");
+        }
+        else
+        {
+            mutex.lock();
+            int rc = client.publish("bench/post", payload, sizeof(payload));
+            mutex.unlock();
+            if (rc != MQTT::SUCCESS)
+                fail("publish");
+        }
+        latencies[i] = Bench::now_ns() - start;
+    }
+}
+
+
+// run the client until the broker has received all the messages
+static void consume(void const* argument)
+{
+    bool done = false;
+
+    while (!go)
+        sched_yield();
+    while (!done)
+    {
+        if (!posting)
+            mutex.lock();
+        int rc = client.step();
+        done = (network.count(PUBLISH) - received >= total);
+        if (!posting)
+            mutex.unlock();
+        if (rc < 0)
+            fail("step");
+        if (rc == 0)
+            sched_yield();  // let the producers in
+    }
+}
+
+
+static void run(int count, int producers, bool post)
+{
+    Bench::Latencies latencies(count);
+    PosixThread* threads[MAX_PRODUCERS];
+    char name[64];
+
+    go = false;
+    posting = post;
+    total = count / producers * producers;
+    received = network.count(PUBLISH);
+    for (int i = 0; i < producers; ++i)
+    {
+        samples[i].assign(count / producers, 0);
+        threads[i] = new PosixThread(produce, &samples[i]);
+    }
+    PosixThread* io = new PosixThread(consume);
+
+    latencies.begin();
+    go = true;
+    for (int i = 0; i < producers; ++i)
+        delete threads[i];      // joins it
+    delete io;
+    latencies.end();
+
+    for (int i = 0; i < producers; ++i)
+    {
+        for (size_t j = 0; j < samples[i].size(); ++j)
+            latencies.add(samples[i][j]);
+    }
+    snprintf(name, sizeof(name), "%s qos0 %d producers", post ? "post" : "publish with mutex", producers);
+    latencies.report(name);
+}
+
+
+int main(int argc, char* argv[])
+{
+    const int count = Bench::quick(argc, argv) ? 1600 : 1600000;
+    const int producers[] = {1, 2, 4, 8, MAX_PRODUCERS};
+
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = 4;
+    data.clientID.cstring = (char*)"bench";
+    if (network.connect() != 0 || client.connect(data) != MQTT::SUCCESS)
+        fail("connect");
+
+    for (int p = 0; p < 5; ++p)
+    {
+        run(count, producers[p], false);
+        run(count, producers[p], true);
+    }
+    client.disconnect();
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*******************************************************************************
+ * Latency of MQTT::Reactor as the number of clients it drives grows.  Each client has a TCP connection
+ * of its own to the loopback broker, and is subscribed to the topic it publishes to.  A client chosen
+ * at random publishes, and the time is from the publish call to the message handler being called,
+ * through the reactor waking for the one connection with data.  For comparison, the same is timed
+ * without the reactor, stepping every client in turn until the message arrives, which costs in
+ * proportion to the number of clients.
+ *
+ *    bench_reactor [-q]
+ *******************************************************************************/
+
+#include "MQTTPosixSocket.h"
+#include "MQTTClient.h"
+#include "MQTTReactor.h"
+#include "LoopbackServer.h"
+#include "Bench.h"
+
+#include <stdlib.h>
+
+static const int MAX_CLIENTS = 1000;
+
+typedef MQTT::Client<MQTTPosixSocket, Countdown, 200, 1, 1> Client;
+typedef MQTT::Reactor<Client, MQTT::EpollPoller, MAX_CLIENTS> Reactor;
+
+static MQTTPosixSocket networks[MAX_CLIENTS];
+static Client* clients[MAX_CLIENTS];
+static MQTT::EpollPoller poller;
+static Reactor reactor(poller);
+static int arrived = 0;
+
+void messageArrived(MQTT::MessageData&)
+{
+    ++arrived;
+}
+
+
+static void fail(const char* what)
+{
+    printf("%s failed\n", what);
+    exit(1);
+}
+
+
+static void connect(int port, int clientCount)
+{
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    char clientID[16];
+
+    data.MQTTVersion = 4;
+    for (int i = 0; i < clientCount; ++i)
+    {
+        snprintf(clientID, sizeof(clientID), "bench%d", i);
+        data.clientID.cstring = clientID;
+        clients[i] = new Client(networks[i]);
+        if (networks[i].connect("127.0.0.1", port) != 0 || clients[i]->connect(data) != MQTT::SUCCESS)
+            fail("connect");
+        if (clients[i]->subscribe("bench/reactor", MQTT::QOS0, messageArrived) != MQTT::SUCCESS)
+            fail("subscribe");
+    }
+}
+
+
+static void disconnect(int clientCount)
+{
+    for (int i = 0; i < clientCount; ++i)
+    {
+        clients[i]->disconnect();
+        networks[i].disconnect();
+        delete clients[i];
+    }
+}
+
+
+static void publish(int i)
+{
+    if (clients[i]->publish("bench/reactor", (void*)"21.5", 4, MQTT::QOS0) != MQTT::SUCCESS)
+        fail("publish");
+}
+
+
+static void react(int count, int clientCount)
+{
+    Bench::Latencies latencies(count);
+    char name[64];
+
+    latencies.begin();
+    for (int n = 0; n < count; ++n)
+    {
+        int expected = arrived + 1;
+        long long start = Bench::now_ns();
+
+        publish(rand() % clientCount);
+        while (arrived < expected)
+        {
+            if (reactor.run(1000) < 0)
+                fail("reactor");
+        }
+        latencies.add(Bench::now_ns() - start);
+    }
+    latencies.end();
+    snprintf(name, sizeof(name), "reactor %d clients", clientCount);
+    latencies.report(name);
+}
+
+
+static void poll(int count, int clientCount)
+{
+    Bench::Latencies latencies(count);
+    char name[64];
+
+    latencies.begin();
+    for (int n = 0; n < count; ++n)
+    {
+        int expected = arrived + 1;
+        long long start = Bench::now_ns();
+
+        publish(rand() % clientCount);
+        while (arrived < expected)
+        {
+            for (int i = 0; i < clientCount; ++i)
+            {
+                if (clients[i]->step() < 0)
+                    fail("step");
+            }
+        }
+        latencies.add(Bench::now_ns() - start);
+    }
+    latencies.end();
+    snprintf(name, sizeof(name), "step each of %d clients", clientCount);
+    latencies.report(name);
+}
+
+
+int main(int argc, char* argv[])
+{
+    const int count = Bench::quick(argc, argv) ? 100 : 20000;
+    const int clientCounts[] = {1, 100, MAX_CLIENTS};
+
+    srand(1);
+    for (int c = 0; c < 3; ++c)
+    {
+        LoopbackServer<2048, 1> server;
+        int port = server.start();
+
+        if (port < 0)
+            fail("listen");
+        connect(port, clientCounts[c]);
+        for (int i = 0; i < clientCounts[c]; ++i)
+        {
+            if (reactor.add(*clients[i], networks[i]) != MQTT::SUCCESS)
+                fail("add");
+        }
+        react(count, clientCounts[c]);
+        for (int i = 0; i < clientCounts[c]; ++i)
+            reactor.remove(*clients[i]);
+        poll(count / 10, clientCounts[c]);
+        disconnect(clientCounts[c]);
+    }
+    return 0;
+}
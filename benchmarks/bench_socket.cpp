@@ -0,0 +1,100 @@
+/*******************************************************************************
+ * Round trip times of MQTT::Client over MQTTPosixSocket, to a loopback broker behind a TCP socket on
+ * the same host.  The client waits for each acknowledgement in poll(), so it wakes as soon as the
+ * response arrives, and the times are those of the TCP loopback rather than of any polling interval.
+ *
+ *    bench_socket [-q]
+ *******************************************************************************/
+
+#define MQTTCLIENT_QOS2 1
+
+#include "MQTTPosixSocket.h"
+#include "MQTTClient.h"
+#include "LoopbackServer.h"
+#include "Bench.h"
+
+#include <stdlib.h>
+
+static const int MAX_PAYLOAD = 4096;
+
+typedef MQTT::Client<MQTTPosixSocket, Countdown, MAX_PAYLOAD + 100> Client;
+
+static char payload[MAX_PAYLOAD];
+
+void messageArrived(MQTT::MessageData&)
+{
+}
+
+
+static void fail(const char* what)
+{
+    printf("%s failed\n", what);
+    exit(1);
+}
+
+
+// time blocking publishes, which return when the last acknowledgement has arrived
+static void publish(Client& client, int count, int size, MQTT::QoS qos)
+{
+    Bench::Latencies latencies(count);
+    char name[64];
+
+    latencies.begin();
+    for (int i = 0; i < count; ++i)
+    {
+        long long start = Bench::now_ns();
+        if (client.publish("bench/socket", payload, size, qos) != MQTT::SUCCESS)
+            fail("publish");
+        latencies.add(Bench::now_ns() - start);
+    }
+    latencies.end();
+    snprintf(name, sizeof(name), "publish qos%d %dB round trip", qos, size);
+    latencies.report(name);
+}
+
+
+// subscribe to the same filter again and again, which the broker replaces each time
+static void subscribe(Client& client, int count)
+{
+    Bench::Latencies latencies(count);
+
+    latencies.begin();
+    for (int i = 0; i < count; ++i)
+    {
+        long long start = Bench::now_ns();
+        if (client.subscribe("bench/socket/sub", MQTT::QOS1, messageArrived) != MQTT::SUCCESS)
+            fail("subscribe");
+        latencies.add(Bench::now_ns() - start);
+    }
+    latencies.end();
+    latencies.report("subscribe round trip", "subs");
+}
+
+
+int main(int argc, char* argv[])
+{
+    const int count = Bench::quick(argc, argv) ? 100 : 20000;
+    const int sizes[] = {16, 256, 1024, MAX_PAYLOAD};
+    LoopbackServer<> server;
+    MQTTPosixSocket network;
+    Client client(network);
+    int port = server.start();
+
+    memset(payload, 'x', sizeof(payload));
+    if (port < 0 || network.connect("127.0.0.1", port) != 0)
+        fail("TCP connect");
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = 4;
+    data.clientID.cstring = (char*)"bench";
+    if (client.connect(data) != MQTT::SUCCESS)
+        fail("connect");
+
+    for (int s = 0; s < 4; ++s)
+        publish(client, count, sizes[s], MQTT::QOS1);
+    publish(client, count, sizes[1], MQTT::QOS2);
+    subscribe(client, count);
+
+    client.disconnect();
+    network.disconnect();
+    return 0;
+}
@@ -0,0 +1,167 @@
+/*******************************************************************************
+ * Cost of the outbound message store to QoS 1 publishing.  MQTT::Client publishes through the
+ * in-memory loopback broker with up to 16 messages inflight, to NullStore, RamStore and FileStore in
+ * turn, so that the differences between the runs are those of the stores.  Each publishAsync call is
+ * timed, including any wait for room in the window.  The runs count the commits which had puts to
+ * make durable, which for FileStore are its fdatasync calls, to show how many messages each sync
+ * covers.  The FileStore runs call compact every 1024 messages, as an application would between
+ * yields, and time those calls too.
+ *
+ *    bench_store [-q]
+ *******************************************************************************/
+
+#include "MQTTPosix.h"
+#include "MQTTLoopback.h"
+#include "MQTTClient.h"
+#include "MQTTStore.h"
+#include "MQTTFileStore.h"
+#include "Bench.h"
+
+#include <stdlib.h>
+
+static const int WINDOW = 16;
+static const int MAX_PAYLOAD = 1024;
+static const char* LOG = "bench_store.log";
+
+static char payload[MAX_PAYLOAD];
+
+
+static void fail(const char* what)
+{
+    printf("%s failed\n", what);
+    exit(1);
+}
+
+
+/**
+ * @class CountingStore
+ * @brief passes the calls on to a store, counting the commits which made puts durable
+ */
+template<class Store>
+class CountingStore
+{
+public:
+
+    CountingStore(Store& store) : store(store), changed(false), syncs(0)
+    {
+    }
+
+    int open() { return store.open(); }
+    int remove(unsigned short id) { return store.remove(id); }
+    int get(int index, unsigned short& id, int& len) { return store.get(index, id, len); }
+    int read(unsigned short id, int offset, unsigned char* buf, int len) { return store.read(id, offset, buf, len); }
+    void clear() { store.clear(); }
+
+    int put(unsigned short id, const unsigned char* header, int headerlen, const unsigned char* payload, int payloadlen)
+    {
+        changed = true;
+        return store.put(id, header, headerlen, payload, payloadlen);
+    }
+
+    int commit()
+    {
+        int rc = store.commit();
+
+        if (rc == 0 && changed)
+        {
+            ++syncs;
+            changed = false;
+        }
+        return rc;
+    }
+
+    Store& store;
+    bool changed;
+    int syncs;
+
+};
+
+
+// only FileStore needs compacting
+template<class Store>
+static int compact(Store& store)
+{
+    return 0;
+}
+
+
+template<int MAX_MESSAGES>
+static int compact(MQTT::FileStore<MAX_MESSAGES>& store)
+{
+    return store.compact();
+}
+
+
+template<class Store>
+static void publish(const char* storeName, Store& store, int count, int size, Bench::Latencies* compactions)
+{
+    typedef MQTTLoopback<16 * MAX_PAYLOAD> Network;
+    typedef MQTT::Client<Network, Countdown, MAX_PAYLOAD + 100, 1, WINDOW, CountingStore<Store> > Client;
+
+    Network network;
+    CountingStore<Store> counter(store);
+    Client client(network, counter);
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    Bench::Latencies latencies(count);
+    unsigned short id;
+    char name[64];
+
+    data.MQTTVersion = 4;
+    data.clientID.cstring = (char*)"bench";
+    data.cleansession = 0;      // or the store isn't used
+    if (network.connect() != 0 || client.connect(data) != MQTT::SUCCESS)
+        fail("connect");
+
+    latencies.begin();
+    for (int i = 0; i < count; ++i)
+    {
+        long long start = Bench::now_ns();
+        if (client.publishAsync("bench/store", payload, size, id, MQTT::QOS1) != MQTT::SUCCESS)
+            fail("publish");
+        latencies.add(Bench::now_ns() - start);
+        if (compactions && i % 1024 == 1023)
+        {
+            start = Bench::now_ns();
+            if (compact(store) != 0)
+                fail("compact");
+            compactions->add(Bench::now_ns() - start);
+        }
+    }
+    while (client.inflightCount() > 0)
+    {
+        if (client.step() < 0)
+            fail("step");
+    }
+    latencies.end();
+    client.disconnect();
+
+    snprintf(name, sizeof(name), "%s %dB, %.1f msgs/commit", storeName, size, counter.syncs ? (double)count / counter.syncs : 0.0);
+    latencies.report(name);
+}
+
+
+int main(int argc, char* argv[])
+{
+    const int count = Bench::quick(argc, argv) ? 100 : 100000;
+    const int sizes[] = {64, MAX_PAYLOAD};
+
+    memset(payload, 'x', sizeof(payload));
+    for (int s = 0; s < 2; ++s)
+    {
+        MQTT::NullStore nullStore;
+        publish("NullStore", nullStore, count, sizes[s], 0);
+
+        static MQTT::RamStore<WINDOW * (MAX_PAYLOAD + 100), WINDOW> ramStore;
+        publish("RamStore", ramStore, count, sizes[s], 0);
+
+        unlink(LOG);
+        MQTT::FileStore<WINDOW> fileStore(LOG);
+        Bench::Latencies compactions(count / 1024 + 1);
+        compactions.begin();
+        publish("FileStore", fileStore, count / 10, sizes[s], &compactions);
+        compactions.end();
+        compactions.report("FileStore compact", "calls");
+    }
+    unlink(LOG);
+    return 0;
+}
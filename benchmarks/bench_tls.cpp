@@ -0,0 +1,182 @@
+/*******************************************************************************
+ * The cost of a full TLS handshake by MQTTTLSNetwork, against one resuming the previous session.
+ * Reports the handshakes a second, their latency, and the client's processor time and bytes each
+ * took.  Resumption sends no certificate and does no public key operations, so it should cost a
+ * fraction of a full handshake in all three, if the server allows it.  The server is TLSLoopbackServer
+ * in this process, unless one is given on the command line.  With the stand-in, an MQTT connect and
+ * QoS 1 publish over TLS is made as well, to check the records carry the client's packets both ways.
+ *
+ *    bench_tls [-q] [hostname port ca-file]
+ *******************************************************************************/
+
+#include "MQTTPosix.h"
+#include "MQTTPosixSocket.h"
+#include "MQTTTLSNetwork.h"
+#include "MQTTClient.h"
+#include "TLSLoopbackServer.h"
+#include "Bench.h"
+
+#include <stdlib.h>
+
+// counts the bytes carried by the network it wraps
+template<class Network>
+class CountingNetwork
+{
+public:
+
+    CountingNetwork(Network& network) : network(network), bytes(0)
+    {
+    }
+
+    int connect(const char* hostname, int port, int timeout=1000)
+    {
+        return network.connect(hostname, port, timeout);
+    }
+
+    int read(unsigned char* buffer, int len, int timeout)
+    {
+        int rc = network.read(buffer, len, timeout);
+        if (rc > 0)
+            bytes += rc;
+        return rc;
+    }
+
+    int write(unsigned char* buffer, int len, int timeout)
+    {
+        int rc = network.write(buffer, len, timeout);
+        if (rc > 0)
+            bytes += rc;
+        return rc;
+    }
+
+    int disconnect()
+    {
+        return network.disconnect();
+    }
+
+    Network& network;
+    long long bytes;
+
+};
+
+typedef CountingNetwork<MQTTPosixSocket> Network;
+typedef MQTTTLSNetwork<Network, Countdown> TLSNetwork;
+
+
+static void handshakes(TLSNetwork& tls, Network& counter, const char* hostname, int port, int count, bool resume)
+{
+    Bench::Latencies latencies(count);
+    long long cpu = Bench::cpu_ns();
+    long long bytes = counter.bytes;
+    char name[64];
+
+    if (resume && tls.connect(hostname, port, 5000) == 0)    // so there is a session to resume
+        tls.disconnect();
+    bytes = counter.bytes;
+    cpu = Bench::cpu_ns();
+    latencies.begin();
+    for (int i = 0; i < count; ++i)
+    {
+        if (!resume)
+            tls.forgetSession();
+        long long start = Bench::now_ns();
+        if (tls.connect(hostname, port, 5000) != 0)
+        {
+            printf("TLS connect failed\n");
+            exit(1);
+        }
+        latencies.add(Bench::now_ns() - start);
+        tls.disconnect();
+    }
+    latencies.end();
+    snprintf(name, sizeof(name), "%s handshake", resume ? "resumed" : "full");
+    latencies.report(name, "handshakes");
+    printf("%-36s %8.0f us cpu  %8lld bytes each\n", "", (Bench::cpu_ns() - cpu) / 1e3 / count, (counter.bytes - bytes) / count);
+}
+
+
+static void messageArrived(MQTT::MessageData&)
+{
+}
+
+
+// connect to the broker behind the stand-in over TLS, and publish a message to it at QoS 1
+static void publish(TLSNetwork& tls, int port)
+{
+    MQTT::Client<TLSNetwork, Countdown> client(tls);
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    char payload[] = "hello";
+
+    data.MQTTVersion = 4;
+    data.clientID.cstring = (char*)"bench_tls";
+    if (tls.connect("localhost", port, 5000) != 0 || client.connect(data) != MQTT::SUCCESS ||
+        client.subscribe("bench/tls", MQTT::QOS1, messageArrived) != MQTT::SUCCESS ||
+        client.publish("bench/tls", payload, strlen(payload), MQTT::QOS1) != MQTT::SUCCESS)
+    {
+        printf("MQTT over TLS failed\n");
+        exit(1);
+    }
+    client.disconnect();
+    tls.disconnect();
+}
+
+
+int main(int argc, char* argv[])
+{
+    const bool quick = Bench::quick(argc, argv);
+    const int count = quick ? 10 : 500;
+    const char* args[3];
+    int argCount = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-q") != 0 && argCount < 3)
+            args[argCount++] = argv[i];
+    }
+    if (argCount != 0 && argCount != 3)
+    {
+        printf("usage: bench_tls [-q] [hostname port ca-file]\n");
+        return 1;
+    }
+
+    static unsigned char ca[16384];
+    static TLSLoopbackServer<> server;     // the mbed TLS contexts can be too big for the stack
+    const char* hostname = "localhost";
+    size_t calen = 0;
+    int port = 0;
+
+    if (argCount == 0)
+    {
+        if ((port = server.start()) < 0)
+        {
+            printf("starting the TLS server failed\n");
+            return 1;
+        }
+        calen = strlen(TLSLoopbackServer<>::certificate());
+        memcpy(ca, TLSLoopbackServer<>::certificate(), calen);
+    }
+    else
+    {
+        FILE* f = fopen(args[2], "rb");
+        if (f == 0)
+        {
+            printf("unable to read %s\n", args[2]);
+            return 1;
+        }
+        hostname = args[0];
+        port = atoi(args[1]);
+        calen = fread(ca, 1, sizeof(ca) - 1, f);
+        fclose(f);
+    }
+    ca[calen++] = '\0';     // PEM is parsed including the terminating null
+
+    MQTTPosixSocket socket;
+    Network counter(socket);
+    static TLSNetwork tls(counter, ca, calen);
+
+    handshakes(tls, counter, hostname, port, count, false);
+    handshakes(tls, counter, hostname, port, count, true);
+    if (argCount == 0)
+        publish(tls, port);
+    return 0;
+}
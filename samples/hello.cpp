@@ -0,0 +1,96 @@
+/*******************************************************************************
+ * Publishes to its own subscription at each QoS, through the in-memory loopback broker or, when
+ * a host name is given on the command line, through a real broker.  Exits with 0 if every message
+ * came back.
+ *
+ *    hello [hostname [port]]
+ *******************************************************************************/
+
+#define MQTTCLIENT_QOS2 1
+
+#include "MQTTPosixSocket.h"
+#include "MQTTLoopback.h"
+#include "MQTTClient.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int arrived = 0;
+
+void messageArrived(MQTT::MessageData& md)
+{
+    MQTT::Message &message = md.message;
+
+    printf("Message arrived: qos %d, retained %d, dup %d, packetid %d\n", message.qos, message.retained, message.dup, message.id);
+    printf("Payload %.*s\n", (int)message.payloadlen, (char*)message.payload);
+    ++arrived;
+}
+
+
+template<class Network>
+int hello(Network& network, const char* hostname, int port)
+{
+    MQTT::Client<Network, Countdown, 200, 5> client(network, 5000);
+    const char* topic = "hello/posix";
+    const MQTT::QoS levels[] = {MQTT::QOS0, MQTT::QOS1, MQTT::QOS2};
+    int expected = 0;
+    int rc;
+
+    if ((rc = network.connect(hostname, port)) != 0)
+    {
+        printf("rc from TCP connect is %d\n", rc);
+        return 1;
+    }
+
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = 4;
+    data.clientID.cstring = (char*)"hello-posix";
+    if ((rc = client.connect(data)) != 0)
+    {
+        printf("rc from MQTT connect is %d\n", rc);
+        return 1;
+    }
+
+    if ((rc = client.subscribe("hello/#", MQTT::QOS2, messageArrived)) != 0)
+    {
+        printf("rc from MQTT subscribe is %d\n", rc);
+        return 1;
+    }
+
+    for (int i = 0; i < 3; ++i)
+    {
+        char buf[100];
+        sprintf(buf, "Hello World!  QoS %d message", levels[i]);
+        if ((rc = client.publish(topic, (void*)buf, strlen(buf), levels[i])) != 0)
+        {
+            printf("rc from MQTT publish at QoS %d is %d\n", levels[i], rc);
+            return 1;
+        }
+        ++expected;
+        for (int tries = 0; arrived < expected && tries < 50; ++tries)
+            client.yield(100);
+    }
+
+    if ((rc = client.unsubscribe("hello/#")) != 0)
+        printf("rc from MQTT unsubscribe is %d\n", rc);
+    if ((rc = client.disconnect()) != 0)
+        printf("rc from MQTT disconnect is %d\n", rc);
+    network.disconnect();
+
+    printf("%d of %d messages arrived\n", arrived, expected);
+    return (arrived == expected) ? 0 : 1;
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+    {
+        MQTTPosixSocket network;
+        return hello(network, argv[1], (argc > 2) ? atoi(argv[2]) : 1883);
+    }
+
+    MQTTLoopback<> network;
+    return hello(network, 0, 0);
+}
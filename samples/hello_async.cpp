@@ -0,0 +1,94 @@
+/*******************************************************************************
+ * The hello sample for MQTT::Async, using its blocking calls, which need no background thread.
+ * Runs through the in-memory loopback broker or, when a host name is given on the command line,
+ * a real broker.  Exits with 0 if the message came back.
+ *
+ *    hello_async [hostname [port]]
+ *******************************************************************************/
+
+#include "MQTTPosixSocket.h"
+#include "MQTTPosixThread.h"
+#include "MQTTLoopback.h"
+#include "MQTTAsync.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int arrived = 0;
+
+void messageArrived(MQTT::Message* message)
+{
+    printf("Message arrived: qos %d, retained %d, dup %d, packetid %d\n", message->qos, message->retained, message->dup, message->id);
+    printf("Payload %.*s\n", (int)message->payloadlen, (char*)message->payload);
+    ++arrived;
+}
+
+
+template<class Network>
+int hello(Network& network, const char* hostname, int port)
+{
+    typedef MQTT::Async<Network, Countdown, PosixThread, PosixMutex> Async;
+    static typename Async::template Storage<200, 5, 2> storage;
+    Async client(&network, storage, 5000);
+    const char* topic = "hello/async";
+    int rc;
+
+    if ((rc = network.connect(hostname, port)) != 0)
+    {
+        printf("rc from TCP connect is %d\n", rc);
+        return 1;
+    }
+
+    MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+    data.MQTTVersion = 4;
+    data.clientID.cstring = (char*)"hello-async";
+    if ((rc = client.connect(0, &data)) != 0)
+    {
+        printf("rc from MQTT connect is %d\n", rc);
+        return 1;
+    }
+
+    if ((rc = client.subscribe(0, topic, MQTT::QOS0, messageArrived)) != 0)
+    {
+        printf("rc from MQTT subscribe is %d\n", rc);
+        return 1;
+    }
+
+    char buf[100];
+    sprintf(buf, "Hello World!  QoS 1 message");
+    MQTT::Message message;
+    message.qos = MQTT::QOS1;
+    message.retained = false;
+    message.dup = false;
+    message.payload = (void*)buf;
+    message.payloadlen = strlen(buf);
+    if ((rc = client.publish(0, topic, &message)) != 0)
+    {
+        printf("rc from MQTT publish is %d\n", rc);
+        return 1;
+    }
+
+    // the blocking unsubscribe reads the publication on its way to the UNSUBACK
+    if ((rc = client.unsubscribe(0, topic)) != 0)
+        printf("rc from MQTT unsubscribe is %d\n", rc);
+    if ((rc = client.disconnect(0)) != 0)
+        printf("rc from MQTT disconnect is %d\n", rc);
+    network.disconnect();
+
+    printf("%d of 1 messages arrived\n", arrived);
+    return (arrived == 1) ? 0 : 1;
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+    {
+        MQTTPosixSocket network;
+        return hello(network, argv[1], (argc > 2) ? atoi(argv[2]) : 1883);
+    }
+
+    MQTTLoopback<> network;
+    return hello(network, 0, 0);
+}
@@ -0,0 +1,45 @@
+/*
+ * Prints the trace records read from a client with readTrace, and saved to a file as they were
+ * copied out, on a machine of the same byte order.
+ *
+ *    MQTTTraceDecode tracefile
+ */
+
+#include <stdio.h>
+#include "../MQTTTrace.h"
+
+static const char* events[] = {"?", "SEND", "SEND_FAILED", "RECEIVE", "RECEIVE_FAILED", "PING_TIMEOUT", "QOS2_FULL"};
+
+static const char* packets[] = {"-", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL",
+    "PUBCOMP", "SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT", "?"};
+
+int main(int argc, char** argv)
+{
+    MQTT::TraceRecord record;
+    uint32_t first = 0;
+    int count = 0;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s tracefile\n", argv[0]);
+        return 1;
+    }
+    FILE* f = fopen(argv[1], "rb");
+    if (f == 0)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    printf("%12s  %-14s  %-11s  %5s  %8s\n", "usec", "event", "packet", "id", "length");
+    while (fread(&record, sizeof(record), 1, f) == 1)
+    {
+        if (count++ == 0)
+            first = record.timestamp;
+        printf("%12lu  %-14s  %-11s  %5u  %8ld\n", (unsigned long)(uint32_t)(record.timestamp - first),
+            (record.event < sizeof(events) / sizeof(events[0])) ? events[record.event] : "?",
+            packets[record.packet_type & 15], record.packet_id, (long)record.length);
+    }
+    fclose(f);
+    return 0;
+}